@@ -0,0 +1,941 @@
+#pragma once
+
+#include <ns.h>
+#include <memtable.h>
+#include <epoch.h>
+#include <mutex>
+
+namespace KVSTORE_NS::memtable
+{
+
+// An adaptive radix tree index, as presented in
+// V. Leis, A. Kemper, T. Neumann, The Adaptive Radix Tree: ARTful Indexing for Main-Memory Databases (ICDE 2013)
+// Inner nodes branch on a single key byte, and grow through 4, 16, 48 and 256 children as they fill,
+// while runs of bytes shared by every key below a node are collapsed into the node's prefix.
+// Keys sharing long structured prefixes ("tenant/object/field") therefore share their inner nodes,
+// and lookups take one step per distinguishing byte, rather than one per skiplist level.
+//
+// Concurrency uses optimistic lock coupling, from
+// V. Leis, F. Scheibner, A. Kemper, T. Neumann, The ART of Practical Synchronization (DaMoN 2016)
+// Readers never write shared memory: they read a node's version, read the node, and restart if the version changed.
+// Writers lock only the node they modify (and its parent, when the node is replaced).
+// Nodes are never modified in a way that would invalidate a concurrent reader's memory: prefixes are immutable,
+// and a node that must grow or change prefix is replaced by a new copy, with the old node retired to an epoch reclaimer
+// (see "epoch.h"), which frees it once no reader can still hold it. Every traversal holds an epoch guard, so a reader
+// holding a stale pointer always reads valid (if outdated) memory before restarting.
+// A table without a reclaimer keeps its replaced nodes until the index is cleared.
+// Leaves hold no copy of their key, but view the key stored with the leaf's first record.
+struct art_table : table
+{
+    art_table(config_opts const & opts, write_buffer_manager * budget = nullptr, epoch::reclaimer * reclaimer = nullptr) :
+        table(opts, budget), root(new node256({})), reclaimer(reclaimer) {}
+
+    ~art_table() override
+    {
+        this->release_nodes();
+        free_inner(this->root);
+    }
+
+    entry const * lower_bound(std::string_view key) const override
+    {
+        epoch::guard guard{};
+        entry const * e{};
+        while (!this->try_bound(this->root, key, 0, false, e)) {}
+        return e;
+    }
+
+    entry const * next(entry const * e) const override
+    {
+        epoch::guard guard{};
+        entry const * n{};
+        while (!this->try_bound(this->root, e->key, 0, true, n)) {}
+        return n;
+    }
+
+    entry const * before(std::optional<std::string_view> key) const override
+    {
+        epoch::guard guard{};
+        entry const * e{};
+        if (key) { while (!this->try_before(this->root, *key, 0, e)) {} }
+        else
+        {
+            uint64_t v{};
+            while (!this->root->read_lock(v) || !this->try_max(this->root, v, e)) {}
+        }
+
+        return e;
+    }
+
+    void write_claimed(int32_t first, std::span<batch_entry const> batch, entry const ** inserted = nullptr) override
+    {
+        auto link = [this](std::string_view k, int32_t idx) { return this->link_leaf(k, idx); };
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            batch_entry const & item = batch[i];
+            entry const * e = this->fill_record(first + static_cast<int32_t>(i), item.key, item.data, item.size, item.type, item.sequence, link);
+            assert(e);
+            if (inserted) { inserted[i] = e; }
+        }
+    }
+
+protected:
+    entry const * insert_entry(std::string_view key, void * data, size_t size, value_type type, write_sequence const & sequence) override
+    {
+        return this->insert_record(key, data, size, type, sequence, [this](std::string_view k, int32_t idx) {
+            return this->link_leaf(k, idx);
+        });
+    }
+
+    entry const * find_entry(std::string_view key) const override
+    {
+        epoch::guard guard{};
+        entry const * e{};
+        while (!this->try_find(key, e)) {}
+        return e;
+    }
+
+    void clear_index() override
+    {
+        this->release_nodes();
+        free_inner(this->root);
+        this->root = new node256({});
+    }
+
+private:
+    // Leaves are the table entries themselves, viewing their key in the record buffer
+    struct leaf : entry
+    {
+        using entry::entry;
+    };
+
+    // A child reference: either a leaf or an inner node, distinguished by the low bit
+    using ref = uintptr_t;
+    static constexpr ref LEAF_BIT{1};
+
+    struct inner;
+    static bool is_leaf(ref r) { return r & LEAF_BIT; }
+    static ref leaf_ref(leaf * l) { return reinterpret_cast<ref>(l) | LEAF_BIT; }
+    static ref inner_ref(inner * n) { return reinterpret_cast<ref>(n); }
+    static leaf * as_leaf(ref r) { return reinterpret_cast<leaf *>(r & ~LEAF_BIT); }
+    static inner * as_inner(ref r) { return reinterpret_cast<inner *>(r); }
+
+    enum class kind : uint8_t
+    {
+        n4,
+        n16,
+        n48,
+        n256,
+    };
+
+    // The header shared by all inner nodes
+    struct inner
+    {
+        inner(kind t, std::string_view p) : type(t), prefix(p) {}
+
+        static constexpr uint64_t OBSOLETE{0b01};
+        static constexpr uint64_t LOCKED{0b10};
+
+        // returns false if the node is locked or obsolete, in which case the caller must restart
+        bool read_lock(uint64_t & v) const
+        {
+            v = this->version.load(std::memory_order_acquire);
+            return !(v & (LOCKED | OBSOLETE));
+        }
+
+        // returns false if the node has changed since "read_lock" returned "v"
+        bool validate(uint64_t v) const
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return this->version.load(std::memory_order_relaxed) == v;
+        }
+
+        // takes the write lock, iff the node is unchanged since "read_lock" returned "v"
+        bool upgrade(uint64_t v) { return this->version.compare_exchange_strong(v, v + LOCKED); }
+
+        void write_unlock() { this->version.fetch_add(LOCKED, std::memory_order_release); }
+
+        // unlocks the node, and marks it as replaced - readers will restart rather than use it
+        void write_unlock_obsolete() { this->version.fetch_add(LOCKED | OBSOLETE, std::memory_order_release); }
+
+        std::atomic<uint64_t> version{};
+        kind const type;
+        std::atomic<uint16_t> count{};
+        // the bytes shared by all keys below this node, after the byte that selected it. Immutable.
+        std::string const prefix;
+        // the leaf whose key ends exactly at this node (i.e. after the prefix), if any
+        std::atomic<leaf *> value{};
+    };
+
+    // 4 and 16 children, held with their key bytes in ascending order
+    template <size_t N, kind K>
+    struct node_sorted : inner
+    {
+        explicit node_sorted(std::string_view p) : inner(K, p) {}
+        static constexpr size_t CAPACITY{N};
+        std::array<std::atomic<uint8_t>, N> keys{};
+        std::array<std::atomic<ref>, N> children{};
+    };
+
+    using node4 = node_sorted<4, kind::n4>;
+    using node16 = node_sorted<16, kind::n16>;
+
+    // 48 children, with a 256 entry index from key byte to child slot (plus one, zero is empty)
+    struct node48 : inner
+    {
+        explicit node48(std::string_view p) : inner(kind::n48, p) {}
+        static constexpr size_t CAPACITY{48};
+        std::array<std::atomic<uint8_t>, 256> index{};
+        std::array<std::atomic<ref>, CAPACITY> children{};
+    };
+
+    // a child slot for every key byte
+    struct node256 : inner
+    {
+        explicit node256(std::string_view p) : inner(kind::n256, p) {}
+        static constexpr size_t CAPACITY{256};
+        std::array<std::atomic<ref>, CAPACITY> children{};
+    };
+
+    static size_t capacity(inner const * n)
+    {
+        switch (n->type)
+        {
+            case kind::n4: return node4::CAPACITY;
+            case kind::n16: return node16::CAPACITY;
+            case kind::n48: return node48::CAPACITY;
+            case kind::n256: return node256::CAPACITY;
+        }
+
+        return 0;
+    }
+
+    static size_t node_size(kind k)
+    {
+        switch (k)
+        {
+            case kind::n4: return sizeof(node4);
+            case kind::n16: return sizeof(node16);
+            case kind::n48: return sizeof(node48);
+            case kind::n256: return sizeof(node256);
+        }
+
+        return 0;
+    }
+
+    static void free_inner(inner * n)
+    {
+        switch (n->type)
+        {
+            case kind::n4: delete static_cast<node4 *>(n); break;
+            case kind::n16: delete static_cast<node16 *>(n); break;
+            case kind::n48: delete static_cast<node48 *>(n); break;
+            case kind::n256: delete static_cast<node256 *>(n); break;
+        }
+    }
+
+    // returns the child for key byte "b", or 0 if there is none
+    static ref find_child(inner const * n, uint8_t b)
+    {
+        switch (n->type)
+        {
+            case kind::n4: return find_sorted(static_cast<node4 const *>(n), b);
+            case kind::n16: return find_sorted(static_cast<node16 const *>(n), b);
+            case kind::n48:
+            {
+                auto nn = static_cast<node48 const *>(n);
+                uint8_t const slot = nn->index[b];
+                return slot ? nn->children[slot - 1].load() : ref{};
+            }
+            case kind::n256: return static_cast<node256 const *>(n)->children[b];
+        }
+
+        return {};
+    }
+
+    template <typename N>
+    static ref find_sorted(N const * n, uint8_t b)
+    {
+        size_t const count = std::min<size_t>(n->count, N::CAPACITY);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (n->keys[i] == b) { return n->children[i]; }
+        }
+
+        return {};
+    }
+
+    // finds the child with the smallest key byte not less than "b".
+    // returns false if there is none, otherwise sets "out_b" and "out" to that child.
+    static bool next_child(inner const * n, unsigned b, uint8_t & out_b, ref & out)
+    {
+        switch (n->type)
+        {
+            case kind::n4: return next_sorted(static_cast<node4 const *>(n), b, out_b, out);
+            case kind::n16: return next_sorted(static_cast<node16 const *>(n), b, out_b, out);
+            case kind::n48:
+            {
+                auto nn = static_cast<node48 const *>(n);
+                for (; b < 256; b++)
+                {
+                    uint8_t const slot = nn->index[b];
+                    if (slot)
+                    {
+                        out_b = b;
+                        out = nn->children[slot - 1];
+                        return out != 0;
+                    }
+                }
+
+                return false;
+            }
+            case kind::n256:
+            {
+                auto nn = static_cast<node256 const *>(n);
+                for (; b < 256; b++)
+                {
+                    if ((out = nn->children[b]))
+                    {
+                        out_b = b;
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+        }
+
+        return false;
+    }
+
+    template <typename N>
+    static bool next_sorted(N const * n, unsigned b, uint8_t & out_b, ref & out)
+    {
+        size_t const count = std::min<size_t>(n->count, N::CAPACITY);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (n->keys[i] >= b)
+            {
+                out_b = n->keys[i];
+                out = n->children[i];
+                return out != 0;
+            }
+        }
+
+        return false;
+    }
+
+    // finds the child with the largest key byte not greater than "b", as "next_child"
+    static bool prev_child(inner const * n, unsigned b, uint8_t & out_b, ref & out)
+    {
+        switch (n->type)
+        {
+            case kind::n4: return prev_sorted(static_cast<node4 const *>(n), b, out_b, out);
+            case kind::n16: return prev_sorted(static_cast<node16 const *>(n), b, out_b, out);
+            case kind::n48:
+            {
+                auto nn = static_cast<node48 const *>(n);
+                for (unsigned i = b + 1; i-- > 0;)
+                {
+                    uint8_t const slot = nn->index[i];
+                    if (slot)
+                    {
+                        out_b = i;
+                        out = nn->children[slot - 1];
+                        return out != 0;
+                    }
+                }
+
+                return false;
+            }
+            case kind::n256:
+            {
+                auto nn = static_cast<node256 const *>(n);
+                for (unsigned i = b + 1; i-- > 0;)
+                {
+                    if ((out = nn->children[i]))
+                    {
+                        out_b = i;
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+        }
+
+        return false;
+    }
+
+    template <typename N>
+    static bool prev_sorted(N const * n, unsigned b, uint8_t & out_b, ref & out)
+    {
+        size_t const count = std::min<size_t>(n->count, N::CAPACITY);
+        for (size_t i = count; i-- > 0;)
+        {
+            if (n->keys[i] <= b)
+            {
+                out_b = n->keys[i];
+                out = n->children[i];
+                return out != 0;
+            }
+        }
+
+        return false;
+    }
+
+    // Adds a child for a key byte not yet present. Requires the node to be write-locked (or unpublished), and not full.
+    static void add_child(inner * n, uint8_t b, ref r)
+    {
+        switch (n->type)
+        {
+            case kind::n4: add_sorted(static_cast<node4 *>(n), b, r); break;
+            case kind::n16: add_sorted(static_cast<node16 *>(n), b, r); break;
+            case kind::n48:
+            {
+                auto nn = static_cast<node48 *>(n);
+                uint16_t const slot = nn->count;
+                nn->children[slot] = r;
+                nn->index[b] = slot + 1;
+                break;
+            }
+            case kind::n256: static_cast<node256 *>(n)->children[b] = r; break;
+        }
+
+        n->count += 1;
+    }
+
+    template <typename N>
+    static void add_sorted(N * n, uint8_t b, ref r)
+    {
+        size_t pos = n->count;
+        while (pos > 0 && n->keys[pos - 1] > b)
+        {
+            n->keys[pos] = n->keys[pos - 1].load();
+            n->children[pos] = n->children[pos - 1].load();
+            pos -= 1;
+        }
+
+        n->keys[pos] = b;
+        n->children[pos] = r;
+    }
+
+    // Replaces the existing child for key byte "b". Requires the node to be write-locked.
+    static void change_child(inner * n, uint8_t b, ref r)
+    {
+        switch (n->type)
+        {
+            case kind::n4: change_sorted(static_cast<node4 *>(n), b, r); break;
+            case kind::n16: change_sorted(static_cast<node16 *>(n), b, r); break;
+            case kind::n48:
+            {
+                auto nn = static_cast<node48 *>(n);
+                nn->children[nn->index[b] - 1] = r;
+                break;
+            }
+            case kind::n256: static_cast<node256 *>(n)->children[b] = r; break;
+        }
+    }
+
+    template <typename N>
+    static void change_sorted(N * n, uint8_t b, ref r)
+    {
+        for (size_t i = 0; i < n->count; i++)
+        {
+            if (n->keys[i] == b)
+            {
+                n->children[i] = r;
+                return;
+            }
+        }
+
+        assert(false);
+    }
+
+    static inner * make_inner(kind k, std::string_view prefix)
+    {
+        switch (k)
+        {
+            case kind::n4: return new node4(prefix);
+            case kind::n16: return new node16(prefix);
+            case kind::n48: return new node48(prefix);
+            case kind::n256: return new node256(prefix);
+        }
+
+        return nullptr;
+    }
+
+    // copies the value and children of "n" into a new node of the given kind and prefix.
+    // Requires "n" to be write-locked.
+    static inner * copy_inner(inner const * n, kind k, std::string_view prefix)
+    {
+        inner * copy = make_inner(k, prefix);
+        copy->value = n->value.load();
+
+        uint8_t b{};
+        ref r{};
+        for (unsigned next = 0; next < 256 && next_child(n, next, b, r); next = b + 1u) { add_child(copy, b, r); }
+        return copy;
+    }
+
+    static kind grown(kind k)
+    {
+        switch (k)
+        {
+            case kind::n4: return kind::n16;
+            case kind::n16: return kind::n48;
+            default: return kind::n256;
+        }
+    }
+
+    // the number of bytes of "prefix" that match "key" from "depth"
+    static size_t matching(std::string_view prefix, std::string_view key, size_t depth)
+    {
+        size_t i = 0;
+        while (i < prefix.size() && depth + i < key.size() && prefix[i] == key[depth + i]) { i++; }
+        return i;
+    }
+
+    // a replaced node, freed once no concurrent reader can still hold it (or kept until the index is cleared, without a reclaimer).
+    // Requires an epoch guard, held since before the node was unlinked.
+    void retire(inner * n)
+    {
+        if (this->reclaimer)
+        {
+            this->account_retired(node_size(n->type) + heap_size(n->prefix));
+            this->reclaimer->retire([n] { free_inner(n); });
+            return;
+        }
+
+        std::lock_guard lock{this->retired_mutex};
+        this->retired.emplace_back(n);
+    }
+
+    // Links a leaf for "key", or returns the existing leaf for the key
+    std::pair<entry *, bool> link_leaf(std::string_view key, int32_t new_record_idx)
+    {
+        epoch::guard guard{};
+
+        // the leaf is allocated at most once, and kept across restarts
+        leaf * new_leaf{};
+        auto make = [&] {
+            if (!new_leaf) { new_leaf = new leaf(this, key, new_record_idx); }
+            return new_leaf;
+        };
+
+        std::pair<entry *, bool> result{};
+        while (!this->try_insert(key, make, result)) {}
+
+        if (!result.second) { delete new_leaf; }
+        else { this->account_index(sizeof(leaf)); }
+        return result;
+    }
+
+    // A single optimistic insert attempt. Returns false if it must be restarted.
+    template <typename Make>
+    bool try_insert(std::string_view key, Make & make, std::pair<entry *, bool> & result)
+    {
+        inner * parent{};
+        uint64_t pv{};
+        uint8_t parent_b{};
+
+        inner * n = this->root;
+        uint64_t v{};
+        if (!n->read_lock(v)) { return false; }
+
+        size_t depth = 0;
+        while (true)
+        {
+            std::string_view const prefix = n->prefix;
+            size_t const m = matching(prefix, key, depth);
+            if (m < prefix.size())
+            {
+                // the key diverges inside the prefix - insert a new node above this one, holding the shared part,
+                // and replace this node with a copy holding the remainder. The root has no prefix, so parent is set.
+                if (!parent->upgrade(pv)) { return false; }
+                if (!n->upgrade(v))
+                {
+                    parent->write_unlock();
+                    return false;
+                }
+
+                inner * split = new node4(prefix.substr(0, m));
+                inner * moved = copy_inner(n, n->type, prefix.substr(m + 1));
+                add_child(split, prefix[m], inner_ref(moved));
+                this->account_index(node_size(kind::n4) + heap_size(split->prefix) + node_size(moved->type) + heap_size(moved->prefix));
+
+                leaf * l = make();
+                if (depth + m == key.size()) { split->value = l; }
+                else { add_child(split, key[depth + m], leaf_ref(l)); }
+
+                change_child(parent, parent_b, inner_ref(split));
+                n->write_unlock_obsolete();
+                this->retire(n);
+                parent->write_unlock();
+
+                result = {l, true};
+                return true;
+            }
+
+            depth += prefix.size();
+            if (depth == key.size())
+            {
+                // the key ends at this node
+                leaf * existing = n->value;
+                if (!n->validate(v)) { return false; }
+                if (existing)
+                {
+                    result = {existing, false};
+                    return true;
+                }
+
+                if (!n->upgrade(v)) { return false; }
+                leaf * l = make();
+                n->value = l;
+                n->write_unlock();
+
+                result = {l, true};
+                return true;
+            }
+
+            uint8_t const b = key[depth];
+            ref const child = find_child(n, b);
+            if (!n->validate(v)) { return false; }
+
+            if (!child)
+            {
+                if (n->count >= capacity(n))
+                {
+                    // replace the node with a larger copy. The root never fills, so parent is set.
+                    if (!parent->upgrade(pv)) { return false; }
+                    if (!n->upgrade(v))
+                    {
+                        parent->write_unlock();
+                        return false;
+                    }
+
+                    inner * bigger = copy_inner(n, grown(n->type), prefix);
+                    this->account_index(node_size(bigger->type) + heap_size(bigger->prefix));
+                    leaf * l = make();
+                    add_child(bigger, b, leaf_ref(l));
+
+                    change_child(parent, parent_b, inner_ref(bigger));
+                    n->write_unlock_obsolete();
+                    this->retire(n);
+                    parent->write_unlock();
+
+                    result = {l, true};
+                    return true;
+                }
+
+                if (!n->upgrade(v)) { return false; }
+                leaf * l = make();
+                add_child(n, b, leaf_ref(l));
+                n->write_unlock();
+
+                result = {l, true};
+                return true;
+            }
+
+            if (is_leaf(child))
+            {
+                leaf * existing = as_leaf(child);
+                if (existing->key == key)
+                {
+                    result = {existing, false};
+                    return true;
+                }
+
+                // replace the leaf with a new node, holding both it and our key below their shared bytes
+                if (!n->upgrade(v)) { return false; }
+
+                std::string_view const other = existing->key;
+                size_t d = depth + 1;
+                size_t shared = 0;
+                while (d + shared < key.size() && d + shared < other.size() && key[d + shared] == other[d + shared])
+                {
+                    shared++;
+                }
+
+                inner * split = new node4(key.substr(d, shared));
+                this->account_index(node_size(kind::n4) + heap_size(split->prefix));
+                d += shared;
+
+                leaf * l = make();
+                if (d == other.size()) { split->value = existing; }
+                else { add_child(split, other[d], child); }
+                if (d == key.size()) { split->value = l; }
+                else { add_child(split, key[d], leaf_ref(l)); }
+
+                change_child(n, b, inner_ref(split));
+                n->write_unlock();
+
+                result = {l, true};
+                return true;
+            }
+
+            parent = n;
+            pv = v;
+            parent_b = b;
+
+            n = as_inner(child);
+            if (!n->read_lock(v)) { return false; }
+            depth += 1;
+        }
+    }
+
+    // A single optimistic lookup attempt. Returns false if it must be restarted.
+    bool try_find(std::string_view key, entry const * & out) const
+    {
+        inner const * n = this->root;
+        uint64_t v{};
+        if (!n->read_lock(v)) { return false; }
+
+        size_t depth = 0;
+        while (true)
+        {
+            std::string_view const prefix = n->prefix;
+            if (matching(prefix, key, depth) < prefix.size())
+            {
+                out = nullptr;
+                return n->validate(v);
+            }
+
+            depth += prefix.size();
+            if (depth == key.size())
+            {
+                out = n->value;
+                return n->validate(v);
+            }
+
+            ref const child = find_child(n, key[depth]);
+            if (!n->validate(v)) { return false; }
+
+            if (!child)
+            {
+                out = nullptr;
+                return true;
+            }
+
+            if (is_leaf(child))
+            {
+                out = as_leaf(child)->key == key ? as_leaf(child) : nullptr;
+                return true;
+            }
+
+            n = as_inner(child);
+            if (!n->read_lock(v)) { return false; }
+            depth += 1;
+        }
+    }
+
+    // A single optimistic attempt to find the smallest leaf in the subtree of "n" with a key not less than
+    // (or if "strict", greater than) "key", where the path to "n" matches the first "depth" bytes of the key.
+    // Returns false if it must be restarted.
+    bool try_bound(inner const * n, std::string_view key, size_t depth, bool strict, entry const * & out) const
+    {
+        uint64_t v{};
+        if (!n->read_lock(v)) { return false; }
+
+        std::string_view const prefix = n->prefix;
+        int const c = key.substr(std::min(depth, key.size()), prefix.size()).compare(prefix);
+        if (c < 0) { return this->try_min(n, v, false, out); } // every key below is greater
+        if (c > 0) // every key below is smaller
+        {
+            out = nullptr;
+            return n->validate(v);
+        }
+
+        depth += prefix.size();
+        // a key ending here equals ours - every other key below is greater
+        if (depth == key.size()) { return this->try_min(n, v, strict, out); }
+
+        // any key ending here is a prefix of ours, and so smaller - search the children from our next byte
+        uint8_t b{};
+        ref child{};
+        for (unsigned next = static_cast<uint8_t>(key[depth]); next < 256; next = b + 1u)
+        {
+            bool const found = next_child(n, next, b, child);
+            if (!n->validate(v)) { return false; }
+            if (!found) { break; }
+
+            entry const * e{};
+            if (is_leaf(child))
+            {
+                std::string_view const k = as_leaf(child)->key;
+                if (strict ? k > key : k >= key) { e = as_leaf(child); }
+            }
+            else if (b == static_cast<uint8_t>(key[depth]))
+            {
+                if (!this->try_bound(as_inner(child), key, depth + 1, strict, e)) { return false; }
+            }
+            else
+            {
+                uint64_t cv{};
+                if (!as_inner(child)->read_lock(cv) || !this->try_min(as_inner(child), cv, false, e)) { return false; }
+            }
+
+            if (e)
+            {
+                out = e;
+                return true;
+            }
+        }
+
+        out = nullptr;
+        return true;
+    }
+
+    // A single optimistic attempt to find the smallest leaf below "n", read-locked at version "v".
+    // If "skip_value", the leaf ending at "n" itself is excluded. Returns false if it must be restarted.
+    bool try_min(inner const * n, uint64_t v, bool skip_value, entry const * & out) const
+    {
+        while (true)
+        {
+            leaf const * value = skip_value ? nullptr : n->value.load();
+            uint8_t b{};
+            ref child{};
+            bool const found = value ? false : next_child(n, 0, b, child);
+            if (!n->validate(v)) { return false; }
+
+            if (value)
+            {
+                out = value;
+                return true;
+            }
+
+            if (!found)
+            {
+                out = nullptr;
+                return true;
+            }
+
+            if (is_leaf(child))
+            {
+                out = as_leaf(child);
+                return true;
+            }
+
+            n = as_inner(child);
+            skip_value = false;
+            if (!n->read_lock(v)) { return false; }
+        }
+    }
+
+    // A single optimistic attempt to find the largest leaf in the subtree of "n" with a key less than "key",
+    // where the path to "n" matches the first "depth" bytes of the key. Returns false if it must be restarted.
+    bool try_before(inner const * n, std::string_view key, size_t depth, entry const * & out) const
+    {
+        uint64_t v{};
+        if (!n->read_lock(v)) { return false; }
+
+        std::string_view const prefix = n->prefix;
+        int const c = key.substr(std::min(depth, key.size()), prefix.size()).compare(prefix);
+        if (c > 0) { return this->try_max(n, v, out); } // every key below is smaller
+        depth += prefix.size();
+
+        // every key below is greater, or equal to ours, or extends it
+        if (c < 0 || depth == key.size())
+        {
+            out = nullptr;
+            return n->validate(v);
+        }
+
+        // search the children from our next byte down. Any key ending here is a prefix of ours, and smaller than every child.
+        uint8_t b{};
+        ref child{};
+        for (int prev = static_cast<uint8_t>(key[depth]); prev >= 0; prev = int{b} - 1)
+        {
+            bool const found = prev_child(n, prev, b, child);
+            if (!n->validate(v)) { return false; }
+            if (!found) { break; }
+
+            entry const * e{};
+            if (is_leaf(child))
+            {
+                if (as_leaf(child)->key < key) { e = as_leaf(child); }
+            }
+            else if (b == static_cast<uint8_t>(key[depth]))
+            {
+                if (!this->try_before(as_inner(child), key, depth + 1, e)) { return false; }
+            }
+            else
+            {
+                uint64_t cv{};
+                if (!as_inner(child)->read_lock(cv) || !this->try_max(as_inner(child), cv, e)) { return false; }
+            }
+
+            if (e)
+            {
+                out = e;
+                return true;
+            }
+        }
+
+        out = n->value.load();
+        return n->validate(v);
+    }
+
+    // A single optimistic attempt to find the largest leaf below "n", read-locked at version "v".
+    // Returns false if it must be restarted.
+    bool try_max(inner const * n, uint64_t v, entry const * & out) const
+    {
+        while (true)
+        {
+            uint8_t b{};
+            ref child{};
+            bool const found = prev_child(n, 255, b, child);
+            leaf const * value = found ? nullptr : n->value.load();
+            if (!n->validate(v)) { return false; }
+
+            if (!found)
+            {
+                out = value;
+                return true;
+            }
+
+            if (is_leaf(child))
+            {
+                out = as_leaf(child);
+                return true;
+            }
+
+            n = as_inner(child);
+            if (!n->read_lock(v)) { return false; }
+        }
+    }
+
+    // frees all leaves and inner nodes, except the root, whose children are freed but not cleared
+    void release_nodes()
+    {
+        this->release_below(this->root);
+
+        std::lock_guard lock{this->retired_mutex};
+        for (inner * n : this->retired) { free_inner(n); }
+        this->retired.clear();
+    }
+
+    // frees every node below "n" (but not "n" itself). Requires exclusive access to the index.
+    static void release_below(inner * n)
+    {
+        delete n->value.load();
+
+        uint8_t b{};
+        ref r{};
+        for (unsigned next = 0; next < 256 && next_child(n, next, b, r); next = b + 1u)
+        {
+            if (is_leaf(r)) { delete as_leaf(r); }
+            else
+            {
+                release_below(as_inner(r));
+                free_inner(as_inner(r));
+            }
+        }
+    }
+
+    inner * root;
+    epoch::reclaimer * const reclaimer;
+    std::mutex retired_mutex{};
+    std::vector<inner *> retired{};
+};
+
+} // namespace KVSTORE_NS::memtable
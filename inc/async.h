@@ -0,0 +1,281 @@
+#pragma once
+
+#include <ns.h>
+#include <job_pool.h>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace KVSTORE_NS::async
+{
+struct scheduler;
+
+namespace detail
+{
+    // the scheduler running on this thread, if any
+    inline scheduler *& current()
+    {
+        static thread_local scheduler * s{};
+        return s;
+    }
+}
+
+// A coroutine returning a T, started when it is first awaited. On completion, it resumes the coroutine awaiting it.
+template <typename T = void>
+struct task
+{
+    struct promise_base
+    {
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        // resumes the awaiting coroutine directly, so a chain of tasks completes without growing the stack
+        auto final_suspend() noexcept
+        {
+            struct resume_awaiter
+            {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept { return this->next; }
+                void await_resume() noexcept {}
+                std::coroutine_handle<> next;
+            };
+
+            return resume_awaiter{this->continuation ? this->continuation : std::noop_coroutine()};
+        }
+
+        // the store does not throw, so neither may its tasks
+        void unhandled_exception() noexcept { std::terminate(); }
+
+        std::coroutine_handle<> continuation{};
+    };
+
+    struct promise_value : promise_base
+    {
+        void return_value(T value) { this->value = std::move(value); }
+        std::optional<T> value{};
+    };
+
+    struct promise_void : promise_base
+    {
+        void return_void() {}
+    };
+
+    struct promise_type : std::conditional_t<std::is_void_v<T>, promise_void, promise_value>
+    {
+        task get_return_object() { return task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+    };
+
+    task(task&& other) noexcept : h(std::exchange(other.h, {})) {}
+    task(task const &) = delete;
+    task& operator=(task&&) = delete;
+    task& operator=(task const&) = delete;
+
+    ~task()
+    {
+        if (this->h) { this->h.destroy(); }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        this->h.promise().continuation = awaiting;
+        return this->h;
+    }
+
+    T await_resume()
+    {
+        if constexpr (!std::is_void_v<T>) { return std::move(*this->h.promise().value); }
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) : h(h) {}
+
+    std::coroutine_handle<promise_type> h;
+};
+
+// A few threads running many coroutines: a coroutine suspended on the store (see "on_pool") is resumed by
+// the scheduler it was running on, so thousands of lookups may be in flight while only the scheduler's threads run them.
+struct scheduler
+{
+    struct config_options
+    {
+        // the number of threads resuming coroutines
+        size_t threads{2};
+    };
+
+    explicit scheduler(config_options const & opts) : config(opts)
+    {
+        for (size_t i = 0; i < std::max<size_t>(opts.threads, 1); i++)
+        {
+            this->workers.emplace_back([this] { this->work(); });
+        }
+    }
+
+    // waits for every spawned task to complete, then stops the threads
+    ~scheduler()
+    {
+        this->wait();
+
+        {
+            std::lock_guard lock{this->queue_mutex};
+            this->stopping = true;
+        }
+
+        this->queued.notify_all();
+        for (auto & worker : this->workers) { worker.join(); }
+    }
+
+    scheduler(scheduler&&) = delete;
+    scheduler(scheduler const &) = delete;
+    scheduler& operator=(scheduler&&) = delete;
+    scheduler& operator=(scheduler const&) = delete;
+
+    // the scheduler running on the calling thread, or nullptr if the thread is not one of a scheduler's
+    static scheduler * current() { return detail::current(); }
+
+    // queues "h" to be resumed on one of our threads
+    void post(std::coroutine_handle<> h)
+    {
+        // notified under the lock: once "h" is queued, it may complete the last task, and the scheduler be destroyed
+        std::lock_guard lock{this->queue_mutex};
+        this->ready.emplace_back(h);
+        this->queued.notify_one();
+    }
+
+    // an awaitable moving the awaiting coroutine onto our threads
+    auto schedule()
+    {
+        struct schedule_awaiter
+        {
+            bool await_ready() noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) { this->s.post(h); }
+            void await_resume() noexcept {}
+            scheduler & s;
+        };
+
+        return schedule_awaiter{*this};
+    }
+
+    // Runs "t" on our threads, without waiting for it. The task is freed once it completes.
+    void spawn(task<> t)
+    {
+        this->spawned += 1;
+        this->run(std::move(t));
+    }
+
+    // waits until every spawned task has completed
+    void wait()
+    {
+        std::unique_lock lock{this->queue_mutex};
+        this->idle.wait(lock, [this] { return this->spawned.load() == 0; });
+    }
+
+    config_options const config;
+
+private:
+    // a coroutine that frees itself on completion
+    struct detached
+    {
+        struct promise_type
+        {
+            detached get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    detached run(task<> t)
+    {
+        co_await this->schedule();
+        co_await t;
+
+        if (this->spawned.fetch_sub(1) == 1)
+        {
+            std::lock_guard lock{this->queue_mutex};
+            this->idle.notify_all();
+        }
+    }
+
+    void work()
+    {
+        detail::current() = this;
+
+        std::unique_lock lock{this->queue_mutex};
+        while (true)
+        {
+            this->queued.wait(lock, [this] { return !this->ready.empty() || this->stopping; });
+            if (this->ready.empty()) { return; }
+
+            std::coroutine_handle<> h = this->ready.front();
+            this->ready.pop_front();
+
+            lock.unlock();
+            h.resume();
+            lock.lock();
+        }
+    }
+
+    std::mutex queue_mutex{};
+    std::condition_variable queued{};
+    std::condition_variable idle{};
+    std::deque<std::coroutine_handle<>> ready{};
+    std::atomic_size_t spawned{};
+    bool stopping{};
+    std::vector<std::thread> workers{};
+};
+
+// the scheduler running the calling coroutine, which awaitables that suspend it on the store require:
+// a coroutine resumed by the store itself would run on, and may block, the job pool or a flush.
+// A coroutine started elsewhere first moves onto a scheduler with "co_await s.schedule()".
+inline scheduler & resuming_scheduler()
+{
+    scheduler * s = scheduler::current();
+    assert(s);
+    return *s;
+}
+
+// An awaitable running "work" on a job pool, so that a coroutine waiting on a blocking read ties up no thread of its own.
+// The awaiting coroutine must be running on a scheduler, which resumes it (see "resuming_scheduler").
+// If a result is "ready" before the coroutine suspends, the work is skipped, and no scheduler is needed.
+template <typename R>
+struct on_pool
+{
+    on_pool(job_pool & pool, std::optional<R> ready, std::function<R()> work) :
+        pool(pool), result(std::move(ready)), work(std::move(work))
+    {
+
+    }
+
+    bool await_ready() const noexcept { return this->result.has_value(); }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        // the coroutine may be resumed, and this awaitable destroyed, before "submit" returns
+        scheduler & s = resuming_scheduler();
+        this->pool.submit(job_pool::priority::read, [this, h, &s] {
+            this->result.emplace(this->work());
+            s.post(h);
+        });
+    }
+
+    R await_resume() { return std::move(*this->result); }
+
+private:
+    job_pool & pool;
+    std::optional<R> result{};
+    std::function<R()> work{};
+};
+
+} // namespace KVSTORE_NS::async
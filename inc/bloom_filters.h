@@ -5,6 +5,7 @@
 #include <vector>
 #include <xxhash64.h>
 #include <array>
+#include <atomic>
 
 #include <iostream>
 
@@ -162,6 +163,102 @@ private:
   size_t element_count{};
 };
 
+// A static_filter that is safe for concurrent insertion and lookup, sized by the same parameters.
+// Bits are held in atomic 64-bit words and set with fetch_or, so inserts never block and never lose each
+// other's bits. Rather than a hash per slice, each operation computes 2 hashes (from the first 2 seeds)
+// and derives the remaining slice bits by double hashing ("Kirsch-Mitzenmacher").
+// Since the hashes only depend on the seeds, callers holding several filters with the same seeds can hash
+// a key once and probe each filter with the result.
+struct concurrent_filter
+{
+  // The pair of base hashes for an element
+  struct key_hash
+  {
+    uint64_t h1{};
+    uint64_t h2{};
+  };
+
+  concurrent_filter(static_filter::parameters const& params)
+    : params(params)
+    , slices(static_filter::parameters::hash_count(params.target_error_rate))
+    , bps(static_filter::parameters::slice_bits(params.target_error_rate, params.capacity))
+    , words((slices * bps + 63) / 64)
+  {
+  }
+
+  // allow owners to reference the parameters used to create the filter
+  static_filter::parameters const params;
+
+  key_hash hash(void const* data, size_t const data_size) const
+  {
+    return hash(data, data_size, this->params.hash_seeds[0], this->params.hash_seeds[1]);
+  }
+
+  static key_hash hash(void const* data, size_t const data_size, uint64_t const seed1, uint64_t const seed2)
+  {
+    // an odd step ensures successive slice bits differ
+    return key_hash{ XXHash64::hash(data, data_size, seed1), XXHash64::hash(data, data_size, seed2) | 1 };
+  }
+
+  // Returns false if we are certain the element is not in the filter, otherwise true.
+  // Might return a false positive due to hash collisions.
+  bool might_contain(key_hash const& h) const
+  {
+    for (size_t i = 0; i < this->slices; i++) {
+      size_t const bit = this->bit_i(i, h);
+      if (!(this->words[bit / 64].load(std::memory_order_acquire) & (uint64_t{ 1 } << (bit % 64)))) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool might_contain(void const* data, size_t const data_size) const
+  {
+    return this->might_contain(this->hash(data, data_size));
+  }
+
+  // Starts loading the words "might_contain" reads for the element, without waiting for them.
+  // Prefetching a batch of elements before probing any of them overlaps their cache misses.
+  void prefetch(key_hash const& h) const
+  {
+    for (size_t i = 0; i < this->slices; i++) {
+      __builtin_prefetch(&this->words[this->bit_i(i, h) / 64]);
+    }
+  }
+
+  // inserts an element into the filter. Once this returns, "might_contain" is true for the element on all threads.
+  void insert(key_hash const& h)
+  {
+    for (size_t i = 0; i < this->slices; i++) {
+      size_t const bit = this->bit_i(i, h);
+      this->words[bit / 64].fetch_or(uint64_t{ 1 } << (bit % 64), std::memory_order_release);
+    }
+  }
+
+  void insert(void const* data, size_t const data_size) { this->insert(this->hash(data, data_size)); }
+
+  // removes all elements. Requires that no other thread is accessing the filter.
+  void clear()
+  {
+    for (auto& word : this->words) {
+      word.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // the size of the bit array, in bytes
+  size_t memory_usage() const { return this->words.size() * sizeof(uint64_t); }
+
+private:
+  // Returns the bit index for the ith slice of the given hashes
+  size_t bit_i(size_t const i, key_hash const& h) const { return ((h.h1 + i * h.h2) % this->bps) + (i * this->bps); }
+
+  size_t const slices;
+  size_t const bps;
+  std::vector<std::atomic<uint64_t>> words;
+};
+
 // Implements a scalable bloom filter as presented in
 // P. Almeida, C.Baquero, N. Preguiça, D. Hutchison, Scalable Bloom Filters, (GLOBECOM 2007), IEEE, 2007.
 // Uses a list of dynamically created "static_filter"s to increase capacity as new elements are added.
@@ -0,0 +1,316 @@
+#pragma once
+
+#include <ns.h>
+#include <literals.h>
+#include <sstable.h>
+#include <version.h>
+#include <functional>
+#include <optional>
+#include <queue>
+
+using namespace KVSTORE_NS::literals;
+
+namespace KVSTORE_NS::sst
+{
+// Leveled compaction, as in LevelDB (https://github.com/google/leveldb/blob/main/doc/impl.md).
+//
+// Flushed files collect in level 0. Once there are enough of them, they are merged with the level 1 files they overlap,
+// into new level 1 files. Each deeper level is allowed "level_ratio" times the bytes of the level before it,
+// and once a level is over its size, one of its files is merged with the files it overlaps in the next level.
+// Merging keeps only the newest value of each key, and the older versions open snapshots still read (see "retention"),
+// so overwritten values are dropped from disk, and as deeper levels hold disjoint key ranges, a lookup reads at most one file per level.
+// Deletions are merged as values are, as they must still hide older values in the files below the compaction.
+// Once a compaction writes the oldest data for its keys, nothing is left to hide, and the deletions are dropped too.
+//
+// Universal (size-tiered) compaction, as in RocksDB (https://github.com/facebook/rocksdb/wiki/Universal-Compaction),
+// may be selected instead, for stores that are mostly written.
+// All files stay in level 0, each a sorted run, and runs of similar size are merged into one, in place of the runs merged.
+// Each value is rewritten far fewer times than by leveled compaction, but lookups read more files, and more space is used.
+struct compaction
+{
+    enum class style_type
+    {
+        leveled,
+        universal,
+    };
+
+    struct config_options
+    {
+        style_type style{style_type::leveled};
+
+        // the number of level 0 files which triggers their compaction into level 1.
+        // With universal compaction, the number of sorted runs which triggers a merge.
+        size_t level0_file_trigger{4};
+
+        // the size of level 1. Each deeper level is "level_ratio" times the size of the level before it.
+        size_t level_base_bytes{256_MiB};
+        size_t level_ratio{10};
+
+        // compaction splits its output into files of about this size.
+        // As files are written in whole blocks, this should be several times "sstable::config_options::max_block_size".
+        size_t target_file_size{64_MiB};
+
+        // the number of levels, including level 0. The last level grows without limit.
+        size_t levels{7};
+
+        // Universal compaction merges the newest runs while the next is no more than "size_ratio" percent larger
+        // than the runs before it together, and at least "min_merge_width" runs qualify.
+        size_t size_ratio{1};
+        size_t min_merge_width{2};
+
+        // Universal compaction merges every run, once the runs above the oldest take up this percentage of its size.
+        // This bounds the space used by overwritten values to the same percentage of the live data.
+        size_t max_size_amplification{200};
+    };
+
+    // Chooses the next compaction for "v", from the level furthest over its size, or returns nothing if no level is.
+    // Levels past 0 compact their files in turn, in key order: "next_keys" holds, for each level,
+    // the largest key of the last file compacted from it, and is updated.
+    static std::optional<compaction> pick(version const & v, config_options const & opts, std::vector<std::string> & next_keys)
+    {
+        if (opts.style == style_type::universal) { return pick_universal(v, opts); }
+
+        // level 0 is scored by file count, as every file is read by each lookup, and deeper levels by size
+        double best{1.0};
+        std::optional<size_t> level{};
+        for (size_t n = 0; n + 1 < opts.levels && n < v.levels.size(); n++)
+        {
+            double score{};
+            if (n == 0) { score = double(v.levels[0].size()) / double(opts.level0_file_trigger); }
+            else
+            {
+                double max_bytes = double(opts.level_base_bytes);
+                for (size_t l = 1; l < n; l++) { max_bytes *= double(opts.level_ratio); }
+                score = double(v.level_bytes(n)) / max_bytes;
+            }
+
+            if (score >= best)
+            {
+                best = score;
+                level = n;
+            }
+        }
+
+        if (!level) { return std::nullopt; }
+
+        compaction c{.level = *level, .output_level = *level + 1};
+        if (c.level == 0)
+        {
+            // level 0 files may overlap each other, so they are all compacted together
+            c.inputs = v.levels[0];
+        }
+        else
+        {
+            if (next_keys.size() < opts.levels) { next_keys.resize(opts.levels); }
+
+            version::level const & files = v.levels[c.level];
+            auto it = std::find_if(files.begin(), files.end(), [&](version::file_ptr const & file) { return file->smallest() > next_keys[c.level]; });
+            if (it == files.end()) { it = files.begin(); }
+
+            c.inputs.emplace_back(*it);
+            next_keys[c.level] = (*it)->largest();
+        }
+
+        auto const [lo, hi] = c.key_range();
+        std::vector<version::file_ptr> const overlapping = v.overlapping(c.output_level, lo, hi);
+
+        // a single file overlapping nothing below is moved down a level as it is, without being rewritten
+        c.trivial_move = c.level > 0 && overlapping.empty();
+        c.inputs.insert(c.inputs.end(), overlapping.begin(), overlapping.end());
+        c.bottom = c.below_all(v, c.output_level + 1);
+        return c;
+    }
+
+    // Chooses the next merge of sorted runs in level 0, or returns nothing if there are too few runs.
+    // Files left in deeper levels by leveled compaction are older than every run, and are left in place.
+    static std::optional<compaction> pick_universal(version const & v, config_options const & opts)
+    {
+        version::level const & runs = v.levels[0];
+        if (runs.size() < std::max<size_t>(opts.level0_file_trigger, 2)) { return std::nullopt; }
+
+        compaction c{.level = 0, .output_level = 0};
+
+        // merge everything if overwritten values may be taking up too much space
+        size_t newer_bytes{};
+        for (size_t i = 0; i + 1 < runs.size(); i++) { newer_bytes += runs[i]->file_size(); }
+        if (newer_bytes * 100 >= runs.back()->file_size() * opts.max_size_amplification)
+        {
+            c.inputs = runs;
+            c.bottom = c.below_all(v, 1);
+            return c;
+        }
+
+        // merge the newest runs of similar size
+        size_t count{1};
+        size_t merged_bytes{runs[0]->file_size()};
+        for (; count < runs.size() && runs[count]->file_size() * 100 <= merged_bytes * (100 + opts.size_ratio); count++)
+        {
+            merged_bytes += runs[count]->file_size();
+        }
+
+        // otherwise, merge just enough of the newest runs to bring the count back under the trigger
+        if (count < std::max<size_t>(opts.min_merge_width, 2)) { count = std::max<size_t>(runs.size() - opts.level0_file_trigger + 1, 2); }
+
+        c.inputs.assign(runs.begin(), runs.begin() + count);
+        c.bottom = count == runs.size() && c.below_all(v, 1);
+        return c;
+    }
+
+    // Writes the output files of the compaction, named by the times returned by "next_time" (see sstable::writer for "throttle"),
+    // keeping the versions of keys that "keep" requires.
+    // Executed without any lock: the inputs are immutable, and the outputs are not visible until installed.
+    std::vector<version::file_ptr> run(sstable::config_options const & sst_opts, config_options const & opts, retention const & keep,
+                                       std::function<std::chrono::steady_clock::time_point()> const & next_time,
+                                       std::function<void(size_t)> const & throttle = {}) const
+    {
+        if (this->trivial_move) { return this->inputs; }
+
+        // a sorted run in level 0 is written as a single file
+        size_t const target_file_size = this->output_level == 0 ? SIZE_MAX : opts.target_file_size;
+
+        std::vector<std::unique_ptr<sstable::cursor>> cursors{};
+        for (version::file_ptr const & file : this->inputs) { cursors.emplace_back(std::make_unique<sstable::cursor>(*file)); }
+
+        // a k-way merge, by key, then by input order, so the newest value of each key is read first.
+        // Each input holds the versions of a key newest first, so all versions are read in order.
+        auto const later = [&](size_t l, size_t r) {
+            std::string_view const lk = cursors[l]->key();
+            std::string_view const rk = cursors[r]->key();
+            return lk == rk ? l > r : lk > rk;
+        };
+
+        std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap{later};
+        for (size_t i = 0; i < cursors.size(); i++) { if (cursors[i]->valid()) { heap.push(i); } }
+
+        // a version of a key in input "i" is deleted by the ranges of the inputs before it, and the later ranges of its own input,
+        // unless a snapshot reads the version but not the range
+        auto const range_deleted = [&](size_t i, std::string_view key, sequence_t sequence) {
+            for (size_t newer = 0; newer <= i; newer++)
+            {
+                bool const deleted = this->inputs[newer]->deleted_ranges().any_covering(key, [&](range_tombstones::range const & r) {
+                    return (newer < i || sequence < r.sequence) && keep.hides(r.sequence, sequence);
+                });
+
+                if (deleted) { return true; }
+            }
+
+            return false;
+        };
+
+        // the ranges deleted by every input, written to the outputs, save those read by every snapshot at the bottom of the key range.
+        // Each output takes the part of the ranges that ends before the first key of the next output.
+        std::vector<range_tombstones::range> all{};
+        for (version::file_ptr const & file : this->inputs)
+        {
+            for (range_tombstones::range const & r : file->deleted_ranges().ranges())
+            {
+                if (!this->bottom || !keep.visible_to_all(r.sequence)) { all.emplace_back(r); }
+            }
+        }
+
+        range_tombstones const ranges{std::move(all)};
+
+        std::vector<version::file_ptr> outputs{};
+        std::shared_ptr<sstable> out{};
+        std::unique_ptr<sstable::writer> writer{};
+        std::string lower{};
+        bool split{};
+
+        // starts a new output, unless one is open
+        auto const open = [&] {
+            if (writer) { return; }
+            out = std::make_shared<sstable>(sst_opts, next_time());
+            writer = std::make_unique<sstable::writer>(*out, throttle);
+        };
+
+        // finishes the open output, with the ranges up to "upper"
+        auto const close = [&](std::optional<std::string_view> upper) {
+            writer->finish(ranges.clip(lower, upper));
+            writer.reset();
+            outputs.emplace_back(std::move(out));
+        };
+
+        std::string last_key{};
+        sequence_t newer{};
+        bool first{true};
+        while (!heap.empty())
+        {
+            size_t const i = heap.top();
+            heap.pop();
+
+            sstable::cursor & c = *cursors[i];
+            bool const same_key = !first && c.key() == last_key;
+            first = false;
+            if (!same_key) { last_key = c.key(); }
+
+            // older versions of the key are skipped, unless a snapshot reads them, rather than the version before
+            bool const hidden = same_key && keep.hides(newer, c.sequence());
+            newer = c.sequence();
+
+            // versions deleted by a range are dropped, as the range is kept (or has nothing left to hide),
+            // and deletions are dropped once nothing older can hold the key, nor can any snapshot read what they delete
+            bool const dropped = hidden || range_deleted(i, c.key(), c.sequence())
+                || (this->bottom && c.type() == table::value_type::deletion && keep.visible_to_all(c.sequence()));
+            if (!dropped)
+            {
+                // a full output is finished once the key it ends before is known, so its ranges end at that key.
+                // The versions of a key are never split between outputs, so no level holds a key in more than one file.
+                if (split && !same_key)
+                {
+                    close(c.key());
+                    lower = c.key();
+                    split = false;
+                }
+
+                open();
+                writer->add(c.key(), c.value(), c.value_size(), c.type(), c.sequence());
+                split = writer->bytes() >= target_file_size;
+            }
+
+            c.next();
+            if (c.valid()) { heap.push(i); }
+        }
+
+        if (!writer && !ranges.clip(lower, std::nullopt).empty()) { open(); }
+        if (writer) { close(std::nullopt); }
+
+        return outputs;
+    }
+
+    // the level compacted, and the level the output is written to. Both are 0 for universal compaction.
+    size_t level{};
+    size_t output_level{};
+
+    // the files merged, newest first: the files of "level", then those they overlap in "output_level"
+    std::vector<version::file_ptr> inputs{};
+
+    bool trivial_move{};
+
+    // true if no file outside the compaction holds data older than its inputs, in their key range
+    bool bottom{};
+
+private:
+    // the range of keys held or deleted by the inputs
+    std::pair<std::string_view, std::string_view> key_range() const
+    {
+        std::string_view lo{this->inputs.front()->smallest()};
+        std::string_view hi{this->inputs.front()->largest()};
+        for (version::file_ptr const & file : this->inputs)
+        {
+            lo = std::min(lo, file->smallest());
+            hi = std::max(hi, file->largest());
+        }
+
+        return {lo, hi};
+    }
+
+    // true if no file in level "n" or deeper overlaps the inputs
+    bool below_all(version const & v, size_t n) const
+    {
+        auto const [lo, hi] = this->key_range();
+        for (; n < v.levels.size(); n++) { if (!v.overlapping(n, lo, hi).empty()) { return false; } }
+        return true;
+    }
+};
+
+} // namespace KVSTORE_NS::sst
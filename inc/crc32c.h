@@ -0,0 +1,87 @@
+#pragma once
+
+#include <ns.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+namespace KVSTORE_NS::crc32c
+{
+// CRC-32C (Castagnoli), as used by iSCSI, ext4 and the RocksDB log, to detect torn and corrupt WAL records.
+// Computed with the SSE 4.2 crc32 instruction when the target has it, and by slicing-by-8 tables otherwise.
+namespace detail
+{
+    inline constexpr uint32_t POLYNOMIAL = 0x82F63B78; // reflected
+
+    // tables[k][b] is the crc of byte "b" followed by "k" zero bytes
+    inline constexpr std::array<std::array<uint32_t, 256>, 8> tables = [] {
+        std::array<std::array<uint32_t, 256>, 8> t{};
+        for (uint32_t b = 0; b < 256; b++)
+        {
+            uint32_t crc = b;
+            for (int i = 0; i < 8; i++) { crc = (crc >> 1) ^ (crc & 1 ? POLYNOMIAL : 0); }
+            t[0][b] = crc;
+        }
+
+        for (size_t k = 1; k < 8; k++)
+        {
+            for (uint32_t b = 0; b < 256; b++) { t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xFF]; }
+        }
+
+        return t;
+    }();
+}
+
+// extends "crc", the crc of some preceding bytes, over "data"
+inline uint32_t extend(uint32_t crc, void const * data, size_t size)
+{
+    auto p = static_cast<unsigned char const *>(data);
+    uint32_t c = ~crc;
+
+#if defined(__SSE4_2__)
+    uint64_t c64 = c;
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t word{};
+        memcpy(&word, p, 8);
+        c64 = _mm_crc32_u64(c64, word);
+    }
+
+    c = uint32_t(c64);
+    for (; size > 0; size--, p++) { c = _mm_crc32_u8(c, *p); }
+#else
+    auto const & t = detail::tables;
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint32_t lo{};
+        uint32_t hi{};
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+          ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+
+    for (; size > 0; size--, p++) { c = (c >> 8) ^ t[0][(c ^ *p) & 0xFF]; }
+#endif
+
+    return ~c;
+}
+
+inline uint32_t value(void const * data, size_t size) { return extend(0, data, size); }
+
+// A crc stored alongside the data it covers is masked, as the crc of a string holding crcs is prone to collisions.
+inline uint32_t mask(uint32_t crc) { return ((crc >> 15) | (crc << 17)) + 0xA282EAD8u; }
+
+inline uint32_t unmask(uint32_t masked)
+{
+    uint32_t const rot = masked - 0xA282EAD8u;
+    return (rot >> 17) | (rot << 15);
+}
+
+} // namespace KVSTORE_NS::crc32c
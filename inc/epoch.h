@@ -0,0 +1,189 @@
+#pragma once
+
+#include <ns.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <deque>
+
+namespace KVSTORE_NS::epoch
+{
+// Epoch-based reclamation, as described in
+// K. Fraser, Practical Lock-Freedom (PhD thesis, University of Cambridge, 2004)
+//
+// Readers pin the global epoch for the duration of an operation with a "guard", touching only their own slot.
+// Memory unlinked from shared structures is handed to a "reclaimer", tagged with the epoch at which it was retired.
+// The epoch only advances once every pinned reader has observed the current epoch, so once it has advanced twice
+// past an object's retirement, no reader can still hold a reference to it, and it is freed.
+//
+// A single epoch is shared by the whole process, so a thread needs one slot regardless of how many stores it uses.
+// Slots are never freed: a slot released by an exiting thread is reused by the next new thread.
+namespace detail
+{
+    // A reader's published epoch, on its own cache line. Zero while the reader is not pinned.
+    struct alignas(64) slot
+    {
+        std::atomic<uint64_t> pinned{};
+        std::atomic_bool owned{};
+        slot * next{};
+    };
+
+    struct domain
+    {
+        // starts at 1, so that a pinned epoch is never zero
+        std::atomic<uint64_t> epoch{1};
+        std::atomic<slot *> slots{};
+
+        // claims a released slot, or adds a new one to the list
+        slot * acquire()
+        {
+            for (slot * s = this->slots; s; s = s->next)
+            {
+                bool expected = false;
+                if (!s->owned && s->owned.compare_exchange_strong(expected, true)) { return s; }
+            }
+
+            slot * s = new slot{};
+            s->owned = true;
+            s->next = this->slots;
+            while (!this->slots.compare_exchange_weak(s->next, s)) {}
+            return s;
+        }
+
+        // advances the epoch, iff every pinned reader has observed the current one. Returns the (possibly new) epoch.
+        uint64_t try_advance()
+        {
+            uint64_t e = this->epoch;
+            for (slot * s = this->slots; s; s = s->next)
+            {
+                uint64_t const p = s->pinned;
+                if (p && p != e) { return e; }
+            }
+
+            this->epoch.compare_exchange_strong(e, e + 1);
+            return this->epoch;
+        }
+    };
+
+    inline domain & global()
+    {
+        static domain d{};
+        return d;
+    }
+
+    // The calling thread's slot and pin depth, released when the thread exits
+    struct local
+    {
+        local() : s(global().acquire()) {}
+
+        ~local()
+        {
+            this->s->pinned = 0;
+            this->s->owned = false;
+        }
+
+        slot * const s;
+        size_t depth{};
+    };
+
+    inline local & this_thread()
+    {
+        static thread_local local l{};
+        return l;
+    }
+}
+
+// Pins the current epoch while in scope, so that memory retired during that time is not freed.
+// Guards may be nested - only the outermost guard pins and unpins.
+struct guard
+{
+    guard() : l(detail::this_thread())
+    {
+        if (this->l.depth++ == 0)
+        {
+            // the store must be visible to a concurrent "try_advance" before we read any shared pointer.
+            // If the epoch advances between the load and the store, we pin an older epoch, which only delays reclamation.
+            this->l.s->pinned.store(detail::global().epoch.load(), std::memory_order_seq_cst);
+        }
+    }
+
+    ~guard()
+    {
+        if (--this->l.depth == 0) { this->l.s->pinned.store(0, std::memory_order_release); }
+    }
+
+    guard(guard&&) = delete;
+    guard(guard const &) = delete;
+    guard& operator=(guard&&) = delete;
+    guard& operator=(guard const&) = delete;
+
+private:
+    detail::local & l;
+};
+
+// Defers freeing memory, unlinked from a shared structure, until no guard can still reference it.
+// Retired functions run in the order they were retired.
+// "retire" and "collect" may be called from any thread. "retire" may be called while holding a guard: the memory is tagged with
+// an epoch no older than the guard's, so it is not freed until the guard is released. "collect" must not be, as it could then
+// never free memory retired during the guard.
+struct reclaimer
+{
+    reclaimer() = default;
+
+    // Runs everything still retired. Requires that no guard still references the retired memory.
+    ~reclaimer() { this->drain(); }
+
+    reclaimer(reclaimer&&) = delete;
+    reclaimer(reclaimer const &) = delete;
+    reclaimer& operator=(reclaimer&&) = delete;
+    reclaimer& operator=(reclaimer const&) = delete;
+
+    // "free" will be called once no reader can hold a reference to the memory it frees
+    void retire(std::function<void()> free)
+    {
+        std::lock_guard lock{this->retired_mutex};
+        this->retired.emplace_back(detail::global().epoch.load(), std::move(free));
+    }
+
+    // Attempts to advance the epoch, and frees whatever is no longer reachable.
+    // Collections run one at a time, so retired functions never run concurrently, or out of order:
+    // a collection started while another runs is skipped, leaving its work to the next.
+    void collect()
+    {
+        std::unique_lock collecting{this->collect_mutex, std::try_to_lock};
+        if (!collecting.owns_lock()) { return; }
+
+        // without pinned readers in the way, two advances free everything retired before this call
+        detail::global().try_advance();
+        uint64_t const e = detail::global().try_advance();
+
+        std::deque<std::function<void()>> ready{};
+        {
+            std::lock_guard lock{this->retired_mutex};
+            while (!this->retired.empty() && this->retired.front().first + 2 <= e)
+            {
+                ready.emplace_back(std::move(this->retired.front().second));
+                this->retired.pop_front();
+            }
+        }
+
+        for (auto & free : ready) { free(); }
+    }
+
+    // Frees everything retired, without waiting for readers. Requires that no guard still references the retired memory.
+    void drain()
+    {
+        std::lock_guard collecting{this->collect_mutex};
+        std::lock_guard lock{this->retired_mutex};
+        for (auto & r : this->retired) { r.second(); }
+        this->retired.clear();
+    }
+
+private:
+    std::mutex collect_mutex{};
+    std::mutex retired_mutex{};
+    std::deque<std::pair<uint64_t, std::function<void()>>> retired{};
+};
+
+} // namespace KVSTORE_NS::epoch
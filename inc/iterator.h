@@ -0,0 +1,551 @@
+#pragma once
+
+#include <ns.h>
+#include <memtable.h>
+#include <sstable.h>
+#include <version.h>
+#include <sequence.h>
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace KVSTORE_NS
+{
+// An ordered view of the keys of several sources - memtables, their sorted indexes, and sst files - as of a snapshot.
+// The sources are given newest first, as a lookup searches them, and each is read through its own cursor.
+// The cursors are merged through a heap ordered by key, and then by source, so the sources holding a key are taken
+// together, in order: the first to hold a version of the key visible at the snapshot supplies its value,
+// unless a range deleted in it, or in a newer source, hides that version. Older versions are passed over unread.
+//
+// The iterator moves in either direction. Like LevelDB's merging iterator, the cursors of every source are kept
+// past the current key in the direction of travel, save those on it, and are repositioned around it when the direction changes.
+// The heap, key and value are held in buffers reused from step to step, so stepping does not allocate
+// once they have grown to the longest key.
+struct merging_iterator
+{
+    // a version of a key, as read from a source
+    struct item
+    {
+        table::value_type type{};
+        void const * data{};
+        size_t size{};
+        sequence_t sequence{};
+    };
+
+    // A cursor over the keys of one source, in key order
+    struct source
+    {
+        virtual ~source() = default;
+
+        // moves to the first key not less than "key"
+        virtual void seek(std::string_view key) = 0;
+
+        // moves to the last key less than "key", or the last key of all if "key" is not set
+        virtual void seek_before(std::optional<std::string_view> key) = 0;
+
+        // move to the following and preceding key. Require valid().
+        virtual void next() = 0;
+        virtual void prev() = 0;
+
+        virtual bool valid() const = 0;
+
+        // the current key. Requires valid().
+        virtual std::string_view key() const = 0;
+
+        // sets "out" to the newest version of the current key visible to the read, returning false if there is none.
+        // Requires valid().
+        virtual bool visible(item & out) const = 0;
+
+        // true if a range deleted by the source hides the version of "key" at "sequence" from the read
+        virtual bool range_deleted(std::string_view key, sequence_t sequence) const = 0;
+
+        // false if the source deletes no ranges, so that "range_deleted" need not be asked
+        virtual bool has_ranges() const = 0;
+    };
+
+    // A memtable still indexed by its own engine, which may be written to as it is read
+    struct table_source : source
+    {
+        table_source(table const & t, sequence_t snapshot) : t(t), snapshot(snapshot), ranges(t.deleted_ranges()) {}
+
+        void seek(std::string_view key) override { this->e = this->t.lower_bound(key); }
+        void seek_before(std::optional<std::string_view> key) override { this->e = this->t.before(key); }
+        void next() override { this->e = this->t.next(this->e); }
+        void prev() override { this->e = this->t.before(this->e->key); }
+        bool valid() const override { return this->e; }
+        std::string_view key() const override { return this->e->key; }
+
+        bool visible(item & out) const override
+        {
+            table::record const * r = this->t.visible(this->t.get(this->e), this->snapshot);
+            if (!r) { return false; }
+
+            out = item{.type = r->type, .data = r->data, .size = r->size, .sequence = r->sequence};
+            return true;
+        }
+
+        bool range_deleted(std::string_view key, sequence_t sequence) const override
+        {
+            return this->ranges.covers(key, sequence, this->snapshot);
+        }
+
+        bool has_ranges() const override { return !this->ranges.empty(); }
+
+    private:
+        table const & t;
+        sequence_t const snapshot;
+        // the ranges are taken as the source is created: any deleted later are newer than the read
+        range_tombstones const ranges;
+        table::entry const * e{};
+    };
+
+    // A memtable read through its sorted index, where the keys are held in an array
+    struct sorted_source : source
+    {
+        sorted_source(sorted_table const & t, sequence_t snapshot) : t(t), snapshot(snapshot), i(t.size()) {}
+
+        void seek(std::string_view key) override { this->i = this->t.lower_bound(key); }
+
+        void seek_before(std::optional<std::string_view> key) override
+        {
+            size_t const end = key ? this->t.lower_bound(*key) : this->t.size();
+            this->i = end == 0 ? this->t.size() : end - 1;
+        }
+
+        void next() override { this->i += 1; }
+        void prev() override { this->i = this->i == 0 ? this->t.size() : this->i - 1; }
+        bool valid() const override { return this->i < this->t.size(); }
+        std::string_view key() const override { return this->t.key(this->i); }
+
+        bool visible(item & out) const override
+        {
+            table::record const * r = this->t.value(this->i);
+            while (r && r->sequence > this->snapshot) { r = this->t.previous(*r); }
+            if (!r) { return false; }
+
+            out = item{.type = r->type, .data = r->data, .size = r->size, .sequence = r->sequence};
+            return true;
+        }
+
+        bool range_deleted(std::string_view key, sequence_t sequence) const override
+        {
+            return this->t.deleted_ranges().covers(key, sequence, this->snapshot);
+        }
+
+        bool has_ranges() const override { return !this->t.deleted_ranges().empty(); }
+
+    private:
+        sorted_table const & t;
+        sequence_t const snapshot;
+        // the current key's index, or size() once past either end
+        size_t i{};
+    };
+
+    // A run of sst files holding disjoint key ranges, in key order: a single level 0 file, or a deeper level.
+    // Only one file is mapped at a time, by a cursor opened as the source moves onto it.
+    // The versions of a key are never split between the files of a level, so each key is read from one file.
+    struct files_source : source
+    {
+        files_source(std::vector<sst::version::file_ptr> files, sequence_t snapshot) : files(std::move(files)), snapshot(snapshot)
+        {
+            for (sst::version::file_ptr const & f : this->files) { this->ranged = this->ranged || !f->deleted_ranges().empty(); }
+        }
+
+        void seek(std::string_view key) override
+        {
+            auto it = std::lower_bound(this->files.begin(), this->files.end(), key,
+                [](sst::version::file_ptr const & f, std::string_view k) { return f->largest() < k; });
+
+            this->at_key = false;
+            if (it == this->files.end()) { return; }
+
+            this->open(it - this->files.begin());
+            this->c->seek(key);
+            this->forward();
+        }
+
+        void seek_before(std::optional<std::string_view> key) override
+        {
+            // the last key before "key" is in the last file starting before it
+            auto it = key ? std::lower_bound(this->files.begin(), this->files.end(), *key,
+                                             [](sst::version::file_ptr const & f, std::string_view k) { return f->smallest() < k; })
+                          : this->files.end();
+
+            this->at_key = false;
+            if (it == this->files.begin()) { return; }
+
+            this->open(it - this->files.begin() - 1);
+            if (key) { this->c->seek(*key); }
+            else { this->to_end(); }
+            this->backward();
+        }
+
+        // the cursor is already on the first version of the next key, if there is one in this file
+        void next() override { this->forward(); }
+
+        void prev() override
+        {
+            // step back over the versions of the current key
+            do
+            {
+                if (!this->step_back()) { return; }
+            } while (this->c->key() == this->current);
+
+            this->first_version();
+        }
+
+        bool valid() const override { return this->at_key; }
+        std::string_view key() const override { return this->current; }
+
+        bool visible(item & out) const override
+        {
+            if (!this->found) { return false; }
+
+            out = this->version;
+            return true;
+        }
+
+        bool range_deleted(std::string_view key, sequence_t sequence) const override
+        {
+            // a key is in the ranges of at most two files of a level, where one range ends at the key the next file starts with
+            auto it = std::lower_bound(this->files.begin(), this->files.end(), key,
+                [](sst::version::file_ptr const & f, std::string_view k) { return f->largest() < k; });
+
+            for (; it != this->files.end() && (*it)->smallest() <= key; it++)
+            {
+                if ((*it)->deleted_ranges().covers(key, sequence, this->snapshot)) { return true; }
+            }
+
+            return false;
+        }
+
+        bool has_ranges() const override { return this->ranged; }
+
+    private:
+        // maps file "n", unless it is already open
+        void open(size_t n)
+        {
+            if (this->c && this->file == n) { return; }
+
+            this->c.reset();
+            this->c = std::make_unique<sst::sstable::cursor>(*this->files[n]);
+            this->file = n;
+        }
+
+        // reads the key the cursor is on, moving on through later files if it is past the end of its own
+        void forward()
+        {
+            while (!this->c->valid())
+            {
+                if (this->file + 1 == this->files.size())
+                {
+                    this->at_key = false;
+                    return;
+                }
+
+                this->open(this->file + 1);
+            }
+
+            this->read_key();
+        }
+
+        // reads the key before the cursor's position, moving back through earlier files if there is none in its own
+        void backward()
+        {
+            if (!this->step_back()) { return; }
+            this->first_version();
+        }
+
+        // moves the cursor back one entry, into earlier files as needed. Clears "at_key" if there is no earlier entry.
+        bool step_back()
+        {
+            while (!this->c->prev())
+            {
+                if (this->file == 0)
+                {
+                    this->at_key = false;
+                    return false;
+                }
+
+                this->open(this->file - 1);
+                this->to_end();
+            }
+
+            return true;
+        }
+
+        // moves the cursor back from a version of a key to its first, newest version, and reads the key
+        void first_version()
+        {
+            this->current = this->c->key();
+            while (this->c->prev())
+            {
+                if (this->c->key() != this->current)
+                {
+                    this->c->next();
+                    break;
+                }
+            }
+
+            this->read_key();
+        }
+
+        // moves the cursor past the last entry of its file
+        void to_end()
+        {
+            this->c->seek(this->files[this->file]->largest());
+            while (this->c->valid()) { this->c->next(); }
+        }
+
+        // reads the versions of the key the cursor is on, keeping the newest visible to the read,
+        // and leaves the cursor on the next key
+        void read_key()
+        {
+            this->at_key = true;
+            this->found = false;
+            this->current = this->c->key();
+            for (; this->c->valid() && this->c->key() == this->current; this->c->next())
+            {
+                if (!this->found && this->c->sequence() <= this->snapshot)
+                {
+                    this->found = true;
+                    this->version = item{.type = this->c->type(), .data = this->c->value(), .size = this->c->value_size(), .sequence = this->c->sequence()};
+                }
+            }
+        }
+
+        std::vector<sst::version::file_ptr> const files;
+        sequence_t const snapshot;
+        bool ranged{};
+
+        size_t file{};
+        std::unique_ptr<sst::sstable::cursor> c{};
+
+        bool at_key{};
+        std::string current{};
+        bool found{};
+        item version{};
+    };
+
+    // merges "sources", given newest first, reading them at "snapshot".
+    // Only keys starting with "prefix" are read, and files holding no such keys are best left out of the sources.
+    merging_iterator(std::vector<std::unique_ptr<source>> sources, sequence_t snapshot, std::string prefix = {}) :
+        sources(std::move(sources)), snapshot(snapshot), prefix(std::move(prefix)), prefix_end(successor(this->prefix))
+    {
+        for (size_t i = 0; i < this->sources.size(); i++) { if (this->sources[i]->has_ranges()) { this->ranged.emplace_back(i); } }
+        this->heap.reserve(this->sources.size());
+        this->at.reserve(this->sources.size());
+    }
+
+    merging_iterator(merging_iterator&&) = delete;
+    merging_iterator(merging_iterator const &) = delete;
+    merging_iterator& operator=(merging_iterator&&) = delete;
+    merging_iterator& operator=(merging_iterator const&) = delete;
+
+    // true if the iterator is on a key
+    bool valid() const { return this->on_key; }
+
+    // the current key and its value. Require valid().
+    // The value is read in place, and is valid until the iterator moves, or is destroyed.
+    std::string_view key() const { return this->current; }
+    std::span<std::byte const> value() const { return {static_cast<std::byte const *>(this->current_value.data), this->current_value.size}; }
+
+    void seek_to_first() { this->seek(this->prefix); }
+
+    void seek_to_last()
+    {
+        if (this->prefix_end) { this->seek_before(*this->prefix_end); }
+        else { this->seek_before(std::nullopt); }
+    }
+
+    // moves to the first key not less than "key"
+    void seek(std::string_view key)
+    {
+        if (key < this->prefix) { key = this->prefix; }
+        for (std::unique_ptr<source> const & s : this->sources) { s->seek(key); }
+
+        this->forward = true;
+        this->fill_heap();
+        this->settle();
+    }
+
+    // moves to the last key not greater than "key"
+    void seek_for_prev(std::string_view key)
+    {
+        // the smallest key greater than "key" appends a zero byte to it
+        this->scratch.assign(key);
+        this->scratch.push_back('\0');
+        if (this->prefix_end && *this->prefix_end < this->scratch) { this->scratch = *this->prefix_end; }
+
+        this->seek_before(this->scratch);
+    }
+
+    // move to the following and preceding key. Require valid().
+    void next()
+    {
+        // turning around: the cursors are before the current key, and are moved past it
+        if (!this->forward)
+        {
+            for (std::unique_ptr<source> const & s : this->sources)
+            {
+                s->seek(this->current);
+                if (s->valid() && s->key() == this->current) { s->next(); }
+            }
+
+            this->forward = true;
+            this->fill_heap();
+        }
+
+        this->settle();
+    }
+
+    void prev()
+    {
+        // turning around: the cursors are after the current key, and are moved before it
+        if (this->forward)
+        {
+            for (std::unique_ptr<source> const & s : this->sources) { s->seek_before(this->current); }
+
+            this->forward = false;
+            this->fill_heap();
+        }
+
+        this->settle();
+    }
+
+    // the smallest key greater than every key starting with "prefix", if there is one
+    static std::optional<std::string> successor(std::string_view prefix)
+    {
+        std::string end{prefix};
+        while (!end.empty() && static_cast<uint8_t>(end.back()) == 0xFF) { end.pop_back(); }
+        if (end.empty()) { return std::nullopt; }
+
+        end.back() = static_cast<char>(static_cast<uint8_t>(end.back()) + 1);
+        return end;
+    }
+
+private:
+    void seek_before(std::optional<std::string_view> key)
+    {
+        for (std::unique_ptr<source> const & s : this->sources) { s->seek_before(key); }
+
+        this->forward = false;
+        this->fill_heap();
+        this->settle();
+    }
+
+    // true if source "l" is taken after source "r": forwards, the smallest key is taken first, and backwards the largest.
+    // Of sources on the same key, the newest is taken first.
+    bool later(size_t l, size_t r) const
+    {
+        int const c = this->sources[l]->key().compare(this->sources[r]->key());
+        if (c == 0) { return l > r; }
+        return this->forward ? c > 0 : c < 0;
+    }
+
+    // rebuilds the heap from the sources, once each has been repositioned
+    void fill_heap()
+    {
+        this->at.clear();
+        this->heap.clear();
+        for (size_t i = 0; i < this->sources.size(); i++) { if (this->sources[i]->valid()) { this->heap.emplace_back(i); } }
+        std::make_heap(this->heap.begin(), this->heap.end(), [this](size_t l, size_t r) { return this->later(l, r); });
+    }
+
+    // Moves to the next key in the direction of travel with a value visible to the read, taking each key's sources off the heap.
+    // The sources stay on the key until the iterator moves again, as the value is read in place, from their memory.
+    void settle()
+    {
+        auto const later = [this](size_t l, size_t r) { return this->later(l, r); };
+        while (true)
+        {
+            // move the sources on the last key past it
+            for (size_t i : this->at)
+            {
+                source & s = *this->sources[i];
+                if (this->forward) { s.next(); }
+                else { s.prev(); }
+
+                if (s.valid())
+                {
+                    this->heap.emplace_back(i);
+                    std::push_heap(this->heap.begin(), this->heap.end(), later);
+                }
+            }
+
+            this->at.clear();
+
+            // keys outside the prefix are past the end of the range in either direction
+            if (this->heap.empty() || !this->sources[this->heap.front()]->key().starts_with(this->prefix)) { break; }
+            this->current.assign(this->sources[this->heap.front()]->key());
+
+            while (!this->heap.empty() && this->sources[this->heap.front()]->key() == this->current)
+            {
+                std::pop_heap(this->heap.begin(), this->heap.end(), later);
+                this->at.emplace_back(this->heap.back());
+                this->heap.pop_back();
+            }
+
+            if (this->resolve())
+            {
+                this->on_key = true;
+                return;
+            }
+        }
+
+        this->on_key = false;
+    }
+
+    // Finds the value of the current key from the sources on it, taken newest first, returning false if the key is deleted,
+    // or has no version visible to the read. As a lookup, the newest source with a visible version supplies it,
+    // unless a range in that source, or a newer one, deletes the version.
+    bool resolve()
+    {
+        size_t newest{};
+        bool found{};
+        for (size_t i : this->at)
+        {
+            if (this->sources[i]->visible(this->current_value))
+            {
+                newest = i;
+                found = true;
+                break;
+            }
+        }
+
+        if (!found || this->current_value.type == table::value_type::deletion) { return false; }
+
+        for (size_t i : this->ranged)
+        {
+            if (i > newest) { break; }
+            if (this->sources[i]->range_deleted(this->current, i == newest ? this->current_value.sequence : 0)) { return false; }
+        }
+
+        return true;
+    }
+
+    std::vector<std::unique_ptr<source>> const sources;
+    sequence_t const snapshot;
+    std::string const prefix;
+    std::optional<std::string> const prefix_end;
+
+    // the sources which delete ranges, in order
+    std::vector<size_t> ranged{};
+
+    // the sources with keys left in the direction of travel, as a heap by "later"
+    std::vector<size_t> heap{};
+    bool forward{true};
+
+    // the sources on the current key, or the last key resolved
+    std::vector<size_t> at{};
+
+    bool on_key{};
+    std::string current{};
+    item current_value{};
+    std::string scratch{};
+};
+
+} // namespace KVSTORE_NS
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <ns.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace KVSTORE_NS
+{
+// A pool of threads running the background jobs of one or more stores.
+// Jobs are queued by priority: reads are short, and a caller is waiting on them, so they run first.
+// Flushes free memtable memory and unblock writers, so they run next,
+// while compactions only run on a bounded number of threads, leaving the rest free to pick up flushes promptly.
+struct job_pool
+{
+    struct config_options
+    {
+        // the number of threads running jobs
+        size_t threads{4};
+
+        // the most threads that may run compactions at once. Kept below "threads", so that a flush never waits on compactions.
+        size_t max_compactions{1};
+    };
+
+    enum class priority
+    {
+        read,
+        flush,
+        compaction,
+    };
+
+    explicit job_pool(config_options const & opts) : config(opts)
+    {
+        for (size_t i = 0; i < std::max<size_t>(opts.threads, 1); i++)
+        {
+            this->workers.emplace_back([this] { this->work(); });
+        }
+    }
+
+    // runs the jobs already queued, then stops the threads
+    ~job_pool()
+    {
+        {
+            std::lock_guard lock{this->queue_mutex};
+            this->stopping = true;
+        }
+
+        this->queued.notify_all();
+        for (auto & worker : this->workers) { worker.join(); }
+    }
+
+    job_pool(job_pool&&) = delete;
+    job_pool(job_pool const &) = delete;
+    job_pool& operator=(job_pool&&) = delete;
+    job_pool& operator=(job_pool const&) = delete;
+
+    void submit(priority p, std::function<void()> job)
+    {
+        {
+            std::lock_guard lock{this->queue_mutex};
+            this->queue(p).emplace_back(std::move(job));
+        }
+
+        this->queued.notify_one();
+    }
+
+    config_options const config;
+
+private:
+    // true if a queued job may start now. Requires "queue_mutex".
+    bool runnable() const
+    {
+        return !this->reads.empty() || !this->flushes.empty() || (!this->compactions.empty() && this->running_compactions < this->config.max_compactions);
+    }
+
+    void work()
+    {
+        std::unique_lock lock{this->queue_mutex};
+        while (true)
+        {
+            this->queued.wait(lock, [this] { return this->runnable() || this->stopping; });
+            if (!this->runnable()) { return; }
+
+            priority const p = !this->reads.empty() ? priority::read : !this->flushes.empty() ? priority::flush : priority::compaction;
+            std::function<void()> job = std::move(this->queue(p).front());
+            this->queue(p).pop_front();
+            if (p == priority::compaction) { this->running_compactions += 1; }
+
+            lock.unlock();
+            job();
+            lock.lock();
+
+            if (p == priority::compaction)
+            {
+                // a compaction slot is free - another queued compaction may now run
+                this->running_compactions -= 1;
+                this->queued.notify_all();
+            }
+        }
+    }
+
+    std::deque<std::function<void()>> & queue(priority p)
+    {
+        return p == priority::read ? this->reads : p == priority::flush ? this->flushes : this->compactions;
+    }
+
+    std::mutex queue_mutex{};
+    std::condition_variable queued{};
+    std::deque<std::function<void()>> reads{};
+    std::deque<std::function<void()>> flushes{};
+    std::deque<std::function<void()>> compactions{};
+    size_t running_compactions{};
+    bool stopping{};
+    std::vector<std::thread> workers{};
+};
+
+} // namespace KVSTORE_NS
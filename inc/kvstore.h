@@ -2,9 +2,27 @@
 #pragma once
 #include <ns.h>
 #include <wal.h>
+#include <art.h>
+#include <write_buffer.h>
+#include <epoch.h>
 #include <sstable.h>
+#include <version.h>
+#include <compaction.h>
+#include <job_pool.h>
+#include <rate_limiter.h>
+#include <sequence.h>
+#include <iterator.h>
+#include <write_batch.h>
+#include <pinned_value.h>
+#include <async.h>
+#include <row_cache.h>
 #include <thread>
-#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <numeric>
+#include <functional>
+#include <span>
 
 
 namespace KVSTORE_NS
@@ -16,51 +34,332 @@ using namespace std::chrono_literals;
 
 struct kvstore
 {
+    // The options of a column family: a keyspace of the store with its own memtables and sst files (see "column_family").
+    struct family_options
+    {
+        // the name the family is found by (see "kvstore::family"), and is logged under in the WAL
+        std::string name{};
+
+        // see memtable.h
+        table::config_opts memtable_options{};
+
+        // see sstable.h. Each family's files must be in a directory of their own, which is created if missing.
+        sstable::config_options sst_options{};
+
+        // see compaction.h
+        compaction::config_options compaction_options{};
+
+        // the number of locked memtables held in memory before writing to SST files
+        // Increasing this value will potentially increase performance,
+        // but will cause the memory footprint and WAL size to increase.
+        // the actual history may exceed this value while a flush is in progress, or delayed by "flush_batching_delay"
+        size_t memtable_history{2};
+
+        // the number of flushed memtables kept for reuse by the background thread.
+        // Recycled tables keep their record buffers, so replacing a full memtable does not allocate.
+        size_t memtable_pool_size{2};
+
+        // The values read from sst files are cached by key (see row_cache.h), if "enable_row_cache" is set.
+        // Reads at a snapshot neither use nor fill the cache.
+        bool enable_row_cache{false};
+        row_cache::config_options row_cache_options{};
+    };
+
     struct config_options
     {
+        // The options below, up to "row_cache_options", are those of the default column family, named "default"
         // see memtable.h
-        skiptable::config_opts memtable_options{};
+        table::config_opts memtable_options{};
 
         // see sstable.h
         sstable::config_options sst_options{};
 
+        // see compaction.h
+        compaction::config_options compaction_options{};
+
+        // see family_options
+        size_t memtable_history{2};
+        size_t memtable_pool_size{2};
+        bool enable_row_cache{false};
+        row_cache::config_options row_cache_options{};
+
+        // The column families of the store besides the default family (see "column_family").
+        // All the families share the store's WAL, background thread, job pool and write buffer.
+        std::vector<family_options> column_families{};
+
         // see wal.h
         walfile::config_options wal_options{};
 
-        // how often the background thread wakes up to write memtable history to sst files
+        // The background thread is woken as soon as a memtable fills. It also wakes at this period without being woken,
+        // to flush early when other stores sharing our write buffer have used up its budget.
         std::chrono::milliseconds background_activity_period{50ms};
 
-        // the number of locked memtables held in memory before writing to SST files
-        // Increasing this value will potentially increase performance,
-        // but will cause the memory footprint and WAL size to increase.
-        // the actual history may exceed this value, as it is only flushed every "background_activity_period"
-        size_t memtable_history{2};
+        // once woken, the background thread waits this long before flushing,
+        // so that memtables filling in quick succession are flushed together
+        std::chrono::milliseconds flush_batching_delay{1ms};
+
+        // The memory budget for the store's memtables (see write_buffer.h).
+        // Stores passed the same manager share its budget. If not set, the store creates its own from "write_buffer_options".
+        std::shared_ptr<write_buffer_manager> write_buffer{};
+        write_buffer_manager::config_options write_buffer_options{};
+
+        // The threads that write memtables to sst files (see job_pool.h). Several memtables are flushed in parallel.
+        // Stores passed the same pool share its threads. If not set, the store creates its own from "job_options".
+        std::shared_ptr<job_pool> jobs{};
+        job_pool::config_options job_options{};
+
+        // Limits the rate at which flushes and compactions write sst files (see rate_limiter.h).
+        // Stores passed the same limiter share its rates. If not set, the store creates its own from "limiter_options".
+        std::shared_ptr<rate_limiter> limiter{};
+        rate_limiter::config_options limiter_options{};
+
+        // "multi_get" shares the keys it looks up in sst files between the calling thread and the job pool,
+        // in jobs of this many keys. Batches with fewer keys left for the files are read on the calling thread alone.
+        size_t multi_get_job_keys{8};
+
+        // "get" copies values smaller than this into a "pinned_value", rather than pinning the sst file holding them,
+        // as a pin keeps the file mapped, even once compaction has replaced it, until it is released.
+        size_t pin_min_bytes{4_KiB};
+    };
+
+private:
+    struct hist_node
+    {
+        ~hist_node() { delete this->sorted.load(); }
+
+        std::unique_ptr<memtable::table> table{};
+        // a compact index over "table", published by the background thread
+        std::atomic<sorted_table const *> sorted{};
+        // only modified by the background thread, once published, when detaching flushed nodes
+        std::atomic<hist_node *> next{};
+
+        // set by the background thread once the table is submitted for flushing
+        bool flushing{};
+        // the creation time of the table's sst file, assigned in history order, so that files sort as their tables do
+        std::chrono::steady_clock::time_point flush_time{};
+        // the table's sst file, once written. Requires "install_mutex".
+        version::file_ptr file{};
+        // set once the flush is done: a table holding only records abandoned by writers has no file
+        bool written{};
+    };
+
+public:
+    // A keyspace of the store, with its own memtables, sst files and options.
+    // The families of a store share its WAL, so a write batch may write to several of them atomically, and they are flushed
+    // together, keeping one log for all of them. Snapshots are store-wide, and read every family at the same point.
+    // Families are created with the store (see "config_options::column_families"), and are found by name.
+    // The operations of the store that take no family operate on the default family.
+    struct column_family
+    {
+        column_family(column_family&&) = delete;
+        column_family(column_family const &) = delete;
+        column_family& operator=(column_family&&) = delete;
+        column_family& operator=(column_family const&) = delete;
+
+        ~column_family()
+        {
+            delete this->mtable.load();
+            delete this->standby.load();
+            delete this->current.load();
+        }
+
+        // identifies the family in a write batch (see write_batch.h)
+        uint32_t id() const { return this->family_id; }
+
+        family_options const config;
+
+    private:
+        friend struct kvstore;
+
+        column_family(family_options const & opts, uint32_t id) : config(opts), family_id(id) {}
+
+        uint32_t const family_id;
+
+        std::unique_ptr<row_cache> cache{};
+
+        // replaced by the writer that locks it (see "save_memtable")
+        std::atomic<table *> mtable{};
+
+        // an empty table, ready to replace "mtable" when it fills. Refilled by the background thread.
+        std::atomic<table *> standby{};
+
+        // flushed tables, reset and held for reuse
+        std::mutex pool_mutex{};
+        std::vector<std::unique_ptr<table>> pool{};
+
+        std::atomic<hist_node *> hist{};
+
+        // the sst files, as read by "get". Replaced (never modified) by "install".
+        std::atomic<version const *> current{};
+        // whether a compaction is running, signalled by "flushed" as it completes. Requires "install_mutex".
+        bool compacting{};
+        // for each level, the largest key of the last file compacted from it
+        std::vector<std::string> compaction_keys{};
+    };
+
+    // A consistent point in time to read the store at: reads at a snapshot see every write completed before it was taken,
+    // and none made after. The versions of keys a snapshot may read are kept by flushes and compactions until it is destroyed,
+    // so snapshots should not be held longer than needed. The store must outlive its snapshots.
+    struct snapshot
+    {
+        explicit snapshot(kvstore & store) : store(store)
+        {
+            std::lock_guard lock{store.snapshot_mutex};
+            this->seq = store.published.load();
+            store.snapshots.insert(this->seq);
+        }
+
+        ~snapshot()
+        {
+            std::lock_guard lock{this->store.snapshot_mutex};
+            this->store.snapshots.erase(this->store.snapshots.find(this->seq));
+        }
+
+        snapshot(snapshot&&) = delete;
+        snapshot(snapshot const &) = delete;
+        snapshot& operator=(snapshot&&) = delete;
+        snapshot& operator=(snapshot const&) = delete;
+
+        // the sequence of the last write the snapshot reads
+        sequence_t sequence() const { return this->seq; }
+
+    private:
+        kvstore & store;
+        sequence_t seq{};
+    };
+
+    // An ordered scan over the keys of the store, as of a snapshot, merging the memtables and sst files (see iterator.h).
+    // Without a snapshot, the iterator takes its own, so it reads the store as it was when the iterator was created.
+    // The iterator is created unpositioned, and is positioned by one of the seeks.
+    // It pins the memtables and files it reads, which are not freed until it is destroyed, so it should not be held longer
+    // than needed. The pins are reference counts, so an open iterator holds back the release of nothing else,
+    // and may be destroyed on any thread. The store must outlive it.
+    struct iterator
+    {
+        struct config_options
+        {
+            // if set, the store is read as of this snapshot, which must outlive the iterator
+            snapshot const * at{};
+
+            // only keys starting with this prefix are read. Files holding no such keys are not read at all.
+            std::string prefix{};
+
+            // the column family to read, if not the default
+            column_family const * family{};
+        };
+
+        explicit iterator(kvstore & store) : iterator(store, config_options{}) {}
+
+        iterator(kvstore & store, config_options const & opts) :
+            own(opts.at ? nullptr : std::make_unique<snapshot>(store)),
+            seq(opts.at ? opts.at->sequence() : this->own->sequence()),
+            merged(store.iterator_sources(opts.family ? *opts.family : store.default_family(), opts.prefix, this->seq, this->tables.pinned),
+                   this->seq, opts.prefix)
+        {
+
+        }
+
+        iterator(iterator&&) = delete;
+        iterator(iterator const &) = delete;
+        iterator& operator=(iterator&&) = delete;
+        iterator& operator=(iterator const&) = delete;
+
+        // true if the iterator is on a key
+        bool valid() const { return this->merged.valid(); }
+
+        // the current key and its value. Require valid().
+        // The value is read in place, and is valid until the iterator moves.
+        std::string_view key() const { return this->merged.key(); }
+        std::span<std::byte const> value() const { return this->merged.value(); }
+
+        // move to the first or last key
+        void seek_to_first() { this->merged.seek_to_first(); }
+        void seek_to_last() { this->merged.seek_to_last(); }
+
+        // move to the first key not less than "key", or the last key not greater than it
+        void seek(std::string_view key) { this->merged.seek(key); }
+        void seek_for_prev(std::string_view key) { this->merged.seek_for_prev(key); }
+
+        // move to the following and preceding key. Require valid().
+        void next() { this->merged.next(); }
+        void prev() { this->merged.prev(); }
+
+    private:
+        // the memtables read, unpinned once the sources reading them are destroyed
+        struct table_pins
+        {
+            ~table_pins() { for (table * t : this->pinned) { t->unpin(); } }
+            std::vector<table *> pinned{};
+        };
+
+        table_pins tables{};
+        std::unique_ptr<snapshot> const own;
+        sequence_t const seq;
+        merging_iterator merged;
     };
 
     explicit kvstore(config_options const & opts):
         config(opts),
-        mtable(std::make_unique<skiptable>(opts.memtable_options)),
-        wal(std::make_unique<walfile>(opts.wal_options))
+        write_buffer(opts.write_buffer ? opts.write_buffer : std::make_shared<write_buffer_manager>(opts.write_buffer_options)),
+        jobs(opts.jobs ? opts.jobs : std::make_shared<job_pool>(opts.job_options)),
+        limiter(opts.limiter ? opts.limiter : std::make_shared<rate_limiter>(opts.limiter_options))
     {
-        // if we have an old WAL (from abnormal exit), read into our memtable and delete
+        this->add_family(family_options{
+            .name = "default",
+            .memtable_options = opts.memtable_options,
+            .sst_options = opts.sst_options,
+            .compaction_options = opts.compaction_options,
+            .memtable_history = opts.memtable_history,
+            .memtable_pool_size = opts.memtable_pool_size,
+            .enable_row_cache = opts.enable_row_cache,
+            .row_cache_options = opts.row_cache_options});
+        for (family_options const & family : opts.column_families) { this->add_family(family); }
+
+        // if we have old WALs (from abnormal exit), read them into our memtables.
+        // The logs are kept until the tables they were read into are flushed, as they are logged nowhere else.
         for (auto const & item : std::filesystem::directory_iterator(opts.wal_options.base_dir))
         {
-            if (item.path().extension() == walfile::FILE_EXT && std::filesystem::is_regular_file(item))
-            {
-                walfile::load(item.path(), *this->mtable);
-                if (this->mtable->locked()) { this->save_memtable(); }
+            if (item.path().extension() == walfile::FILE_EXT && std::filesystem::is_regular_file(item)) { this->recovered_wals.emplace_back(item.path()); }
+        }
+
+        if (!this->recovered_wals.empty())
+        {
+            this->last_sequence = walfile::load(this->recovered_wals, [this](std::string_view name) -> table * {
+                column_family * cf = this->family(name);
+                if (!cf) { return nullptr; }
 
-                std::filesystem::remove(item);
+                // a table filled by the logs is kept in the history, to be flushed, and recovery continues in a new one
+                if (cf->mtable.load()->locked()) { this->save_memtable(*cf, cf->mtable); }
+                return cf->mtable.load();
+            });
+
+            for (auto & cf : this->families)
+            {
+                if (cf->mtable.load()->locked()) { this->save_memtable(*cf, cf->mtable); }
             }
         }
 
-        // load our old sst files into the queue
-        for (auto const & item : std::filesystem::directory_iterator(opts.sst_options.base_dir))
+        for (auto & cf : this->families)
         {
-            if (item.path().extension() == sstable::FILE_EXT && std::filesystem::is_regular_file(item))
+            // load our old sst files into the first version
+            cf->current = version::load(cf->config.sst_options.base_dir);
+
+            // new files are named after the existing ones, even if the clock has restarted since they were written
+            for (version::level const & files : cf->current.load()->levels)
             {
-                sstq.emplace(item.path());
+                for (version::file_ptr const & file : files) { this->last_file_time = std::max(this->last_file_time, file->time()); }
             }
+
+            // as are new writes sequenced after the existing ones
+            this->last_sequence = std::max(this->last_sequence.load(), cf->current.load()->largest_sequence());
+        }
+
+        this->published = this->last_sequence.load();
+        this->wal = this->new_wal();
+
+        {
+            std::lock_guard lock{this->install_mutex};
+            for (auto & cf : this->families) { this->schedule_compaction(*cf); }
         }
 
         // startup the background thread
@@ -69,9 +368,27 @@ struct kvstore
 
     ~kvstore()
     {
-        this->exit = true;
+        {
+            std::lock_guard lock{this->work_mutex};
+            this->exit = true;
+        }
+
+        this->work_cv.notify_one();
         this->background_thread.join();
         this->flush_memtables();
+
+        {
+            std::unique_lock lock{this->install_mutex};
+            this->flushed.wait(lock, [this] {
+                return this->flush_queue.empty() && this->flush_jobs == 0
+                    && std::none_of(this->families.begin(), this->families.end(), [](auto const & cf) { return cf->compacting; });
+            });
+        }
+
+        // no readers remain, so everything retired can be freed immediately
+        this->reclaimer.drain();
+        this->families.clear();
+        delete this->wal.load();
     }
 
     kvstore(kvstore const &) = delete;
@@ -79,156 +396,1114 @@ struct kvstore
     kvstore & operator==(kvstore const &) = delete;
     kvstore & operator==(kvstore&&) = delete;
 
+    // the column family named "name", or nullptr if the store has none
+    column_family * family(std::string_view name)
+    {
+        for (auto & cf : this->families) { if (cf->config.name == name) { return cf.get(); } }
+        return nullptr;
+    }
+
+    column_family & default_family() { return *this->families.front(); }
+    column_family const & default_family() const { return *this->families.front(); }
+
     // Insert a k,v pair into the table. Currently, this is written so as not to fail, rather retrying endlessly
     // An alternative design would be to implement bounded retry logic so as not to hang clients upon certain edge cases
-    void put(std::string_view key, void * data, size_t data_size)
+    // Every write returns once it is logged with durability "d" (see wal.h), or the WAL's "default_durability" if "d" is not set.
+    // Writes asking for durability are committed in groups, so concurrent writers share the log's writes and syncs.
+    // A write waits for no other: it is read once every write sequenced before it has also returned (see "publish"),
+    // so while an earlier write is still being logged, a returned write may not yet be seen.
+    void put(std::string_view key, void * data, size_t data_size, std::optional<durability> d = {})
     {
-put_retry:
-        skiptable::node const * node = this->mtable->insert(key, data, data_size);
-        // failure indicates the memtable is full / locked - retry after rereshing the table
+        this->put(this->default_family(), key, data, data_size, d);
+    }
+
+    void put(column_family & cf, std::string_view key, void * data, size_t data_size, std::optional<durability> d = {})
+    {
+        // delays the write while the memtables are near their memory budget
+        this->write_buffer->throttle();
+        this->write_value(cf, key, data, data_size, d);
+    }
+
+    // Awaitable "put", for coroutines (see async.h): "co_await store.async_put(key, data, size)".
+    // The write is made as the coroutine resumes. While the memtables are at their memory budget, where "put" would block,
+    // the coroutine is suspended instead, and resumed on its scheduler once flushes free memory; it must then be running
+    // on one (see "async::resuming_scheduler"). The write is never delayed short of the budget, as "put" may be.
+    // "key" and "data" must stay valid until the write completes.
+    auto async_put(column_family & cf, std::string_view key, void * data, size_t data_size)
+    {
+        struct put_awaiter
+        {
+            bool await_ready() const { return this->store.has_room(); }
+
+            void await_suspend(std::coroutine_handle<> h) { wait_for_room(this->store, async::resuming_scheduler(), h); }
+
+            void await_resume() { this->store.write_value(this->cf, this->key, this->data, this->data_size, {}); }
+
+            // Writers racing the coroutine's resumption may fill the budget again after the release that freed it,
+            // so the room is checked again as it is found, and the wait renewed rather than blocking the scheduler.
+            static void wait_for_room(kvstore & store, async::scheduler & s, std::coroutine_handle<> h)
+            {
+                store.write_buffer->when_room([&store, &s, h] {
+                    if (store.has_room()) { s.post(h); }
+                    else { wait_for_room(store, s, h); }
+                });
+            }
+
+            kvstore & store;
+            column_family & cf;
+            std::string_view key;
+            void * data;
+            size_t data_size;
+        };
+
+        return put_awaiter{*this, cf, key, data, data_size};
+    }
+
+    auto async_put(std::string_view key, void * data, size_t data_size) { return this->async_put(this->default_family(), key, data, data_size); }
+
+    // Delete a key from the store. Like "put", the deletion is retried until it succeeds.
+    // The deletion is written as a tombstone, hiding older values of the key until compaction drops them.
+    void remove(std::string_view key, std::optional<durability> d = {}) { this->remove(this->default_family(), key, d); }
+
+    void remove(column_family & cf, std::string_view key, std::optional<durability> d = {})
+    {
+        this->write_buffer->throttle();
+        epoch::guard pin{};
+        write_sequence const sequence{this->last_sequence};
+
+remove_retry:
+        memtable::table * table = cf.mtable;
+        memtable::table::entry const * node = table->remove(key, sequence);
         if (!node)
         {
-            this->save_memtable();
-            goto put_retry;
+            this->save_memtable(cf, table);
+            goto remove_retry;
+        }
+
+        this->complete_abandoned(sequence);
+        this->wal.load()->log(table::value_type::deletion, cf.id(), sequence.taken(), key, {}, d);
+        this->publish(sequence.taken());
+    }
+
+    // Delete every key from "begin" up to (not including) "end", as a single range tombstone
+    void remove_range(std::string_view begin, std::string_view end, std::optional<durability> d = {})
+    {
+        this->remove_range(this->default_family(), begin, end, d);
+    }
+
+    void remove_range(column_family & cf, std::string_view begin, std::string_view end, std::optional<durability> d = {})
+    {
+        if (!(begin < end)) { return; }
+
+        this->write_buffer->throttle();
+        epoch::guard pin{};
+        write_sequence const sequence{this->last_sequence};
+
+        memtable::table * table = cf.mtable;
+        while (!table->insert_range(begin, end, sequence))
+        {
+            this->save_memtable(cf, table);
+            table = cf.mtable;
         }
 
-        this->wal->log(node);
+        this->complete_abandoned(sequence);
+        this->wal.load()->log_range(cf.id(), sequence.taken(), begin, end, d);
+        this->publish(sequence.taken());
+    }
+
+    // Apply every write in "batch" atomically: reads, and recovery from the WAL, see all of them or none.
+    // The writes are sequenced in the order they were added, so of several writes to a key, the last added is kept.
+    // They are logged as a single record, and inserted in key order, so each insert resumes its search from the last.
+    // A batch may write to several column families, all of which are written atomically.
+    void write(write_batch const & batch, std::optional<durability> d = {})
+    {
+        if (batch.empty()) { return; }
+
+        this->write_buffer->throttle();
+        epoch::guard pin{};
+
+        // the writes of each family, in key order, as the batch's index of each
+        struct family_run
+        {
+            column_family * cf{};
+            std::vector<memtable::table::batch_entry> entries{};
+            std::vector<size_t> order{};
+            memtable::table * mtable{};
+            int32_t first_record{};
+        };
+
+        std::vector<size_t> sorted(batch.size());
+        std::iota(sorted.begin(), sorted.end(), size_t{});
+        std::stable_sort(sorted.begin(), sorted.end(), [&](size_t l, size_t r) {
+            return batch[l].family != batch[r].family ? batch[l].family < batch[r].family : batch[l].key < batch[r].key;
+        });
+
+        std::vector<family_run> runs{};
+        for (size_t i : sorted)
+        {
+            write_batch::entry const e = batch[i];
+            assert(e.family < this->families.size());
+            if (runs.empty() || runs.back().cf->id() != e.family) { runs.emplace_back(family_run{.cf = this->families[e.family].get()}); }
+
+            runs.back().order.emplace_back(i);
+            runs.back().entries.emplace_back(memtable::table::batch_entry{
+                .key = e.key,
+                .data = const_cast<char *>(e.value.data()),
+                .size = e.value.size(),
+                .type = e.type});
+        }
+
+        // Each family's writes are claimed in its memtable, rotating it first if it lacks the room, so the batch lands whole in one table
+        // of each family. The batch's sequences are then taken as a block, as a single write takes its one (see "write_sequence"):
+        // if any of the tables was locked first, the block is abandoned, and the batch retried in their replacements.
+        // Families are claimed in order, so writers rotating a family only wait on claims of the families before it.
+        sequence_t first{};
+        while (true)
+        {
+            for (family_run & run : runs)
+            {
+                while (true)
+                {
+                    run.mtable = run.cf->mtable;
+                    if (std::optional<int32_t> const claimed = run.mtable->claim(run.entries.size()))
+                    {
+                        run.first_record = *claimed;
+                        break;
+                    }
+
+                    // a batch too large for any table of the family gets a table of its own
+                    size_t const capacity = run.cf->config.memtable_options.writes_before_lock;
+                    this->save_memtable(*run.cf, run.mtable, run.entries.size() > capacity ? run.entries.size() : 0);
+                }
+            }
+
+            first = this->next_sequence(batch.size());
+            if (std::none_of(runs.begin(), runs.end(), [](family_run const & run) { return run.mtable->lock_taken(); })) { break; }
+
+            for (family_run & run : runs) { run.mtable->release_claim(); }
+            this->publish(first + batch.size() - 1, batch.size());
+        }
+
+        // The writes are not read until the batch is published
+        for (family_run & run : runs)
+        {
+            for (size_t i = 0; i < run.entries.size(); i++) { run.entries[i].sequence = first + run.order[i]; }
+            run.mtable->write_claimed(run.first_record, run.entries);
+            run.mtable->release_claim();
+        }
+
+        this->wal.load()->log_batch(first, batch, d);
+        this->publish(first + batch.size() - 1, batch.size());
     }
 
     // Fetches the value bytes for a given key, returning true if the key is in the store
     // iff the key is found, the data will be copied into "data_out", which will be resized as needed.
-    bool get(std::string_view key, std::vector<std::byte> & data_out) const
+    // If "at" is set, the key is read as it was when the snapshot was taken.
+    // Otherwise, it is read as of the last write published, so no write in progress (or part of a batch) is seen.
+    bool get(std::string_view key, std::vector<std::byte> & data_out, snapshot const * at = nullptr) const
+    {
+        return this->get(this->default_family(), key, data_out, at);
+    }
+
+    bool get(column_family const & cf, std::string_view key, std::vector<std::byte> & data_out, snapshot const * at = nullptr) const
+    {
+        // pin the epoch, so the memtables we walk are not freed by a concurrent flush until we are done.
+        epoch::guard pin{};
+        std::span<std::byte const> value{};
+        std::shared_ptr<void const> mapping{};
+        lookup const found = this->find(cf, key, value, mapping, at);
+        return copy(found, value, data_out) == lookup::found;
+    }
+
+    // As above, but a value in an sst file is read in place, and the file is pinned until "value_out" is released
+    // (see pinned_value.h). Values in memtables, and values smaller than "pin_min_bytes", are copied.
+    bool get(std::string_view key, pinned_value & value_out, snapshot const * at = nullptr) const
+    {
+        return this->get(this->default_family(), key, value_out, at);
+    }
+
+    bool get(column_family const & cf, std::string_view key, pinned_value & value_out, snapshot const * at = nullptr) const
+    {
+        value_out.reset();
+
+        // A memtable is only kept alive by the epoch, whose guards are bound to the thread that takes them,
+        // and which holds back every flushed table while pinned, so a value found in one is copied before the guard is released.
+        epoch::guard pin{};
+        std::span<std::byte const> value{};
+        std::shared_ptr<void const> mapping{};
+        if (this->find(cf, key, value, mapping, at) != lookup::found) { return false; }
+
+        if (mapping && value.size() >= this->config.pin_min_bytes) { value_out.pin_to(value, std::move(mapping)); }
+        else { value_out.copy_from(value); }
+        return true;
+    }
+
+    // Awaitable "get", for coroutines (see async.h): "bool found = co_await store.async_get(key, data)".
+    // The memtables are searched at once, and only a read that reaches the sst files suspends the coroutine,
+    // to be finished on the job pool. "key" and "data_out" must stay valid until the read completes.
+    async::on_pool<bool> async_get(std::string_view key, std::vector<std::byte> & data_out, snapshot const * at = nullptr) const
+    {
+        return this->async_get(this->default_family(), key, data_out, at);
+    }
+
+    async::on_pool<bool> async_get(column_family const & cf, std::string_view key, std::vector<std::byte> & data_out,
+                                   snapshot const * at = nullptr) const
+    {
+        std::optional<bool> ready{};
+        {
+            epoch::guard pin{};
+            std::span<std::byte const> value{};
+            sequence_t const seq = at ? at->sequence() : this->published.load();
+            lookup const found = this->find_in_memory(cf, key, table::hash(key), value, seq);
+            if (found != lookup::missing) { ready = copy(found, value, data_out) == lookup::found; }
+        }
+
+        return {*this->jobs, ready, [this, &cf, key, &data_out, at] { return this->get(cf, key, data_out, at); }};
+    }
+
+    // Fetches several keys at once, returning whether each is in the store, as "get" would for each of them.
+    // "values_out" is resized to the number of keys, and receives the value of each key found, in the order of "keys".
+    // Every key is read at the same sequence, so the results are consistent with each other.
+    // The keys are searched in key order, each memtable being probed once for the whole batch, and the lookups left
+    // for the sst files are run in parallel on the job pool, so a batch costs little more than its slowest lookup.
+    std::vector<bool> multi_get(std::span<std::string_view const> keys, std::vector<std::vector<std::byte>> & values_out,
+                                snapshot const * at = nullptr) const
+    {
+        return this->multi_get(this->default_family(), keys, values_out, at);
+    }
+
+    std::vector<bool> multi_get(column_family const & cf, std::span<std::string_view const> keys,
+                                std::vector<std::vector<std::byte>> & values_out, snapshot const * at = nullptr) const
+    {
+        rate_limiter::sample timing{this->limiter.get()};
+
+        // each key is hashed once, for the bloom filters of all the in-memory tables
+        std::vector<probe> sorted{};
+        sorted.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) { sorted.emplace_back(probe{.key = keys[i], .hash = table::hash(keys[i]), .index = i}); }
+        std::sort(sorted.begin(), sorted.end(), [](probe const & l, probe const & r) { return l.key < r.key; });
+
+        values_out.resize(keys.size());
+        std::vector<lookup> results(keys.size());
+
+        epoch::guard pin{};
+multi_get_retry:
+        sequence_t const seq = at ? at->sequence() : this->published.load();
+        std::vector<probe> pending{sorted};
+
+        // drops the keys "search" finds, or finds deleted, from those pending
+        auto const resolve = [&](auto const & search) {
+            std::erase_if(pending, [&](probe const & p) {
+                results[p.index] = search(p);
+                return results[p.index] != lookup::missing;
+            });
+        };
+
+        // the filter bits of every key are fetched before any is probed, so their cache misses overlap
+        table const * mt = cf.mtable.load();
+        for (probe const & p : pending) { mt->prefetch(p.hash); }
+        resolve([&](probe const & p) { return mt->get(p.key, p.hash, values_out[p.index], seq); });
+
+        for (hist_node * n = cf.hist; n && !pending.empty(); n = n->next)
+        {
+            sorted_table const * st = n->sorted;
+            for (probe const & p : pending) { n->table->prefetch(p.hash); }
+            resolve([&](probe const & p) {
+                return st ? st->get(p.key, p.hash, values_out[p.index], seq) : n->table->get(p.key, p.hash, values_out[p.index], seq);
+            });
+        }
+
+        // then the row cache, whose generation is taken before the files are read (see "find")
+        row_cache * cache = at ? nullptr : cf.cache.get();
+        uint64_t const generation = cache ? cache->generation() : 0;
+        if (cache)
+        {
+            std::erase_if(pending, [&](probe const & p) {
+                row_cache::value_ptr const cached = cache->get(p.key);
+                if (!cached) { return false; }
+
+                values_out[p.index] = *cached;
+                results[p.index] = lookup::found;
+                return true;
+            });
+        }
+
+        // see "find"
+        version const * v = cf.current.load();
+        if (!at && this->retained.load() > seq) { goto multi_get_retry; }
+
+        this->read_files(pending, [&](probe const & p) { results[p.index] = v->get(p.key, values_out[p.index], seq); });
+        if (cache && v->largest_sequence() <= seq)
+        {
+            for (probe const & p : pending)
+            {
+                if (results[p.index] == lookup::found) { cache->insert(p.key, values_out[p.index], generation); }
+            }
+        }
+
+        std::vector<bool> found(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) { found[i] = results[i] == lookup::found; }
+        return found;
+    }
+
+    config_options const config;
+
+private:
+    // creates a column family, and its first memtables. Called by the constructor, before the background thread starts.
+    void add_family(family_options const & opts)
+    {
+        for ([[maybe_unused]] auto const & cf : this->families)
+        {
+            assert(cf->config.name != opts.name);
+            assert(cf->config.sst_options.base_dir != opts.sst_options.base_dir);
+        }
+
+        std::filesystem::create_directories(opts.sst_options.base_dir);
+
+        auto & cf = this->families.emplace_back(new column_family(opts, uint32_t(this->families.size())));
+        if (opts.enable_row_cache) { cf->cache = std::make_unique<row_cache>(opts.row_cache_options); }
+        cf->mtable = this->new_memtable(*cf);
+        cf->standby = this->new_memtable(*cf);
+    }
+
+    // a new WAL, naming every column family before anything is logged to it
+    walfile * new_wal() const
+    {
+        walfile * wal = new walfile(this->config.wal_options);
+        for (auto const & cf : this->families) { wal->name_family(cf->id(), cf->config.name); }
+        return wal;
+    }
+
+    // Looks "key" up in the memtables, then the sst files, referencing its value in place if it is found.
+    // Values found in a file are kept mapped by "mapping". Values found in a memtable are valid while the caller's epoch is pinned.
+    lookup find(column_family const & cf, std::string_view key, std::span<std::byte const> & value_out, std::shared_ptr<void const> & mapping,
+                snapshot const * at) const
     {
+        // a sample of reads are timed, to tune the rate of background writes
+        rate_limiter::sample timing{this->limiter.get()};
+
         // first check our memtable
-        skiptable::record const * record = this->mtable->get(key);
-        if (record)
+        // the key is hashed once for the bloom filters of all the in-memory tables
+        table::key_hash const hash = table::hash(key);
+
+        // Each table, and then each file, is checked until one holds the key, or deletes it.
+find_retry:
+        sequence_t const seq = at ? at->sequence() : this->published.load();
+        if (lookup const found = this->find_in_memory(cf, key, hash, value_out, seq); found != lookup::missing) { return found; }
+
+        // then the row cache, which holds the newest values in the files. The generation is taken before the files are read,
+        // so a value is not cached if a flush has since installed a newer version of the key.
+        row_cache * cache = at ? nullptr : cf.cache.get();
+        uint64_t const generation = cache ? cache->generation() : 0;
+        if (cache)
         {
-            data_out.resize(record->size);
-            memcpy(data_out.data(), record->data, record->size);
-            return true;
+            if (row_cache::value_ptr cached = cache->get(key))
+            {
+                value_out = *cached;
+                mapping = std::move(cached);
+                return lookup::found;
+            }
         }
 
+        // now check through our sst files, from most -> least recent, ensuring freshness of data.
+        // The current version is immutable, and is not freed while we are pinned, so no lock is needed.
+        version const * v = cf.current.load();
+
+        // Without a snapshot, the read is unknown to flushes and compactions, which drop the versions hidden from every read
+        // at or after the last published sequence as they start. If one has started since our sequence was taken,
+        // its files may lack the version we would read, so the read is restarted at the newer sequence.
+        if (!at && this->retained.load() > seq) { goto find_retry; }
+
+        // A flush may install a write that is not yet published, and erase the key from the cache before we fill it.
+        // The value read is then older than the files' newest, so it is only cached if no file holds a write after "seq".
+        lookup const found = v->get(key, value_out, mapping, seq);
+        if (cache && found == lookup::found && v->largest_sequence() <= seq) { cache->insert(key, value_out, generation); }
+        return found;
+    }
+
+    // Looks "key" up in the memtables alone, at "seq". Requires the caller's epoch to be pinned.
+    lookup find_in_memory(column_family const & cf, std::string_view key, table::key_hash const & hash, std::span<std::byte const> & value_out,
+                          sequence_t seq) const
+    {
+        lookup found = cf.mtable.load()->get(key, hash, value_out, seq);
+        if (found != lookup::missing) { return found; }
+
         // now check old memtables, most recent first
-        hist_node * n = this->hist;
+        // once the background thread has built a sorted index for a table, it is searched in place of the skiplist
+        hist_node * n = cf.hist;
         while (n)
         {
-            record = n->table->get(key);
-            if (record)
-            {
-                data_out.resize(record->size);
-                memcpy(data_out.data(), record->data, record->size);
-                return true;
-            }
+            sorted_table const * sorted = n->sorted;
+            found = sorted ? sorted->get(key, hash, value_out, seq) : n->table->get(key, hash, value_out, seq);
+            if (found != lookup::missing) { return found; }
 
             n = n->next;
         }
 
-        // now check through our sst files. As the priority queue is sorted by timestamp,
-        // the files will be checked from most -> least recent, ensuring freshness of data
-        // we take a read-lock on the shared mutex here, which will block the brackground thread
-        // issues with sst files not being created (and/or in-memory history growing unbounded)
-        // can likely be traced to get-requests starving the background thread
-        std::shared_lock sst_lock{this->sst_mutex};
-        for (auto const & entry : this->sstq) { if (entry.get(key, data_out)) { return true; } }
-
-        return false;
+        return lookup::missing;
     }
 
-    config_options const config;
+    // a key of a "multi_get", at "index" in the batch
+    struct probe
+    {
+        std::string_view key{};
+        table::key_hash hash{};
+        size_t index{};
+    };
 
-private:
-    // lock our current memtable and add it to the history
+    // The state of a "read_files" call, shared with the jobs it submits.
+    // A job may start after every chunk of keys is claimed, or even after the call returns, so it reads nothing
+    // but this state unless it claims a chunk - and the call waits for every claimed chunk to be read.
+    struct file_reads
+    {
+        // reads the ith chunk of keys
+        std::function<void(size_t)> read{};
+        size_t chunks{};
+        std::atomic_size_t next{};
+        std::atomic_size_t done{};
+        std::mutex done_mutex{};
+        std::condition_variable all_done{};
+
+        // reads chunks until none are left to claim
+        void run()
+        {
+            for (size_t c = this->next.fetch_add(1); c < this->chunks; c = this->next.fetch_add(1))
+            {
+                this->read(c);
+                if (this->done.fetch_add(1) + 1 == this->chunks)
+                {
+                    std::lock_guard lock{this->done_mutex};
+                    this->all_done.notify_all();
+                }
+            }
+        }
+    };
+
+    // An item in the flush queue: a table of a family waiting for its sst file to be installed,
+    // or a WAL that may be removed once every table queued before it is installed
+    struct flush_item
+    {
+        column_family * family{};
+        hist_node * table{};
+        walfile * wal{};
+        // logs read at startup, whose writes were in the tables queued before this item
+        std::vector<std::filesystem::path> recovered{};
+    };
+
+    // lock the passed memtable, replace it as the family's current memtable and add it to the history
     // we want to insert this as the "head" of the history list, so that more recent values are read first,
     // before older tables are checked when serving "get" operations
-    void save_memtable()
+    // The replacement is normally the standby table prepared by the background thread, making this a pointer swap.
+    // If several writers find the same table full, only the first to lock it performs the rotation.
+    // The table is added to the history before it is replaced, so a reader that finds the replacement as the memtable
+    // always finds the full table in the history (a reader may find it in both, which only repeats a search).
+    // If "capacity" is set, the replacement is a new table taking that many writes, for a batch too large for the family's tables.
+    void save_memtable(column_family & cf, table * full, size_t capacity = 0)
+    {
+        if (full->empty() && capacity == 0) { return; }
+
+        // Writes that find the table locked are retried in the replacement, so it must be locked before the replacement is installed.
+        // Another thread rotated the table first if it was already locked.
+        if (full->lock()) { return; }
+
+        table * replacement = capacity > 0 ? this->new_memtable(cf, capacity) : this->take_standby(cf);
+
+        // a table only replaced to make room for a batch holds nothing to flush. Writers may still be refusing writes to it,
+        // so it is recycled once they are done
+        if (full->empty())
+        {
+            cf.mtable = replacement;
+            this->reclaimer.retire([this, &cf, full] { this->recycle(cf, std::unique_ptr<table>(full)); });
+            return;
+        }
+
+        hist_node * hn = new hist_node{.table=std::unique_ptr<table>(full)};
+        hist_node * head = cf.hist;
+        do { hn->next = head; } while (!cf.hist.compare_exchange_weak(head, hn));
+
+        cf.mtable = replacement;
+
+        // the background thread indexes or flushes the table, and replaces the standby we used
+        this->wake_background();
+    }
+
+    void wake_background()
+    {
+        {
+            std::lock_guard lock{this->work_mutex};
+            this->work_pending = true;
+        }
+
+        this->work_cv.notify_one();
+    }
+
+    // allocates an empty memtable of the family's engine, drawing its memory from the write buffer.
+    // The table takes the family's configured number of writes, or "capacity", if larger.
+    memtable::table * new_memtable(column_family const & cf, size_t capacity = 0)
+    {
+        table::config_opts opts = cf.config.memtable_options;
+        opts.writes_before_lock = std::max(opts.writes_before_lock, capacity);
+        switch (opts.engine)
+        {
+            case table::engine_type::art: return new art_table(opts, this->write_buffer.get(), &this->reclaimer);
+            case table::engine_type::skiplist: break;
+        }
+
+        return new skiptable(opts, this->write_buffer.get());
+    }
+
+    // returns an empty table to replace the family's current memtable, preferring the prepared standby,
+    // then the recycled pool, and only allocating on the writer's path when the background thread has fallen behind
+    table * take_standby(column_family & cf)
+    {
+        if (memtable::table * table = cf.standby.exchange(nullptr)) { return table; }
+
+        {
+            std::lock_guard pool_lock{cf.pool_mutex};
+            if (!cf.pool.empty())
+            {
+                memtable::table * table = cf.pool.back().release();
+                cf.pool.pop_back();
+                return table;
+            }
+        }
+
+        return this->new_memtable(cf);
+    }
+
+    // offers an unused empty table back as the standby, or to the pool if a standby is already present
+    void return_standby(column_family & cf, memtable::table * table)
+    {
+        memtable::table * expected{};
+        if (cf.standby.compare_exchange_strong(expected, table)) { return; }
+
+        this->recycle(cf, std::unique_ptr<memtable::table>(table));
+    }
+
+    // resets a table no longer in use and keeps it for reuse, or frees it once the pool is full.
+    // Tables made larger for a batch are always freed.
+    void recycle(column_family & cf, std::unique_ptr<memtable::table> table)
+    {
+        if (table->config.writes_before_lock != cf.config.memtable_options.writes_before_lock) { return; }
+
+        table->reset();
+        std::lock_guard pool_lock{cf.pool_mutex};
+        if (cf.pool.size() < cf.config.memtable_pool_size) { cf.pool.emplace_back(std::move(table)); }
+    }
+
+    // ensures a standby table is ready for the family's next rotation. Executed by the background thread.
+    void prepare_standby(column_family & cf)
     {
-        if (this->mtable->empty()) { return; }
+        if (cf.standby.load()) { return; }
 
-        auto mt = std::make_unique<skiptable>(this->config.memtable_options);
-        std::swap(this->mtable, mt);
-        mt->lock();
+        std::unique_ptr<memtable::table> table{};
+        {
+            std::lock_guard pool_lock{cf.pool_mutex};
+            if (!cf.pool.empty())
+            {
+                table = std::move(cf.pool.back());
+                cf.pool.pop_back();
+            }
+        }
 
-        hist_node * hn = new hist_node{.table=std::move(mt)};
-        do { hn->next = this->hist; } while (!this->hist.compare_exchange_weak(hn->next, hn));
+        if (!table) { table.reset(this->new_memtable(cf)); }
+        this->return_standby(cf, table.release());
     }
 
     // flush our memtable history to sst files, reseting the WAL and flushing the in-memory data to disk
-    // This may block while trying to acquire the sst mutex.
-    // This is _ok_ because we only run this in the background thread.
-    // However, if that thread seems to be hanging, or "get" operations are blocked on the mutex,
-    // this is where to debug
+    // Each table not already being flushed is written by a job on the pool, so several tables are written in parallel,
+    // while their files are installed in history order, oldest first, by "install_flushed".
+    // Every column family is flushed at once, as they share the WAL, which is only removed once all their tables logged in it are.
+    // Executed by the background thread, and at shutdown.
     void flush_memtables()
     {
-        this->save_memtable();
+        // swap out the WAL before rotating the memtables, so that every write to the new memtables is logged in the new WAL.
+        // Don't delete the old one until the flushed tables are in sst files, in case we crash in this process.
+        // The old WAL is queued under the same lock, so a flush job always finds every WAL its table's writes may be logged in.
+        std::lock_guard lock{this->install_mutex};
+        walfile * old_wal = this->wal.exchange(this->new_wal());
 
-        // swap out the WAL, but don't delete the old one yet, in case we crash in this process
-        // the old WAL will be cleaned up after this block exits
-        auto wf = std::make_unique<walfile>(this->config.wal_options);
-        std::swap(this->wal, wf);
+        for (auto & cf : this->families) { this->save_memtable(*cf, cf->mtable); }
+
+        // Tables already being flushed are always the oldest in the history, so the new ones are those before them.
+        // Flushing tables may be detached concurrently, but are not freed while we are pinned.
+        std::vector<flush_item> tables{};
+        {
+            epoch::guard pin{};
+            for (auto & cf : this->families)
+            {
+                size_t const first = tables.size();
+                for (hist_node * n = cf->hist; n && !n->flushing; n = n->next) { tables.emplace_back(flush_item{.family = cf.get(), .table = n}); }
+                std::reverse(tables.begin() + first, tables.end());
+            }
+        }
 
-        hist_node * save = this->hist.exchange(nullptr);
-        while (save)
+        for (flush_item const & item : tables)
         {
-            this->sst_mutex.lock();
-            this->sstq.emplace(this->config.sst_options, *save->table);
-            this->sst_mutex.unlock();
+            column_family * cf = item.family;
+            hist_node * n = item.table;
+            n->flushing = true;
+            n->flush_time = this->next_file_time();
+            this->flush_queue.emplace_back(item);
+            this->flush_jobs += 1;
+
+            this->jobs->submit(job_pool::priority::flush, [this, cf, n] {
+                this->index_memtable(*n);
+                this->await_logged(*n);
+                sorted_table const & sorted = *n->sorted.load();
+                version::file_ptr file{};
+                if (sorted.size() > 0 || !sorted.deleted_ranges().ranges().empty())
+                {
+                    file = std::make_shared<sstable const>(cf->config.sst_options, sorted, n->flush_time,
+                        [this](size_t bytes) { this->limiter->request(bytes, rate_limiter::priority::flush); }, this->snapshot_retention());
+                }
+
+                {
+                    std::lock_guard lock{this->install_mutex};
+                    n->file = std::move(file);
+                    n->written = true;
+                    this->install_flushed();
+                }
 
-            hist_node * delnode = save;
-            save = save->next;
-            delete delnode;
+                this->reclaimer.collect();
+
+                // the job's last access to the store - once the count is zero, the store may be destroyed
+                std::lock_guard lock{this->install_mutex};
+                this->flush_jobs -= 1;
+                this->flushed.notify_all();
+            });
         }
+
+        this->flush_queue.emplace_back(flush_item{.wal = old_wal, .recovered = std::move(this->recovered_wals)});
+        this->recovered_wals.clear();
+        this->install_flushed();
     }
 
-    // this function (executed by our background thread) periodically wakes and flushes memtables to disk as sst files
+    // Installs the sst files of flushed tables, in the order they were queued, stopping at the first not yet written.
+    // Each table is then detached from its family's history - as the oldest table, it is always the last - and retired.
+    // Requires "install_mutex".
+    void install_flushed()
+    {
+        size_t const queued = this->flush_queue.size();
+        while (!this->flush_queue.empty())
+        {
+            flush_item const item = this->flush_queue.front();
+            if (item.table)
+            {
+                column_family & cf = *item.family;
+                if (!item.table->written) { break; }
+                if (item.table->file) { this->install(cf, item.table->file); }
+
+                // the table's keys now have newer versions in the files than any cached
+                if (cf.cache && item.table->file)
+                {
+                    sorted_table const & sorted = *item.table->sorted.load();
+                    for (size_t i = 0; i < sorted.size(); i++) { cf.cache->erase(sorted.key(i)); }
+                    for (range_tombstones::range const & r : sorted.deleted_ranges().ranges()) { cf.cache->erase_range(r.begin, r.end); }
+                }
+
+                // writers may have pushed newer tables in front of it
+                hist_node * newer = item.table;
+                if (!cf.hist.compare_exchange_strong(newer, nullptr))
+                {
+                    while (newer->next != item.table) { newer = newer->next; }
+                    newer->next = nullptr;
+                }
+
+                // readers may still be walking the detached table, so it is recycled once they are done,
+                // and once the iterators pinning it (and its sorted index) are destroyed
+                this->reclaimer.retire([this, &cf, n = item.table] {
+                    n->table->release_unpinned([this, &cf, n] {
+                        this->recycle(cf, std::move(n->table));
+                        delete n;
+                    });
+                });
+            }
+            else
+            {
+                // every table logged in the WAL is installed, and its file and the manifest listing it synced, so removing the log
+                // loses no write, even to a crash of the machine
+                this->reclaimer.retire([wal = item.wal] { delete wal; });
+                for (std::filesystem::path const & log : item.recovered) { std::filesystem::remove(log); }
+            }
+
+            this->flush_queue.pop_front();
+        }
+
+        if (this->flush_queue.size() != queued)
+        {
+            for (auto & cf : this->families) { this->schedule_compaction(*cf); }
+        }
+    }
+
+    // Submits the family's next compaction, if one is needed and none is running. Compactions of a family run one at a time,
+    // each scheduling the next as it completes, so that every compaction is chosen from the files left by the last.
+    // Requires "install_mutex".
+    void schedule_compaction(column_family & cf)
+    {
+        if (cf.compacting || this->exit) { return; }
+
+        std::optional<compaction> next = compaction::pick(*cf.current.load(), cf.config.compaction_options, cf.compaction_keys);
+        if (!next) { return; }
+
+        cf.compacting = true;
+        this->jobs->submit(job_pool::priority::compaction, [this, &cf, c = std::move(*next)] {
+            std::vector<version::file_ptr> outputs = c.run(cf.config.sst_options, cf.config.compaction_options, this->snapshot_retention(),
+                [this] {
+                    std::lock_guard lock{this->install_mutex};
+                    return this->next_file_time();
+                },
+                [this](size_t bytes) { this->limiter->request(bytes, rate_limiter::priority::compaction); });
+
+            {
+                std::lock_guard lock{this->install_mutex};
+                version const * old = cf.current.exchange(cf.current.load()->apply(c.inputs, c.output_level, outputs));
+                cf.current.load()->save(cf.config.sst_options.base_dir);
+                this->reclaimer.retire([old] { delete old; });
+
+                // readers of the replaced version, and iterators, may still be reading the input files, so they are removed
+                // once the last reference to them is released
+                for (version::file_ptr const & file : c.inputs)
+                {
+                    if (std::find(outputs.begin(), outputs.end(), file) == outputs.end()) { file->make_obsolete(); }
+                }
+            }
+
+            this->reclaimer.collect();
+
+            // the job's last access to the store - once no compaction is running, the store may be destroyed
+            std::lock_guard lock{this->install_mutex};
+            cf.compacting = false;
+            this->schedule_compaction(cf);
+            this->flushed.notify_all();
+        });
+    }
+
+    // a new, unique time to name an sst file, later than that of every file written before.
+    // Requires "install_mutex".
+    std::chrono::steady_clock::time_point next_file_time()
+    {
+        this->last_file_time = std::max(std::chrono::steady_clock::now(), this->last_file_time + 1ns);
+        return this->last_file_time;
+    }
+
+    // Runs "read" for each of "keys", in chunks of "multi_get_job_keys" shared between this thread and the job pool.
+    // Sst lookups mostly wait on the file system, so running them concurrently overlaps their latency.
+    template <typename Read>
+    void read_files(std::span<probe const> keys, Read const & read) const
+    {
+        size_t const per_job = std::max<size_t>(this->config.multi_get_job_keys, 1);
+        if (keys.size() <= per_job)
+        {
+            for (probe const & p : keys) { read(p); }
+            return;
+        }
+
+        auto reads = std::make_shared<file_reads>();
+        reads->chunks = (keys.size() + per_job - 1) / per_job;
+        reads->read = [&](size_t c) {
+            for (probe const & p : keys.subspan(c * per_job, std::min(per_job, keys.size() - c * per_job))) { read(p); }
+        };
+
+        // this thread reads a share too, so the helpers are only needed for the rest
+        for (size_t i = 1; i < reads->chunks; i++) { this->jobs->submit(job_pool::priority::read, [reads] { reads->run(); }); }
+        reads->run();
+
+        std::unique_lock lock{reads->done_mutex};
+        reads->all_done.wait(lock, [&] { return reads->done.load() == reads->chunks; });
+    }
+
+    // takes the sequences for "count" new writes, returning the first
+    sequence_t next_sequence(size_t count = 1) { return this->last_sequence.fetch_add(count) + 1; }
+
+    // the body of "put", once any delay for the memory budget is over
+    void write_value(column_family & cf, std::string_view key, void * data, size_t data_size, std::optional<durability> d)
+    {
+        // the memtable and WAL we load may be retired by a concurrent flush, but are not freed while we are pinned
+        epoch::guard pin{};
+
+        // the sequence is taken by the memtable that accepts the write (see "write_sequence")
+        write_sequence const sequence{this->last_sequence};
+
+put_retry:
+        memtable::table * table = cf.mtable;
+        memtable::table::entry const * node = table->insert(key, data, data_size, sequence);
+        // failure indicates the memtable is full / locked - retry after rereshing the table
+        if (!node)
+        {
+            this->save_memtable(cf, table);
+            goto put_retry;
+        }
+
+        this->complete_abandoned(sequence);
+        this->wal.load()->log(table::value_type::value, cf.id(), sequence.taken(), key, {reinterpret_cast<char const *>(data), data_size}, d);
+        this->publish(sequence.taken());
+    }
+
+    // whether the memtables are under their memory budget, where "put" would not block
+    bool has_room() const { return this->write_buffer->usage() < this->write_buffer->config.buffer_size; }
+
+    // completes the sequences a write abandoned in memtables locked as it took them, as they hold no write
+    void complete_abandoned(write_sequence const & sequence)
+    {
+        for (sequence_t abandoned : sequence.abandoned()) { this->publish(abandoned); }
+    }
+
+    // Marks the "count" writes up to "sequence" complete.
+    // Reads are made at the last published sequence, so they see every write at or below it, and none still in progress.
+    // Writes complete in any order, each waiting only for its own durability: the completion is recorded, and whichever
+    // writer completes the write following the published sequence advances it over every completed write after it.
+    void publish(sequence_t sequence, size_t count = 1)
+    {
+        sequence_t const first = sequence - count + 1;
+
+        // the completion is recorded in the slot of its first sequence, which is free once the write a ring before it is published.
+        // Only a writer that far ahead of the slowest write in progress waits.
+        for (sequence_t p = this->published.load(); first - p > COMPLETIONS; p = this->published.load()) { this->published.wait(p); }
+        this->completions[first % COMPLETIONS].store(sequence);
+
+        // A slot holding a sequence at or below the published one was left by a write a ring earlier, so the write it stands for
+        // is still in progress. Its writer then advances past us, as our completion is stored before it reads the slot.
+        sequence_t p = this->published.load();
+        while (true)
+        {
+            sequence_t const end = this->completions[(p + 1) % COMPLETIONS].load();
+            if (end <= p) { return; }
+            if (this->published.compare_exchange_strong(p, end))
+            {
+                this->published.notify_all();
+                p = end;
+            }
+        }
+    }
+
+    // The sources of an iterator over a family reading at "seq", newest first: the memtables, each level 0 file, and each deeper level.
+    // Only the files that may hold keys starting with "prefix" are read.
+    // The memtables read are added to "pinned", and kept until the caller unpins them. The files are kept by the sources.
+    std::vector<std::unique_ptr<merging_iterator::source>> iterator_sources(column_family const & cf, std::string_view prefix, sequence_t seq,
+                                                                            std::vector<table *> & pinned) const
+    {
+        // the tables found are pinned before the epoch is released, so they outlive it
+        epoch::guard pin{};
+        std::vector<std::unique_ptr<merging_iterator::source>> sources{};
+
+        table * mtable = cf.mtable;
+        mtable->pin();
+        pinned.emplace_back(mtable);
+        sources.emplace_back(std::make_unique<merging_iterator::table_source>(*mtable, seq));
+        for (hist_node * n = cf.hist; n; n = n->next)
+        {
+            n->table->pin();
+            pinned.emplace_back(n->table.get());
+            if (sorted_table const * sorted = n->sorted) { sources.emplace_back(std::make_unique<merging_iterator::sorted_source>(*sorted, seq)); }
+            else { sources.emplace_back(std::make_unique<merging_iterator::table_source>(*n->table, seq)); }
+        }
+
+        std::optional<std::string> const end = merging_iterator::successor(prefix);
+        auto const holds_prefix = [&](version::file_ptr const & file) {
+            return prefix <= file->largest() && (!end || file->smallest() < *end);
+        };
+
+        version const * v = cf.current;
+        for (version::file_ptr const & file : v->levels[0])
+        {
+            if (holds_prefix(file)) { sources.emplace_back(std::make_unique<merging_iterator::files_source>(std::vector{file}, seq)); }
+        }
+
+        for (size_t n = 1; n < v->levels.size(); n++)
+        {
+            std::vector<version::file_ptr> files{};
+            std::copy_if(v->levels[n].begin(), v->levels[n].end(), std::back_inserter(files), holds_prefix);
+            if (!files.empty()) { sources.emplace_back(std::make_unique<merging_iterator::files_source>(std::move(files), seq)); }
+        }
+
+        return sources;
+    }
+
+    // the versions of keys that a flush or compaction starting now must keep for the open snapshots
+    retention snapshot_retention()
+    {
+        std::lock_guard lock{this->snapshot_mutex};
+        sequence_t const horizon = this->published.load();
+        this->retained = horizon;
+        return retention(std::vector<sequence_t>(this->snapshots.begin(), this->snapshots.end()), horizon);
+    }
+
+    bool flushes_running()
+    {
+        std::lock_guard lock{this->install_mutex};
+        return this->flush_jobs > 0;
+    }
+
+    // publish a new version of the family with "file" as the newest sst file. The replaced version is freed once no reader holds it.
+    // Requires "install_mutex".
+    void install(column_family & cf, version::file_ptr file)
+    {
+        version const * old = cf.current.exchange(cf.current.load()->with(std::move(file)));
+        cf.current.load()->save(cf.config.sst_options.base_dir);
+        this->reclaimer.retire([old] { delete old; });
+    }
+
+    // build the sorted index for a table in the history, if it doesn't yet have one.
+    // Once readers use the sorted index, the table's own index is unused, and is freed as soon as no reader can be walking it.
+    void index_memtable(hist_node & n)
+    {
+        if (n.sorted.load()) { return; }
+
+        n.sorted = new sorted_table(*n.table);
+        this->reclaimer.retire([table = n.table.get()] { table->release_unpinned([table] { table->release_index(); }); });
+    }
+
+    // Waits until every write in a table being flushed is logged, and syncs the logs holding them.
+    // A batch is written to its tables before it is logged, and may span the tables of several families: a file holding part of it
+    // must not be installed, or its log removed, before the whole batch is durable, or a crash could recover only that part.
+    // The writes were logged to the log replaced as the table was queued, or to a later one, all of which outlive its install
+    // (see "flush_memtables").
+    void await_logged(hist_node const & n)
+    {
+        sorted_table const & sorted = *n.sorted.load();
+        sequence_t newest{};
+        for (size_t i = 0; i < sorted.size(); i++) { newest = std::max(newest, sorted.value(i)->sequence); }
+        for (range_tombstones::range const & r : sorted.deleted_ranges().ranges()) { newest = std::max(newest, r.sequence); }
+
+        // every write is logged before it is published
+        for (sequence_t p = this->published.load(); p < newest; p = this->published.load()) { this->published.wait(p); }
+
+        std::vector<walfile *> logs{};
+        {
+            std::lock_guard lock{this->install_mutex};
+            auto const queued = std::find_if(this->flush_queue.begin(), this->flush_queue.end(), [&](flush_item const & item) { return item.table == &n; });
+            for (auto it = queued; it != this->flush_queue.end(); it++)
+            {
+                if (it->wal) { logs.emplace_back(it->wal); }
+            }
+
+            logs.emplace_back(this->wal.load());
+        }
+
+        for (walfile * log : logs) { log->sync(); }
+    }
+
+    // build sorted indexes for the tables in the family's history, most recent first, as those are read first.
+    // Tables being flushed are indexed by their flush job.
+    void index_memtables(column_family & cf)
+    {
+        epoch::guard pin{};
+        for (hist_node * n = cf.hist; n && !n->flushing; n = n->next) { this->index_memtable(*n); }
+    }
+
+    // this function (executed by our background thread) waits for memtables to fill, and flushes them to disk as sst files
     void background()
     {
+        // the thread also wakes to sync the WAL, if it is synced periodically
+        std::chrono::milliseconds const sync_period = this->config.wal_options.sync_period;
+        std::chrono::milliseconds const period = sync_period.count() > 0
+            ? std::min(this->config.background_activity_period, sync_period) : this->config.background_activity_period;
+        std::chrono::steady_clock::time_point last_sync = std::chrono::steady_clock::now();
+
+        std::unique_lock lock{this->work_mutex};
         while (!this->exit)
         {
-            // If a period is passed in that's quite long, this will delay shutdown
-            // A potential improvement is to partition the wait into smaller increments to check for "exit"
-            auto const next_wake = std::chrono::steady_clock::now() + this->config.background_activity_period;
-            std::this_thread::sleep_until(next_wake);
+            this->work_cv.wait_for(lock, period, [this] { return this->work_pending || this->exit; });
+
+            // let further tables fill before we flush, unless we're shutting down
+            if (this->work_pending && this->config.flush_batching_delay.count() > 0)
+            {
+                this->work_cv.wait_for(lock, this->config.flush_batching_delay, [this] { return this->exit.load(); });
+            }
 
-            if (exit) { break; }
+            if (this->exit) { break; }
+            this->work_pending = false;
+            lock.unlock();
 
-            // Flush memtables to sst files if the history has grown excessively large
-            size_t hist_count{};
-            hist_node * n = this->hist;
-            while (n)
+            // The WAL is only replaced by this thread, so the log synced is not retired meanwhile.
+            // Writes logged without durability are written by the sync, too.
+            if (sync_period.count() > 0 && std::chrono::steady_clock::now() - last_sync >= sync_period)
             {
-                hist_count +=1;
-                n = n->next;
+                this->wal.load()->sync();
+                last_sync = std::chrono::steady_clock::now();
             }
 
-            if (hist_count > this->config.memtable_history)
+            // Flush memtables to sst files if the history of any family has grown excessively large
+            // Tables already being flushed are not counted.
+            bool history_full{};
+            bool in_memory{};
+            {
+                epoch::guard pin{};
+                for (auto & cf : this->families)
+                {
+                    size_t hist_count{};
+                    hist_node * n = cf->hist;
+                    while (n && !n->flushing)
+                    {
+                        hist_count +=1;
+                        n = n->next;
+                    }
+
+                    history_full = history_full || hist_count > cf->config.memtable_history;
+                    in_memory = in_memory || hist_count || !cf->mtable.load()->empty();
+                }
+            }
+
+            // Flush early if the memtables of the stores sharing our write buffer are using too much memory.
+            // Flushes already running will release memory shortly, so we don't add to them a flush of every small table that fills meanwhile.
+            bool const over_budget = this->write_buffer->should_flush() && in_memory && !this->flushes_running();
+            if (history_full || over_budget)
             {
                 this->flush_memtables();
             }
+            else { for (auto & cf : this->families) { this->index_memtables(*cf); } }
+
+            for (auto & cf : this->families) { this->prepare_standby(*cf); }
+            this->reclaimer.collect();
+
+            lock.lock();
         }
     }
 
-    std::unique_ptr<skiptable> mtable;
-    std::unique_ptr<walfile> wal;
+    // declared before the tables, which release their memory to it on destruction
+    std::shared_ptr<write_buffer_manager> const write_buffer;
 
-    struct hist_node
-    {
-        std::shared_ptr<skiptable> table{};
-        hist_node* next{};
-    };
+    std::shared_ptr<job_pool> const jobs;
 
-    std::atomic<hist_node *> hist{};
+    std::shared_ptr<rate_limiter> const limiter;
 
-    mutable std::shared_mutex sst_mutex{};
+    // the default family first, then the others in the order configured. A family's id is its index.
+    std::vector<std::unique_ptr<column_family>> families{};
 
-    // We can safely iterate over the p_queue because we only iterate under a reader/writer mutex,
-    // and therefore don't need to worry about priority inversion.
-    struct sst_queue : std::priority_queue<sstable>
-    {
-        // iterators are pass-through to the underlying priority_queue container
-        std::vector<sstable>::const_iterator  begin() const { return c.begin(); }
-        std::vector<sstable>::const_iterator end() const { return c.end(); }
-    } sstq{};
-    bool exit{};
+    // replaced on each flush. The old log is retired once the flushed tables are in sst files.
+    std::atomic<walfile *> wal{};
+    // the logs read at startup, removed once the next flush has installed the tables they were read into.
+    // Only used by the flush that takes them, under the background thread, or the constructor and destructor.
+    std::vector<std::filesystem::path> recovered_wals{};
+
+    // the sequence of the last write started, and of the last write published, after which every earlier write is complete
+    std::atomic<sequence_t> last_sequence{};
+    std::atomic<sequence_t> published{};
+    // the last sequence of each completed write not yet published, in the slot of its first sequence (see "publish")
+    static constexpr size_t COMPLETIONS{4096};
+    std::vector<std::atomic<sequence_t>> completions = std::vector<std::atomic<sequence_t>>(COMPLETIONS);
+    // the sequences of the open snapshots
+    std::mutex snapshot_mutex{};
+    std::multiset<sequence_t> snapshots{};
+    // the horizon of the last retention taken (see "find")
+    std::atomic<sequence_t> retained{};
+
+    // serializes flush submission and the installation of new versions. Readers never take it.
+    std::mutex install_mutex{};
+    // tables being flushed, and the WALs they were logged in, in the order they must be installed
+    std::deque<flush_item> flush_queue{};
+    // the flush jobs still running, signalled by "flushed" as each completes
+    size_t flush_jobs{};
+    std::condition_variable flushed{};
+    std::chrono::steady_clock::time_point last_file_time{};
+    // frees the memtables and logs retired by flushes, once no reader can still be using them
+    epoch::reclaimer reclaimer{};
+    // wakes the background thread. "exit" and "work_pending" are set under "work_mutex", so no wake is missed.
+    std::mutex work_mutex{};
+    std::condition_variable work_cv{};
+    bool work_pending{};
+    std::atomic_bool exit{};
     std::thread background_thread{};
 };
 
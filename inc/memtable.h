@@ -10,19 +10,169 @@
 #include <vector>
 #include <cassert>
 #include <cstring>
+#include <span>
+#include <algorithm>
+#include <optional>
+#include <functional>
+#include <mutex>
+#include <bloom_filters.h>
+#include <sequence.h>
+#include <write_buffer.h>
 
 using namespace KVSTORE_NS::literals;
 
 namespace KVSTORE_NS::memtable
 {
 
-struct skiptable
+// The outcome of looking a key up in one table or file. Tables and files are searched newest first,
+// and the search stops at the first that holds a version of the key, or deletes it, visible to the read.
+enum class lookup
 {
-    // The maximum depth of the underlying skip-list. Higher values will increase the space required for the table,
-    // and will increase the probability of stale data being returned for "get" operations.
-    // However, search times for data in the table will decrease with higher values.
-    // Therefore, read-heavy workloads may benefit from higher values.
-    static size_t constexpr MAX_TABLE_LEVELS{16};
+    missing,
+    found,
+    deleted,
+};
+
+// copies a value found in place into "data_out", resized as needed, if the lookup found it
+inline lookup copy(lookup found, std::span<std::byte const> value, std::vector<std::byte> & data_out)
+{
+    if (found == lookup::found)
+    {
+        data_out.resize(value.size());
+        memcpy(data_out.data(), value.data(), value.size());
+    }
+
+    return found;
+}
+
+// A set of deleted key ranges, each from "begin" up to (not including) "end", written at "sequence".
+// A range deletes the versions of the keys in it with lower sequences, from reads at or after its own sequence.
+// The ranges are held in order of "begin", along with the furthest end of any range up to each,
+// so the ranges covering a key are found by binary search, then a walk back over those which may reach it.
+struct range_tombstones
+{
+    struct range
+    {
+        std::string begin{};
+        std::string end{};
+        sequence_t sequence{};
+    };
+
+    range_tombstones() = default;
+
+    // holds the passed ranges, in any order. Empty ranges are dropped.
+    explicit range_tombstones(std::vector<range> ranges)
+    {
+        std::erase_if(ranges, [](range const & r) { return !(r.begin < r.end); });
+        std::sort(ranges.begin(), ranges.end(), [](range const & l, range const & r) { return l.begin < r.begin; });
+        this->items = std::move(ranges);
+
+        this->reach.reserve(this->items.size());
+        for (uint32_t i = 0; i < this->items.size(); i++)
+        {
+            bool const further = this->reach.empty() || this->items[this->reach.back()].end < this->items[i].end;
+            this->reach.emplace_back(further ? i : this->reach.back());
+        }
+    }
+
+    bool empty() const { return this->items.empty(); }
+
+    std::vector<range> const & ranges() const { return this->items; }
+
+    // the extent of the ranges. Requires !empty()
+    std::string_view smallest() const { return this->items.front().begin; }
+    std::string_view largest() const { return this->items[this->reach.back()].end; }
+
+    // true if a range covering "key" deletes its version at "sequence" from reads at "snapshot"
+    bool covers(std::string_view key, sequence_t sequence, sequence_t snapshot = MAX_SEQUENCE) const
+    {
+        return this->any_covering(key, [&](range const & r) { return sequence < r.sequence && r.sequence <= snapshot; });
+    }
+
+    // true if "pred" holds for any range covering "key"
+    template <typename Pred>
+    bool any_covering(std::string_view key, Pred && pred) const
+    {
+        // ranges starting after the key can't cover it, and the walk back stops once no earlier range reaches it
+        size_t i = std::upper_bound(this->items.begin(), this->items.end(), key,
+            [](std::string_view k, range const & r) { return k < r.begin; }) - this->items.begin();
+        for (; i > 0 && key < this->items[this->reach[i - 1]].end; i--)
+        {
+            range const & r = this->items[i - 1];
+            if (key < r.end && pred(r)) { return true; }
+        }
+
+        return false;
+    }
+
+    // the parts of the ranges from "lo" up to (not including) "hi", or without an upper bound if "hi" is not set
+    range_tombstones clip(std::string_view lo, std::optional<std::string_view> hi) const
+    {
+        std::vector<range> clipped{};
+        for (range const & r : this->items)
+        {
+            range c{.begin = std::string(std::max<std::string_view>(r.begin, lo)), .end = r.end, .sequence = r.sequence};
+            if (hi && *hi < c.end) { c.end = *hi; }
+            if (c.begin < c.end) { clipped.emplace_back(std::move(c)); }
+        }
+
+        return range_tombstones(std::move(clipped));
+    }
+
+private:
+    std::vector<range> items{};
+    // for each range, the index of the range up to it with the furthest end
+    std::vector<uint32_t> reach{};
+};
+
+// The sequence of a write to a table: either given, or taken from a store's sequence counter once the table has claimed a record
+// for the write. The table is then checked for a lock: a table is locked before its replacement is installed, so a write
+// finding it unlocked is sequenced before every write to the replacement. A write finding it locked may not be, so its
+// sequence is abandoned, and the write is retried in the replacement with a new one (see "kvstore::save_memtable").
+struct write_sequence
+{
+    write_sequence(sequence_t fixed = 0) : value(fixed) {}
+    explicit write_sequence(std::atomic<sequence_t> & counter) : counter(&counter) {}
+
+    // the sequence of the write, taken from the counter if none is held
+    sequence_t take() const
+    {
+        if (this->counter && this->value == 0) { this->value = this->counter->fetch_add(1) + 1; }
+        return this->value;
+    }
+
+    // gives up the sequence taken, for a write the table refused after taking it. The next "take" draws a new one.
+    void abandon() const
+    {
+        if (!this->counter || this->value == 0) { return; }
+        this->abandoned_values.emplace_back(this->value);
+        this->value = 0;
+    }
+
+    // the sequence taken, or 0 if the write was not accepted
+    sequence_t taken() const { return this->value; }
+
+    // the sequences abandoned, which hold no write, but must still be completed by the store (see "kvstore::publish")
+    std::span<sequence_t const> abandoned() const { return this->abandoned_values; }
+
+private:
+    mutable sequence_t value{};
+    mutable std::vector<sequence_t> abandoned_values{};
+    std::atomic<sequence_t> * counter{};
+};
+
+// The common interface and storage of the memtable engines.
+// Values are written to a pre-allocated buffer of records, shared by every engine, and each engine provides
+// an ordered index from keys to records. The store, WAL and SST builder only use this interface,
+// so the engine can be selected per store (see "config_opts::engine").
+struct table
+{
+    // The available index implementations - see skiptable (below) and art_table (art.h)
+    enum class engine_type
+    {
+        skiplist,
+        art,
+    };
 
     // Simple options for configuring the characteristics of the table
     struct config_opts
@@ -42,73 +192,98 @@ struct skiptable
         // Depending on usage patterns, this should be relatively large than "data_limit" -
         // if values are updated much more frequently than they are inserted, the stale data may significantly outweigh live values.
         size_t total_data_limit{160_MiB};
+
+        // Target false-positive rate of the per-table bloom filter, which is sized for "writes_before_lock" keys.
+        // Lookups for keys absent from the table are rejected by the filter, skipping the index search.
+        double filter_error_rate{0.01};
+
+        // The index used by the table. The skiplist is the general purpose choice.
+        // The adaptive radix tree uses less memory and searches fewer levels when keys are long and share prefixes.
+        engine_type engine{engine_type::skiplist};
+    };
+
+    // The kinds of record written to the table.
+    // A deletion hides older values of its key, and a range deletion hides older values of every key in its range.
+    enum class value_type : uint8_t
+    {
+        value,
+        deletion,
+        range_deletion,
     };
 
     // A simple struct to pass C-style pointer-and-size for opaque data.
     // All records returned by member functions are valid for the lifetime of the instance.
+    // The versions of a key are chained from the newest, which its entry references, through "prev", in descending sequence.
     struct record
     {
+        // the value, followed in the same allocation by the key if this record created the key's entry
         void * data{};
         size_t size{};
+        value_type type{value_type::value};
+        sequence_t sequence{};
+        // the index of the next older version of the key, or -1. Read and written atomically, see "previous".
+        int32_t prev{-1};
     };
 
-    // Simple class tracking links in the overall table.
-    // Contains forward links and a reference to the data index in the "records"
-    // All nodes returned by member functions are valid for the lifetime of the instance
-    struct node
+    // A key in the table, and a reference to its data index in the "records".
+    // Each engine derives its index nodes from this.
+    // The key bytes are not owned by the entry: they are stored after the value of the record that created it (see "fill_record").
+    // All entries returned by member functions are valid for the lifetime of the instance
+    struct entry
     {
-        node(memtable::skiptable const * owning_table, std::string_view k, int32_t record_idx) :
-            table(owning_table), key(k), record_idx(record_idx) {}
-
-        // returns the forward-linked node
-        node * iterate(size_t level=0) const { return this->next[level]; }
-
-        // NB: older and newer are not strictly inverses, equality matches with neither
-        bool older(int32_t idx) const { return this->record_idx < idx; }
-        bool newer(int32_t idx) const { return this->record_idx > idx; }
+        entry(memtable::table const * owning_table, std::string_view k, int32_t record_idx) :
+            key(k), owner(owning_table), record_idx(record_idx) {}
 
         int32_t idx() const { return this->record_idx; }
-        int32_t update(int32_t new_idx) { return this->record_idx.exchange(new_idx); }
-
-        void link(size_t level, node * n) { this->next[level] = n; }
+        bool CE_update(int32_t & expected, int32_t new_idx) { return this->record_idx.compare_exchange_weak(expected, new_idx); }
 
-        bool CE_link(size_t level, node * expected, node* n) { return this->next[level].compare_exchange_strong(expected, n); }
-
-        memtable::skiptable::record const * value() const { return this->table->get(this); }
+        memtable::table::record const * value() const { return this->owner->get(this); }
 
-        std::string const key;
-        memtable::skiptable const * table;
+        std::string_view const key;
+        memtable::table const * owner;
     private:
         std::atomic_int32_t record_idx;
-        std::array<std::atomic<node *>, MAX_TABLE_LEVELS> next{};
     };
 
-    skiptable(config_opts const & opts) : config(opts)
+    // Simple struct describing a single element of a batch insert
+    struct batch_entry
     {
-        this->records.resize(opts.writes_before_lock);
-        std::fill(this->records.begin(), this->records.end(), record{nullptr,0});
+        std::string_view key{};
+        void * data{};
+        size_t size{};
+        value_type type{value_type::value};
+        sequence_t sequence{};
+    };
+
+    // The hash of a key, as used by the table's bloom filter.
+    // All tables share the same filter seeds, so a key can be hashed once and looked up in several tables.
+    using key_hash = bloom_filters::concurrent_filter::key_hash;
+    static key_hash hash(std::string_view key)
+    {
+        return bloom_filters::concurrent_filter::hash(key.data(), key.size(), FILTER_SEEDS[0], FILTER_SEEDS[1]);
     }
 
-    ~skiptable()
+    // The record buffer is allocated and written in full here, so its pages are faulted in before the table is used.
+    // If "budget" is set, the memory the table gains from inserts is reserved from it (see write_buffer.h).
+    table(config_opts const & opts, write_buffer_manager * budget = nullptr) :
+        config(opts), write_buffer(budget), filter(filter_parameters(opts))
     {
-        node const * node = this->first();
-        while (node)
-        {
-            auto delnode = node;
-            node = node->iterate();
-            delete delnode;
-        }
+        this->records.resize(opts.writes_before_lock);
+        std::fill(this->records.begin(), this->records.end(), record{});
+    }
 
-        for ( auto & record : this->records)
-        {
-            if (record.data) { free(record.data); }
-        }
+    // NB: engines must free their index in their own destructor, as "clear_index" is unavailable here
+    virtual ~table()
+    {
+        this->release_records();
+        this->release_ranges();
+        this->release_memory();
     }
 
-    skiptable(skiptable&&) = delete;
-    skiptable(skiptable const &) = delete;
-    skiptable& operator=(skiptable&&) = delete;
-    skiptable& operator=(skiptable const&) = delete;
+    table(table&&) = delete;
+    table(table const &) = delete;
+    table& operator=(table&&) = delete;
+    table& operator=(table const&) = delete;
 
     bool lock() { return this->is_locked.exchange(true); }
 
@@ -120,17 +295,663 @@ struct skiptable
             || this->is_locked;
     }
 
-    bool empty() const { return this->data_size == 0; }
+    bool empty() const { return this->next_record == 0; }
+
+    // Locks the table and waits for in-flight inserts to finish.
+    // Once sealed, the table is immutable, and may be read without concern for concurrent writers.
+    void seal()
+    {
+        this->lock();
+        while (this->writers.load() != 0) { std::this_thread::yield(); }
+    }
+
+    // Returns the table to its freshly constructed state, keeping the (already faulted) record buffer,
+    // so that a flushed table can be recycled rather than reallocated.
+    // Requires that no other thread is accessing the table, and that all entries previously returned are discarded.
+    void reset()
+    {
+        this->clear_index();
+        this->release_records();
+        this->release_ranges();
+        this->filter.clear();
+
+        this->total_data_size = 0;
+        this->data_size = 0;
+        this->index_size = 0;
+        this->next_record = 0;
+        this->is_locked = false;
+
+        this->release_memory();
+    }
+
+    // Pins the table for a reader that outlives the epoch it found the table in (see "kvstore::iterator").
+    // A pin must be taken while the reader's epoch is pinned, and keeps the table's memory until "unpin".
+    void pin()
+    {
+        std::lock_guard lock{this->pin_mutex};
+        this->pins += 1;
+    }
+
+    // Drops a pin, running the releases deferred by it. The table may be freed by them, so must not be used afterwards.
+    void unpin()
+    {
+        std::vector<std::function<void()>> releases{};
+        {
+            std::lock_guard lock{this->pin_mutex};
+            if (--this->pins == 0) { releases.swap(this->deferred); }
+        }
+
+        for (auto & release : releases) { release(); }
+    }
+
+    // Runs "release", which frees some of the table's memory, now, or once the last pin is dropped.
+    // Called once no reader's epoch can reach the table, so no pin is taken afterwards. Releases run in the order passed.
+    void release_unpinned(std::function<void()> release)
+    {
+        {
+            std::lock_guard lock{this->pin_mutex};
+            if (this->pins > 0)
+            {
+                this->deferred.emplace_back(std::move(release));
+                return;
+            }
+        }
+
+        release();
+    }
+
+    // Frees the index, keeping the records, once a sorted_table has been built over the table and replaced it for readers.
+    // Afterwards the table finds no keys, until it is reset. Requires that no other thread is accessing the index.
+    // The index's memory is returned to the write buffer, as the sorted_table reserves its own.
+    void release_index()
+    {
+        this->clear_index();
+        size_t const freed = std::min(this->index_size.exchange(0), this->reserved.load());
+        this->reserved -= freed;
+        if (this->write_buffer) { this->write_buffer->release(freed); }
+    }
+
+    // the write buffer the table reserves its memory from, if any
+    write_buffer_manager * budget() const { return this->write_buffer; }
+
+    // The memory held by the table in bytes: the record buffer, the filter, the index and all record data, including stale records.
+    // Allocator overhead is not included.
+    size_t memory_usage() const
+    {
+        return sizeof(*this) + this->records.capacity() * sizeof(record) + this->filter.memory_usage()
+            + this->index_size + this->total_data_size;
+    }
+
+    // Inserts an element into the table, allowing for lock free concurrent import
+    // The value becomes the newest version of the key, unless a version with a higher sequence is already present.
+    // Returns the entry that was inserted, or nullptr on failure
+    entry const * insert(std::string_view key, void * data, size_t size, write_sequence const & sequence = {})
+    {
+        return this->insert_entry(key, data, size, value_type::value, sequence);
+    }
+
+    // Inserts a deletion of "key", as "insert"
+    entry const * remove(std::string_view key, write_sequence const & sequence = {}) { return this->insert_entry(key, nullptr, 0, value_type::deletion, sequence); }
+
+    // Inserts a deletion of every key from "begin" up to (not including) "end", hiding the versions with lower sequences.
+    // Returns false on failure, as "insert".
+    bool insert_range(std::string_view begin, std::string_view end, write_sequence const & sequence = {})
+    {
+        this->writers.fetch_add(1);
+        bool const inserted = this->write_range(begin, end, sequence);
+        if (inserted) { this->charge_memory(); }
+        this->writers.fetch_sub(1);
+        return inserted;
+    }
+
+    // Inserts a group of elements, with the sequences they carry, which should be sorted by ascending key.
+    // Engines may use the ordering to speed up consecutive inserts; unsorted input is still inserted correctly.
+    // The batch is inserted whole, or not at all: returns its size, or 0 if the table is locked or lacks the room for it.
+    // If "inserted" is non-null, it receives the entry for each inserted element, in batch order.
+    size_t insert_batch(std::span<batch_entry const> batch, entry const ** inserted = nullptr)
+    {
+        std::optional<int32_t> const first = this->claim(batch.size());
+        if (!first) { return 0; }
+
+        this->write_claimed(*first, batch, inserted);
+        this->release_claim();
+        return batch.size();
+    }
+
+    // Claims consecutive records for the "count" writes of a batch, which the table then accepts all of.
+    // The caller is registered as a writer until "release_claim", so the table is not sealed meanwhile.
+    // Returns the first record claimed, or nothing, leaving the caller unregistered, if the table is locked or lacks the room.
+    std::optional<int32_t> claim(size_t count)
+    {
+        this->writers.fetch_add(1);
+        if (!this->locked() && count <= this->config.writes_before_lock)
+        {
+            int32_t const first = this->next_record.fetch_add(static_cast<int32_t>(count));
+            if (static_cast<size_t>(first) + count <= this->config.writes_before_lock) { return first; }
+        }
+
+        this->writers.fetch_sub(1);
+        return std::nullopt;
+    }
+
+    // Writes "batch", as "insert_batch", to the records claimed from "first"
+    virtual void write_claimed(int32_t first, std::span<batch_entry const> batch, entry const ** inserted = nullptr) = 0;
+
+    // Ends a claim, once its records are written, or abandoned unwritten
+    void release_claim()
+    {
+        this->charge_memory();
+        this->writers.fetch_sub(1);
+    }
+
+    // true once "lock" has been called, as it is when the table is replaced. Unlike "locked", not set by the table filling up.
+    bool lock_taken() const { return this->is_locked; }
+
+    // Finds the entry in the table with the given key, nullptr if the key is not found.
+    // The returned pointer is valid for the lifetime of the table itself.
+    entry const * find(std::string_view key) const { return this->find(key, hash(key)); }
+
+    // As above, with the key's hash precomputed
+    entry const * find(std::string_view key, key_hash const & h) const
+    {
+        // keys that were never inserted are almost always rejected here, without touching the index
+        if (!this->filter.might_contain(h)) { return nullptr; }
+        return this->find_entry(key);
+    }
+
+    // Returns the first entry with a key not less than "key", or nullptr if there is none
+    virtual entry const * lower_bound(std::string_view key) const = 0;
+
+    // Returns the entry following "e" in key order, or nullptr if "e" is the last
+    virtual entry const * next(entry const * e) const = 0;
+
+    // Returns the last entry with a key less than "key", or the last entry of all if "key" is not set.
+    // Returns nullptr if there is none.
+    virtual entry const * before(std::optional<std::string_view> key) const = 0;
+
+    // Returns the entry with the smallest key, or nullptr if the table is empty
+    entry const * first() const { return this->lower_bound({}); }
+
+    // Returns the entry with the largest key, or nullptr if the table is empty
+    entry const * last() const { return this->before(std::nullopt); }
+
+    // If the passed entry ptr is stale, it is possible that a subsequent (or concurrent)
+    // insert operation has overwritten the record idx for this entry.
+    // In this case we will return a stale value for the data record.
+    // However, this record will still reference valid data for the lifetime of this table.
+    // returns nullptr on invalid input
+    record const * get(entry const * e) const
+    {
+        if (!e || e->idx() < 0 || e->idx() >= this->next_record) { return nullptr; }
+        else { return &this->records[e->idx()]; }
+    }
+
+    // returns false if "key" is certainly not in the table
+    bool might_contain(key_hash const & h) const { return this->filter.might_contain(h); }
+
+    // starts loading the filter bits for "key", ahead of a lookup (see bloom_filters::concurrent_filter::prefetch)
+    void prefetch(key_hash const & h) const { this->filter.prefetch(h); }
+
+    // returns nullptr if the key is not found
+    record const * get(std::string_view key) const { return this->get(this->find(key)); }
+
+    // returns nullptr if the key is not found, with the key's hash precomputed
+    record const * get(std::string_view key, key_hash const & h) const { return this->get(this->find(key, h)); }
+
+    // Looks up the newest version of "key" visible at "snapshot", copying its value into "data_out" (resized as needed)
+    // if it is found
+    lookup get(std::string_view key, key_hash const & h, std::vector<std::byte> & data_out, sequence_t snapshot = MAX_SEQUENCE) const
+    {
+        std::span<std::byte const> value{};
+        lookup const found = this->get(key, h, value, snapshot);
+        return copy(found, value, data_out);
+    }
+
+    // As above, but references the value in place, in the table's own record, rather than copying it.
+    // The value is valid until the table is reset.
+    lookup get(std::string_view key, key_hash const & h, std::span<std::byte const> & value_out, sequence_t snapshot = MAX_SEQUENCE) const
+    {
+        record const * r = this->visible(this->get(this->find(key, h)), snapshot);
+        if (this->range_deleted(key, r ? r->sequence : 0, snapshot)) { return lookup::deleted; }
+        return view(r, value_out);
+    }
+
+    // the next older version of the key from "r", or nullptr if "r" is the oldest
+    record const * previous(record const & r) const
+    {
+        int32_t const prev = __atomic_load_n(&r.prev, __ATOMIC_ACQUIRE);
+        return prev < 0 ? nullptr : &this->records[prev];
+    }
+
+    // the newest version, from "r" on, with a sequence at or below "snapshot", or nullptr if there is none
+    record const * visible(record const * r, sequence_t snapshot) const
+    {
+        while (r && r->sequence > snapshot) { r = this->previous(*r); }
+        return r;
+    }
+
+    // references the value of "r" in "value_out", where "r" is the version of a key visible to a read, or nullptr if none is
+    static lookup view(record const * r, std::span<std::byte const> & value_out)
+    {
+        if (!r) { return lookup::missing; }
+        if (r->type == value_type::deletion) { return lookup::deleted; }
+
+        value_out = {static_cast<std::byte const *>(r->data), r->size};
+        return lookup::found;
+    }
+
+    // true if "key" is in a range deleting its version at "sequence" from reads at "snapshot"
+    bool range_deleted(std::string_view key, sequence_t sequence, sequence_t snapshot = MAX_SEQUENCE) const
+    {
+        for (range_node const * n = this->ranges.load(); n; n = n->next)
+        {
+            range_tombstones::range const & r = n->range;
+            if (sequence < r.sequence && r.sequence <= snapshot && r.begin <= key && key < r.end) { return true; }
+        }
+
+        return false;
+    }
+
+    // the ranges deleted in the table, in any order
+    std::vector<range_tombstones::range> deleted_ranges() const
+    {
+        std::vector<range_tombstones::range> ranges{};
+        for (range_node const * n = this->ranges.load(); n; n = n->next) { ranges.emplace_back(n->range); }
+        return ranges;
+    }
+
+    config_opts const config;
+
+protected:
+    // Engine hook for "insert" and "remove"
+    virtual entry const * insert_entry(std::string_view key, void * data, size_t size, value_type type, write_sequence const & sequence) = 0;
+
+    // Engine hook for "find", called once the filter has accepted the key
+    virtual entry const * find_entry(std::string_view key) const = 0;
+
+    // Engine hook for "reset" - frees every index node, returning the index to its empty state
+    virtual void clear_index() = 0;
+
+    // Engines report the memory of each index node they allocate, as it is allocated,
+    // and of each node they retire before the index is cleared, as it is retired
+    void account_index(size_t bytes) { this->index_size += bytes; }
+    void account_retired(size_t bytes) { this->index_size -= bytes; }
+
+    // the heap memory held by a string, beyond the string object itself
+    static size_t heap_size(std::string const & s)
+    {
+        return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+    }
+
+    // Writes a record claimed by the caller at "idx", then calls "link(key, record_idx)",
+    // which must return the engine's entry for the key, and true iff it created that entry for this record.
+    // The key passed to "link" is stored in the record, after the value, and is the key an entry created by it must view.
+    // If the key already had an entry, it is pointed at the new record instead, and the record gives up its copy of the key.
+    // Returns nullptr, linking nothing, if the record cannot be allocated.
+    template <typename Link>
+    entry const * fill_record(int32_t idx, std::string_view key, void * data, size_t size, value_type type, sequence_t sequence, Link & link)
+    {
+        // Write the new data, and the key, into the record buffer, returning false on failure to allocate
+        // (an empty key and value, as an empty key's deletion, allocate nothing)
+        record & r = this->records[idx];
+        std::string_view stored{};
+        if (size + key.size() > 0)
+        {
+            r.data = malloc(size + key.size());
+            if (!r.data) { return nullptr; }
+            if (size > 0) { memcpy(r.data, data, size); }
+            if (!key.empty()) { memcpy(static_cast<char *>(r.data) + size, key.data(), key.size()); }
+            r.size = size;
+            stored = {static_cast<char const *>(r.data) + size, key.size()};
+        }
+
+        r.type = type;
+        r.sequence = sequence;
+
+        // the filter must report the key before it becomes reachable in the index, so a lookup can never
+        // be rejected by the filter after the entry is visible
+        key_hash const h = hash(key);
+        if (!this->filter.might_contain(h)) { this->filter.insert(h); }
+
+        auto const [e, inserted] = link(stored, idx);
+        if (inserted)
+        {
+            this->total_data_size += size + key.size();
+            this->data_size += size;
+            return e;
+        }
+
+        // the entry views the key in an older record, so the copy is dropped before the record becomes reachable
+        if (size == 0)
+        {
+            free(r.data);
+            r.data = nullptr;
+        }
+        else if (!key.empty())
+        {
+            if (void * shrunk = realloc(r.data, size)) { r.data = shrunk; }
+        }
+
+        this->total_data_size += size;
+        this->apply_update(e, idx, size);
+        return e;
+    }
+
+    // The shared body of the engines' inserts: claims and writes the record, linking it by "link" (see "fill_record")
+    template <typename Link>
+    entry const * insert_record(std::string_view key, void * data, size_t size, value_type type, write_sequence const & sequence, Link && link)
+    {
+        // register as an in-flight writer before checking the lock, so that "seal" either waits for us,
+        // or we observe the lock and fail
+        this->writers.fetch_add(1);
+        entry const * e = this->write_record(key, data, size, type, sequence, link);
+        if (e) { this->charge_memory(); }
+        this->writers.fetch_sub(1);
+        return e;
+    }
+
+private:
+    // seeds for the filter hashes - fixed, so that hashes are interchangeable between tables
+    static constexpr std::array<uint64_t, 2> FILTER_SEEDS{0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL};
+
+    static bloom_filters::static_filter::parameters filter_parameters(config_opts const & opts)
+    {
+        bloom_filters::static_filter::parameters params{};
+        params.target_error_rate = opts.filter_error_rate;
+        params.capacity = std::max<size_t>(opts.writes_before_lock, 1);
+        params.hash_seeds[0] = FILTER_SEEDS[0];
+        params.hash_seeds[1] = FILTER_SEEDS[1];
+        return params;
+    }
+
+    // A range deletion, linked into the table's list of them
+    struct range_node
+    {
+        range_tombstones::range const range;
+        range_node * next{};
+    };
+
+    // The body of "insert_record", run while registered as an in-flight writer
+    template <typename Link>
+    entry const * write_record(std::string_view key, void * data, size_t size, value_type type, write_sequence const & sequence, Link & link)
+    {
+        // Ensure the table hasn't exceeded configured limits
+        if (this->locked()) { return nullptr; }
+
+        // Find the location in our record table where we will allocate new data
+        // Concurrent write is consistent, as we only increment this value here, and never decrement
+        // In addition, concurrent reads are consistent, though they may return stale data
+        int32_t const new_record_idx = this->next_record.fetch_add(1);
+
+        // Concurrent inserts may all pass the "locked" check above before any of them claims a record
+        if (static_cast<size_t>(new_record_idx) >= this->config.writes_before_lock) { return nullptr; }
+
+        // the write is only sequenced once the table holds a record for it, and kept only if the table was not locked first
+        sequence_t const seq = sequence.take();
+        if (this->is_locked)
+        {
+            sequence.abandon();
+            return nullptr;
+        }
+
+        entry const * e = this->fill_record(new_record_idx, key, data, size, type, seq, link);
+        if (!e) { sequence.abandon(); }
+        return e;
+    }
+
+    // The body of "insert_range", run while registered as an in-flight writer.
+    // The deletion takes a record, so that it counts towards the table's writes.
+    bool write_range(std::string_view begin, std::string_view end, write_sequence const & seq)
+    {
+        if (this->locked()) { return false; }
+
+        int32_t const new_record_idx = this->next_record.fetch_add(1);
+        if (static_cast<size_t>(new_record_idx) >= this->config.writes_before_lock) { return false; }
+
+        // as "write_record"
+        sequence_t const sequence = seq.take();
+        if (this->is_locked)
+        {
+            seq.abandon();
+            return false;
+        }
+
+        this->records[new_record_idx].type = value_type::range_deletion;
+        this->records[new_record_idx].sequence = sequence;
+        range_node * n = new range_node{.range = {.begin = std::string(begin), .end = std::string(end), .sequence = sequence}};
+        this->total_data_size += sizeof(range_node) + begin.size() + end.size();
+
+        n->next = this->ranges.load();
+        while (!this->ranges.compare_exchange_weak(n->next, n)) {}
+        return true;
+    }
+
+    // Links a newly written record into the versions of an existing entry's key, in order of sequence.
+    // Usually the record is the newest, and the entry is pointed at it. If a concurrent insert has already linked
+    // a version with a higher sequence, the record is linked behind it, as though it had been overwritten.
+    // Records are only ever linked in front of older versions, so a reader walking the chain never misses a version
+    // that was linked before it started.
+    void apply_update(entry * e, int32_t new_record_idx, size_t size)
+    {
+        record & r = this->records[new_record_idx];
+        int32_t old = e->idx();
+        while (this->records[old].sequence <= r.sequence)
+        {
+            __atomic_store_n(&r.prev, old, __ATOMIC_RELEASE);
+            if (e->CE_update(old, new_record_idx))
+            {
+                this->data_size -= this->records[old].size;
+                this->data_size += size;
+                return;
+            }
+        }
+
+        // find the last version newer than the record, and link the record after it
+        int32_t at = old;
+        while (true)
+        {
+            int32_t next = __atomic_load_n(&this->records[at].prev, __ATOMIC_ACQUIRE);
+            if (next >= 0 && this->records[next].sequence > r.sequence)
+            {
+                at = next;
+                continue;
+            }
+
+            __atomic_store_n(&r.prev, next, __ATOMIC_RELEASE);
+            if (__atomic_compare_exchange_n(&this->records[at].prev, &next, new_record_idx, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) { return; }
+        }
+    }
+
+    // brings the reservation from the write buffer up to the table's memory usage, reserving ahead by a block,
+    // so that only one insert in many touches the shared counter.
+    // Only the memory that grows with inserts is reserved: the record buffer and filter are fixed when the table is
+    // constructed, and kept while it is pooled, so cannot be released by a flush.
+    void charge_memory()
+    {
+        if (!this->write_buffer) { return; }
+
+        size_t const usage = this->index_size + this->total_data_size;
+        size_t reserved = this->reserved;
+        while (usage > reserved)
+        {
+            size_t const target = usage + this->write_buffer->config.reserve_block;
+            if (this->reserved.compare_exchange_weak(reserved, target))
+            {
+                this->write_buffer->reserve(target - reserved);
+                return;
+            }
+        }
+    }
+
+    // returns the whole reservation to the write buffer
+    void release_memory()
+    {
+        if (this->write_buffer) { this->write_buffer->release(this->reserved.exchange(0)); }
+    }
+
+    // frees the range deletions
+    void release_ranges()
+    {
+        range_node * n = this->ranges.exchange(nullptr);
+        while (n)
+        {
+            range_node * next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+
+    // frees all record data, clearing the records that were used
+    void release_records()
+    {
+        size_t const used = std::min<size_t>(this->next_record, this->records.size());
+        for (size_t i = 0; i < used; i++)
+        {
+            if (this->records[i].data) { free(this->records[i].data); }
+            this->records[i] = record{};
+        }
+    }
+
+    std::vector<record> records{};
+    // range deletions are rare, so they are kept in a list, which readers walk in full
+    std::atomic<range_node *> ranges{};
+    std::atomic_size_t total_data_size{};
+    std::atomic_size_t data_size{};
+    // the memory of the engine's index nodes
+    std::atomic_size_t index_size{};
+    write_buffer_manager * const write_buffer;
+    // the memory reserved from "write_buffer", which runs ahead of "memory_usage"
+    std::atomic_size_t reserved{};
+    std::atomic_bool is_locked{};
+    std::atomic_int32_t writers{};
+    std::atomic_int32_t next_record{};
+    bloom_filters::concurrent_filter filter;
+    // readers' pins, and the releases waiting for them (see "pin")
+    std::mutex pin_mutex{};
+    size_t pins{};
+    std::vector<std::function<void()>> deferred{};
+};
+
+// A lock-free skiplist index
+struct skiptable : table
+{
+    // The maximum depth of the underlying skip-list. Higher values will increase the space required for the table,
+    // and will increase the probability of stale data being returned for "get" operations.
+    // However, search times for data in the table will decrease with higher values.
+    // Therefore, read-heavy workloads may benefit from higher values.
+    static size_t constexpr MAX_TABLE_LEVELS{16};
+
+    // Simple class tracking links in the overall table.
+    // Adds the forward links for each level to the table entry
+    struct node : entry
+    {
+        node(memtable::table const * owning_table, std::string_view k, int32_t record_idx) :
+            entry(owning_table, k, record_idx) {}
+
+        // returns the forward-linked node
+        node * iterate(size_t level=0) const { return this->next[level]; }
+
+        void link(size_t level, node * n) { this->next[level] = n; }
+
+        bool CE_link(size_t level, node * expected, node* n) { return this->next[level].compare_exchange_strong(expected, n); }
+
+    private:
+        std::array<std::atomic<node *>, MAX_TABLE_LEVELS> next{};
+    };
+
+    // A search finger over the table: the predecessor and successor of the last key inserted through it, per level.
+    // Passing the same splice to consecutive inserts lets each search resume from the previous key's position,
+    // rather than descending from "head", which makes ascending runs of keys close to O(1) per insert.
+    // A splice may go stale under concurrent inserts - this only costs extra forward steps, never correctness.
+    struct splice
+    {
+        std::array<node *, MAX_TABLE_LEVELS> prev{};
+        std::array<node *, MAX_TABLE_LEVELS> next{};
+    };
+
+    skiptable(config_opts const & opts, write_buffer_manager * budget = nullptr) : table(opts, budget)
+    {
+        for (auto & tail : this->tails) { tail = &this->head; }
+    }
+
+    ~skiptable() override { this->release_nodes(); }
+
+    using table::first;
 
     // Returns the first node in the table for the given level
-    node const * first(size_t level=0) const
+    node const * first(size_t level) const
     {
         return this->head.iterate(level);
     }
 
-    // Finds the node in the table with the given key, nullptr if the key is not found.
-    // The returned pointer is valid for the lifetime of the table itself.
-    node const * find(std::string_view key) const
+    using table::insert;
+
+    // Links the batch through a single splice, so each insert resumes its search from the previous key
+    void write_claimed(int32_t first, std::span<batch_entry const> batch, entry const ** inserted = nullptr) override
+    {
+        splice hint{};
+        auto link = [&](std::string_view k, int32_t idx) { return this->link_node(k, idx, hint); };
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            batch_entry const & item = batch[i];
+            entry const * e = this->fill_record(first + static_cast<int32_t>(i), item.key, item.data, item.size, item.type, item.sequence, link);
+            assert(e);
+            if (inserted) { inserted[i] = e; }
+        }
+    }
+
+    // Hinted insert - behaves as "insert", but starts the search from the passed splice where it is usable,
+    // and leaves the splice positioned just after "key" for the next call.
+    entry const * insert(std::string_view key, void * data, size_t size, splice & hint,
+                         value_type type = value_type::value, write_sequence const & sequence = {})
+    {
+        return this->insert_record(key, data, size, type, sequence, [&](std::string_view k, int32_t idx) {
+            return this->link_node(k, idx, hint);
+        });
+    }
+
+    entry const * lower_bound(std::string_view key) const override
+    {
+        node const * n = &this->head;
+        for (int32_t i = MAX_TABLE_LEVELS - 1; i >= 0; i--)
+        {
+            while (true)
+            {
+                node const * n2 = n->iterate(i);
+                if (!n2 || key <= n2->key) { break; }
+                n = n2;
+            }
+        }
+
+        return n->iterate(0);
+    }
+
+    entry const * next(entry const * e) const override { return static_cast<node const *>(e)->iterate(); }
+
+    entry const * before(std::optional<std::string_view> key) const override
+    {
+        node const * n = &this->head;
+        for (int32_t i = MAX_TABLE_LEVELS - 1; i >= 0; i--)
+        {
+            while (true)
+            {
+                node const * n2 = n->iterate(i);
+                if (!n2 || (key && *key <= n2->key)) { break; }
+                n = n2;
+            }
+        }
+
+        return n == &this->head ? nullptr : n;
+    }
+
+protected:
+    entry const * insert_entry(std::string_view key, void * data, size_t size, value_type type, write_sequence const & sequence) override
+    {
+        splice hint{};
+        return this->insert(key, data, size, hint, type, sequence);
+    }
+
+    entry const * find_entry(std::string_view key) const override
     {
         node const * n = &this->head;
         for (int32_t i = MAX_TABLE_LEVELS - 1; i >= 0; i--)
@@ -150,136 +971,365 @@ struct skiptable
         return nullptr;
     }
 
-    // Inserts an element into the table, allowing for lock free concurrent import
-    // Returns the node that was inserted, or nullptr on failure
-    node const * insert(std::string_view key, void * data, size_t size)
+    void clear_index() override
     {
-        // Ensure the table hasn't exceeded configured limits
-        if (this->locked()) { return nullptr; }
-
-        // Find the location in our record table where we will allocate new data
-        // Concurrent write is consistent, as we only increment this value here, and never decrement
-        // In addition, concurrent reads are consistent, though they may return stale data
-        size_t const new_record_idx = this->next_record.fetch_add(1);
-
-        // Write the new data into the record buffer, returning false on failure to allocate
-        this->records[new_record_idx].data = malloc(size);
-        if (this->records[new_record_idx].data)
+        this->release_nodes();
+        for (size_t i = 0; i < MAX_TABLE_LEVELS; i++)
         {
-            memcpy(this->records[new_record_idx].data, data, size);
-            this->records[new_record_idx].size = size;
+            this->head.link(i, nullptr);
+            this->tails[i] = &this->head;
         }
-        else { return nullptr; }
-
-        this->total_data_size += size;
+    }
 
-        // Generate a random level to insert the new data, bounded by the max levels in our table
-        // we leak the random generator until the thread is cleaned up, but that's relatively inconsequential
+private:
+    // Generate a random level to insert new data, bounded by the max levels in our table
+    // we leak the random generator until the thread is cleaned up, but that's relatively inconsequential
+    static int32_t random_level()
+    {
         static thread_local std::minstd_rand* gen = nullptr;
         if (!gen) gen = new std::minstd_rand(std::hash<std::thread::id>()(std::this_thread::get_id()));
         std::uniform_int_distribution<int> dist{};
         int32_t level = 0;
-        while (level < MAX_TABLE_LEVELS)
+        while (level < static_cast<int32_t>(MAX_TABLE_LEVELS) - 1)
         {
             int const rn = dist(*gen);
             if (rn % 2) level += 1; // increase the level until an even number, resulting in roughly 1/2 the count per level
             else break;
         }
 
-        node * new_node = new node(this, key, new_record_idx);
+        return level;
+    }
+
+    // Links a node for "key" at each level up to a random height, or returns the existing node for the key
+    std::pair<entry *, bool> link_node(std::string_view key, int32_t new_record_idx, splice & hint)
+    {
+        int32_t const level = random_level();
 
         // for each level below the calculated layer, insert the node
         // This is where much of the complexity of the lock-free concurrency lies
         // we only want to commit updates if a new node has not been inserted, otherwise we must rollback and retry
-        std::array<node *, MAX_TABLE_LEVELS> updates{};
-        std::array<node *, MAX_TABLE_LEVELS> update_nexts{};
+        node * new_node{};
+        int32_t linked_to = -1;
 
 insert_loop:
+        node * existing = this->find_splice(key, level, linked_to + 1, hint);
+        if (existing)
+        {
+            // Only possible before the node is linked at level 0, as keys are unique on the bottom level
+            assert(linked_to < 0);
+            delete new_node;
+            return {existing, false};
+        }
+
+        if (!new_node) { new_node = new node(this, key, new_record_idx); }
+
+        // At this point, we have all the links we need to update.
+        // Link from the bottom level up: once the node is on level 0 it is visible to readers and writers,
+        // and the upper levels are only shortcuts. If a link has changed underneath us, we re-find the splice
+        // for the levels that remain and retry from there, leaving the levels already linked in place.
+        // An adversary could potentially use well-timed/structured inserts to cause this loop to retry indefinitely,
+        // so it might be practical to insert retry/fail logic here rather than an infinite retry loop.
+        for (int32_t i = linked_to + 1; i <= level; i++)
+        {
+            new_node->link(i, hint.next[i]);
+            if (!hint.prev[i]->CE_link(i, hint.next[i], new_node))
+            {
+                // The link was changed while we were updating - find new links and retry
+                goto insert_loop;
+            }
+
+            linked_to = i;
+
+            // we were appended to the end of this level, so advance the tail hint past every node before us.
+            // Racing appenders each move it forward, never back, so a tail left behind by one is caught up by the next.
+            if (!hint.next[i])
+            {
+                node * t = this->tails[i].load();
+                while (this->precedes(t, new_node->key) && !this->tails[i].compare_exchange_weak(t, new_node)) {}
+            }
+
+            hint.prev[i] = new_node;
+        }
+
+        this->account_index(sizeof(node));
+        return {new_node, true};
+    }
+
+    // frees all nodes
+    void release_nodes()
+    {
+        node const * node = this->first(0);
+        while (node)
+        {
+            auto delnode = node;
+            node = node->iterate();
+            delete delnode;
+        }
+    }
+
+    // returns true if "n" may be used as a search start for "key", i.e. it sorts strictly before it
+    bool precedes(node const * n, std::string_view key) const { return n == &this->head || n->key < key; }
+
+    // Fills "sp" with the predecessor and successor of "key" for each level in [min_level, MAX_TABLE_LEVELS),
+    // starting from the cheapest usable position: the level tails when appending past the current maximum,
+    // else the lowest level of the passed splice that still brackets the key, else "head".
+    // Returns the existing node for "key" if one is found, otherwise nullptr.
+    node * find_splice(std::string_view key, int32_t level, int32_t min_level, splice & sp)
+    {
+        int32_t start = MAX_TABLE_LEVELS - 1;
         node * n = &this->head;
-        for (int32_t i = level; i >= 0; i--)
+
+        // Append fast path - if the bottom level's tail sorts before our key, we are past the current maximum,
+        // so each level is searched from its tail, which is usually the final node on that level
+        bool const append = this->precedes(this->tails[0], key);
+        if (!append)
         {
-            while (true)
+            // find the lowest level where the splice still brackets our key, and resume the search there
+            for (int32_t i = min_level; i < static_cast<int32_t>(MAX_TABLE_LEVELS); i++)
             {
-                node * n2 = n->iterate(i);
-                // use compare and save the value to prevent re-testing potentially long-running string equality
-                // if the next key is the tail (nullptr), set comp to -1 to signify that it is "larger" than our key
-                int comp = n2 ? key.compare(n2->key) : -1;
-                if (comp < 0)
+                if (sp.prev[i] && this->precedes(sp.prev[i], key) && (!sp.next[i] || key < sp.next[i]->key))
                 {
-                    updates[i] = n;
-                    update_nexts[i] = n2;
+                    // levels above a bracketing level usually bracket as well, but only the lower bound matters here
+                    int32_t const from = std::max(i, level);
+                    if (sp.prev[from] && this->precedes(sp.prev[from], key))
+                    {
+                        start = from;
+                        n = sp.prev[from];
+                    }
                     break;
                 }
-                else if (comp == 0 && n2->newer(new_record_idx))
-                {
-                    // This key has been updated by a more recent insert operation - pretend this insertion "succeeded",
-                    // and was then later overwritten by the other operation.
-                    delete new_node;
-                    return n2;
-                }
-                else if (comp == 0 && n2->older(new_record_idx))
-                {
-                    // Simply update the node to point to the new data in the store and return after adjusting sizes
-                    int32_t const old = n2->update(new_record_idx);
-                    this->data_size -= this->records[old].size;
-                    this->data_size += size;
-                    delete new_node;
-                    return n2;
-                }
-                else if (comp == 0 /* !older && !newer */)
-                {
-                    // This should never occur, as we should not reuse record indicies
-                    assert(false);
-                }
-                else
-                {
-                    // Keep iterating through the level
-                    n = n2;
-                }
             }
         }
 
-        // At this point, we have all the links we need to update.
-        // Attempt to update them from highest to lowest level, retrying the whole process if the links have changed
-        // An adversary could potentially use well-timed/structured inserts to cause this loop to retry indefinitely,
-        // so it might be practical to insert retry/fail logic here rather than an infinite retry loop.
-        // However, this would require much more careful handling of the node deletion, as it could be partially linked.
-        for (int32_t i = level; i >= 0; i--)
+        for (int32_t i = start; i >= min_level; i--)
         {
-            new_node->link(i, update_nexts[i]);
-            if (!updates[i]->CE_link(i,update_nexts[i], new_node))
+            if (append)
             {
-                // The link was changed while we were updating - find new links and retry
-                goto insert_loop;
+                node * const t = this->tails[i];
+                if (this->precedes(t, key)) { n = t; }
             }
+
+            if (node * existing = this->search_level(key, i, n, sp)) { return existing; }
+            n = sp.prev[i];
         }
 
-        this->data_size += size;
-        return new_node;
+        return nullptr;
     }
 
-    // If the passed node ptr is stale, it is possible that a subsequent (or concurrent)
-    // insert operation has overwritten the record idx for this node.
-    // In this case we will return a stale value for the data record.
-    // However, this record will still reference valid data for the lifetime of this table.
-    // returns nullptr on invalid input
-    record const * get(node const * node) const
+    // Walks a single level forward from "n" (which must precede "key"), recording the splice for that level.
+    // Returns the node if "key" is found on this level.
+    node * search_level(std::string_view key, int32_t level, node * n, splice & sp)
+    {
+        while (true)
+        {
+            node * n2 = n->iterate(level);
+            // use compare and save the value to prevent re-testing potentially long-running string equality
+            // if the next key is the tail (nullptr), set comp to -1 to signify that it is "larger" than our key
+            int const comp = n2 ? key.compare(n2->key) : -1;
+            if (comp < 0)
+            {
+                sp.prev[level] = n;
+                sp.next[level] = n2;
+                return nullptr;
+            }
+            else if (comp == 0) { return n2; }
+            else
+            {
+                // Keep iterating through the level
+                n = n2;
+            }
+        }
+    }
+
+    node head{this, std::string(), -1};
+
+    // The last node linked on each level, used as a starting point for appends past the current maximum key.
+    // These are hints only: they may lag behind the true tail under concurrent appends, but never pass it.
+    std::array<std::atomic<node *>, MAX_TABLE_LEVELS> tails{};
+};
+
+// An immutable, compact index over a sealed table, built once the table has been moved to the history.
+// Keys are copied into a single contiguous buffer, and entries are held in key order as (key offset, value),
+// so ordered iteration is a linear scan, and the SST builder can consume the table directly.
+// Point lookups search an Eytzinger (breadth-first) layout of the entries, holding the leading 8 bytes of each key
+// inline, so that most comparisons never leave the search array and each step's children can be prefetched.
+// Values are referenced in place in the source table's records, and the source's bloom filter is reused,
+// so the source table must outlive this index.
+// Each key references its newest version, from which older versions are reached through the source table.
+struct sorted_table
+{
+    using record = table::record;
+
+    // Builds the index over "source_table", sealing it first if necessary.
+    // The index's memory is reserved from the source's write buffer, if it has one, until the index is destroyed.
+    explicit sorted_table(table & source_table) : source(source_table), write_buffer(source_table.budget())
+    {
+        source_table.seal();
+        this->deleted = range_tombstones(source_table.deleted_ranges());
+
+        size_t key_bytes{};
+        size_t count{};
+        for (table::entry const * n = source_table.first(); n; n = source_table.next(n))
+        {
+            key_bytes += n->key.size();
+            count += 1;
+        }
+
+        assert(key_bytes <= UINT32_MAX);
+        this->keys.reserve(key_bytes);
+        this->entries.reserve(count);
+        for (table::entry const * n = source_table.first(); n; n = source_table.next(n))
+        {
+            this->entries.emplace_back(entry{
+                .key_offset = static_cast<uint32_t>(this->keys.size()),
+                .key_size = static_cast<uint32_t>(n->key.size()),
+                .value = source_table.get(n)});
+            this->keys.append(n->key);
+        }
+
+        this->layout.resize(count + 1);
+        size_t next{};
+        this->build_layout(1, next);
+
+        if (this->write_buffer)
+        {
+            this->reserved = this->keys.capacity() + this->entries.capacity() * sizeof(entry) + this->layout.capacity() * sizeof(slot);
+            this->write_buffer->reserve(this->reserved);
+        }
+    }
+
+    ~sorted_table()
     {
-        if (!node || node->idx() < 0 || node->idx() >= this->next_record) { return nullptr; }
-        else { return &this->records[node->idx()]; }
+        if (this->write_buffer) { this->write_buffer->release(this->reserved); }
     }
 
+    sorted_table(sorted_table&&) = delete;
+    sorted_table(sorted_table const &) = delete;
+    sorted_table& operator=(sorted_table&&) = delete;
+    sorted_table& operator=(sorted_table const&) = delete;
+
+    // the number of keys in the table
+    size_t size() const { return this->entries.size(); }
+
+    // the ith key in ascending order. Requires i < size()
+    std::string_view key(size_t i) const { return {this->keys.data() + this->entries[i].key_offset, this->entries[i].key_size}; }
+
+    // the newest version of the ith key in ascending order. Requires i < size()
+    record const * value(size_t i) const { return this->entries[i].value; }
+
+    // the next older version of a key from "r", or nullptr if "r" is the oldest
+    record const * previous(record const & r) const { return this->source.previous(r); }
+
     // returns nullptr if the key is not found
-    record const * get(std::string_view key) const { return this->get(this->find(key)); }
+    record const * get(std::string_view key) const { return this->get(key, table::hash(key)); }
+
+    // returns nullptr if the key is not found, with the key's hash precomputed
+    record const * get(std::string_view key, table::key_hash const & h) const
+    {
+        if (!this->source.might_contain(h)) { return nullptr; }
+
+        size_t const i = this->lower_bound(key);
+        if (i < this->size() && this->key(i) == key) { return this->value(i); }
+        return nullptr;
+    }
+
+    // Looks up the newest version of "key" visible at "snapshot", as "table::get"
+    lookup get(std::string_view key, table::key_hash const & h, std::vector<std::byte> & data_out, sequence_t snapshot = MAX_SEQUENCE) const
+    {
+        std::span<std::byte const> value{};
+        lookup const found = this->get(key, h, value, snapshot);
+        return copy(found, value, data_out);
+    }
+
+    // As above, referencing the value in place, in the source table's record
+    lookup get(std::string_view key, table::key_hash const & h, std::span<std::byte const> & value_out, sequence_t snapshot = MAX_SEQUENCE) const
+    {
+        record const * r = this->source.visible(this->get(key, h), snapshot);
+        if (this->deleted.covers(key, r ? r->sequence : 0, snapshot)) { return lookup::deleted; }
+        return table::view(r, value_out);
+    }
+
+    // the ranges deleted in the table
+    range_tombstones const & deleted_ranges() const { return this->deleted; }
+
+    // returns the index of the first key not less than "key", or size() if there is none
+    size_t lower_bound(std::string_view key) const
+    {
+        uint64_t const p = prefix(key);
+        size_t const n = this->size();
+
+        // descend the implicit tree, going right whenever the node's key is less than ours
+        size_t k = 1;
+        while (k <= n)
+        {
+            // children of k's children are 4 slots on from 4k - fetch them while we compare
+            __builtin_prefetch(&this->layout[std::min(4 * k, n)]);
+            slot const & s = this->layout[k];
+            bool const less = s.prefix != p ? s.prefix < p
+                                            : std::string_view{this->keys.data() + s.key_offset, s.key_size} < key;
+            k = 2 * k + less;
+        }
+
+        // undo the trailing right turns (and the final left turn) to find the lower bound's slot
+        k >>= __builtin_ffsll(~k);
+        return k == 0 ? n : this->layout[k].idx;
+    }
 
-    config_opts const config;
 private:
-    std::vector<record> records{};
-    std::atomic_size_t total_data_size{};
-    std::atomic_size_t data_size{};
-    std::atomic_bool is_locked{};
-    std::atomic_int32_t next_record{};
-    node head{this, std::string(), -1};
+    struct entry
+    {
+        uint32_t key_offset{};
+        uint32_t key_size{};
+        record const * value{};
+    };
+
+    // an Eytzinger-ordered search slot: the key's leading bytes, where to find the rest of the key,
+    // and the key's position in "entries"
+    struct slot
+    {
+        uint64_t prefix{};
+        uint32_t key_offset{};
+        uint32_t key_size{};
+        uint32_t idx{};
+    };
+
+    // the leading 8 bytes of a key, big-endian and zero padded, so that integer order matches key order
+    // (up to ties, which are resolved by comparing the full keys)
+    static uint64_t prefix(std::string_view key)
+    {
+        uint64_t p{};
+        for (size_t i = 0; i < sizeof(p); i++)
+        {
+            p <<= 8;
+            if (i < key.size()) { p |= static_cast<uint8_t>(key[i]); }
+        }
+
+        return p;
+    }
+
+    // fills the layout by an in-order walk of the implicit tree, which visits slots in ascending key order
+    void build_layout(size_t k, size_t & next)
+    {
+        if (k >= this->layout.size()) { return; }
+        this->build_layout(2 * k, next);
+        this->layout[k] = slot{
+            .prefix = prefix(this->key(next)),
+            .key_offset = this->entries[next].key_offset,
+            .key_size = this->entries[next].key_size,
+            .idx = static_cast<uint32_t>(next)};
+        next += 1;
+        this->build_layout(2 * k + 1, next);
+    }
+
+    table const & source;
+    write_buffer_manager * const write_buffer;
+    // the memory of "keys", "entries" and "layout", reserved from "write_buffer"
+    size_t reserved{};
+    range_tombstones deleted{};
+    std::string keys{};
+    std::vector<entry> entries{};
+    // 1-based, slot 0 is unused
+    std::vector<slot> layout{};
 };
 
 } // namespace KVSTORE_NS::memtable
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <ns.h>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace KVSTORE_NS
+{
+// A value read by "kvstore::get" without copying it: a view of the bytes where the store holds them,
+// in a mapping of an sst file (or the row cache). The memory viewed is kept alive by the value's "pin" until
+// the value is reset, reassigned or destroyed, so values should not be held longer than needed.
+// Small values, and values read from memtables, are copied into the value's own buffer instead (see kvstore.h).
+// A pin is a reference count, so a value may be moved to, and released on, any thread, and may outlive the store.
+struct pinned_value
+{
+    pinned_value() = default;
+
+    pinned_value(pinned_value&&) = default;
+    pinned_value(pinned_value const &) = delete;
+    pinned_value& operator=(pinned_value&&) = default;
+    pinned_value& operator=(pinned_value const&) = delete;
+
+    // the value's bytes. Valid until the value is reset.
+    std::span<std::byte const> data() const { return this->view; }
+    size_t size() const { return this->view.size(); }
+    bool empty() const { return this->view.empty(); }
+
+    // true if the value references the store's memory, rather than a copy
+    bool pinned() const { return this->pin != nullptr; }
+
+    // releases the memory viewed, leaving the value empty. The value's own buffer is kept for reuse.
+    void reset()
+    {
+        this->pin.reset();
+        this->view = {};
+    }
+
+    // views "bytes" in place, keeping them valid by holding "owner"
+    void pin_to(std::span<std::byte const> bytes, std::shared_ptr<void const> owner)
+    {
+        this->pin = std::move(owner);
+        this->view = bytes;
+    }
+
+    // copies "bytes" into the value's own buffer, releasing any pin
+    void copy_from(std::span<std::byte const> bytes)
+    {
+        this->pin.reset();
+        this->buffer.resize(bytes.size());
+        memcpy(this->buffer.data(), bytes.data(), bytes.size());
+        this->view = this->buffer;
+    }
+
+private:
+    std::span<std::byte const> view{};
+    std::shared_ptr<void const> pin{};
+    std::vector<std::byte> buffer{};
+};
+
+} // namespace KVSTORE_NS
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <ns.h>
+#include <literals.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+using namespace std::literals::chrono_literals;
+using namespace KVSTORE_NS::literals;
+
+namespace KVSTORE_NS
+{
+// A token-bucket limit on the rate at which background jobs write to disk, so that bursts of flush and compaction writes
+// don't saturate the device and delay foreground reads.
+// Flushes and compactions draw on separate buckets, each refilled at its own rate. Flushes take priority:
+// a flush may borrow tokens left in the compaction bucket, and compactions wait while any flush waits for tokens.
+// A write may overdraw its bucket, so writes larger than a bucket's burst still complete; later writes then wait out the debt.
+//
+// With auto-tuning, the rates follow the latency of foreground reads, as sampled by "sample":
+// they are cut while reads are slower than the target, and restored towards the configured rates while they are not.
+// A single limiter may be shared by several stores, limiting the writes of all of them to one device.
+struct rate_limiter
+{
+    struct config_options
+    {
+        // the rates at which flushes and compactions may write, in bytes per second. Zero does not limit writes.
+        size_t flush_bytes_per_second{};
+        size_t compaction_bytes_per_second{};
+
+        // the most tokens a bucket holds, as a period of its rate. Longer periods allow larger bursts after idle time.
+        std::chrono::milliseconds burst_period{100ms};
+
+        // adjust the rates to keep foreground reads near "target_read_latency"
+        bool auto_tune{false};
+        std::chrono::microseconds target_read_latency{500us};
+
+        // the rates are adjusted at this period, and never cut below "min_rate_ratio" of the configured rates
+        std::chrono::milliseconds tune_period{1000ms};
+        double min_rate_ratio{0.1};
+    };
+
+    enum class priority
+    {
+        flush,
+        compaction,
+    };
+
+    explicit rate_limiter(config_options const & opts) : config(opts)
+    {
+        this->flush.rate = double(opts.flush_bytes_per_second);
+        this->compaction.rate = double(opts.compaction_bytes_per_second);
+    }
+
+    rate_limiter(rate_limiter&&) = delete;
+    rate_limiter(rate_limiter const &) = delete;
+    rate_limiter& operator=(rate_limiter&&) = delete;
+    rate_limiter& operator=(rate_limiter const&) = delete;
+
+    // Blocks until "bytes" may be written by a job of the given priority
+    void request(size_t bytes, priority p)
+    {
+        bucket & own = p == priority::flush ? this->flush : this->compaction;
+        if (own.rate == 0 && !this->config.auto_tune) { return; }
+
+        std::unique_lock lock{this->mutex};
+        if (p == priority::flush) { this->waiting_flushes += 1; }
+
+        while (true)
+        {
+            this->refill();
+            if (this->unlimited(p)) { break; }
+
+            // compactions yield to waiting flushes, until they are granted their tokens
+            if (p == priority::compaction && this->waiting_flushes > 0)
+            {
+                this->granted.wait(lock);
+                continue;
+            }
+
+            if (own.tokens > 0)
+            {
+                own.tokens -= double(bytes);
+                break;
+            }
+
+            if (p == priority::flush && this->compaction.rate > 0 && this->compaction.tokens > 0)
+            {
+                this->compaction.tokens -= double(bytes);
+                break;
+            }
+
+            // wait until our bucket is out of debt
+            double const deficit = std::max(-own.tokens, 1.0);
+            this->granted.wait_for(lock, std::chrono::duration<double>(deficit / std::max(own.rate, 1.0)));
+        }
+
+        if (p == priority::flush)
+        {
+            this->waiting_flushes -= 1;
+            this->granted.notify_all();
+        }
+    }
+
+    // Times a foreground read while in scope, if auto-tuning. Only one read in "SAMPLE_INTERVAL" is timed per thread.
+    struct sample
+    {
+        static uint32_t constexpr SAMPLE_INTERVAL = 64;
+
+        explicit sample(rate_limiter * limiter) : limiter(limiter && limiter->config.auto_tune && due() ? limiter : nullptr)
+        {
+            if (this->limiter) { this->start = std::chrono::steady_clock::now(); }
+        }
+
+        ~sample()
+        {
+            if (this->limiter) { this->limiter->record(std::chrono::steady_clock::now() - this->start); }
+        }
+
+        sample(sample&&) = delete;
+        sample(sample const &) = delete;
+        sample& operator=(sample&&) = delete;
+        sample& operator=(sample const&) = delete;
+
+    private:
+        static bool due()
+        {
+            static thread_local uint32_t reads{};
+            return ++reads % SAMPLE_INTERVAL == 0;
+        }
+
+        rate_limiter * const limiter;
+        std::chrono::steady_clock::time_point start{};
+    };
+
+    // the current rate of writes at the given priority, in bytes per second, or zero if unlimited
+    size_t rate(priority p)
+    {
+        std::lock_guard lock{this->mutex};
+        return size_t(p == priority::flush ? this->flush.rate : this->compaction.rate);
+    }
+
+    config_options const config;
+
+private:
+    struct bucket
+    {
+        double rate{};
+        double tokens{};
+    };
+
+    bool unlimited(priority p) const { return (p == priority::flush ? this->flush.rate : this->compaction.rate) == 0; }
+
+    // adds the tokens accrued since the last refill. Requires "mutex".
+    void refill()
+    {
+        auto const now = std::chrono::steady_clock::now();
+        double const elapsed = std::chrono::duration<double>(now - this->last_refill).count();
+        this->last_refill = now;
+
+        double const burst = std::chrono::duration<double>(this->config.burst_period).count();
+        for (bucket * b : {&this->flush, &this->compaction})
+        {
+            b->tokens = std::min(b->tokens + b->rate * elapsed, b->rate * burst);
+        }
+    }
+
+    // folds a read latency into the running average, and adjusts the rates once per tune period
+    void record(std::chrono::steady_clock::duration latency)
+    {
+        std::lock_guard lock{this->mutex};
+        double const us = std::chrono::duration<double, std::micro>(latency).count();
+        this->average_latency = this->average_latency == 0 ? us : 0.9 * this->average_latency + 0.1 * us;
+
+        auto const now = std::chrono::steady_clock::now();
+        if (now - this->last_tune < this->config.tune_period) { return; }
+        this->last_tune = now;
+
+        // cut quickly while reads are slow, and recover slowly, so the rates settle just below the point reads suffer
+        bool const slow = this->average_latency > double(this->config.target_read_latency.count());
+        this->tune_ratio = std::clamp(this->tune_ratio * (slow ? 0.7 : 1.1), this->config.min_rate_ratio, 1.0);
+
+        this->refill();
+        this->flush.rate = double(this->config.flush_bytes_per_second) * this->tune_ratio;
+        this->compaction.rate = double(this->config.compaction_bytes_per_second) * this->tune_ratio;
+    }
+
+    std::mutex mutex{};
+    std::condition_variable granted{};
+    bucket flush{};
+    bucket compaction{};
+    size_t waiting_flushes{};
+    std::chrono::steady_clock::time_point last_refill{std::chrono::steady_clock::now()};
+
+    // auto-tuning state: the average sampled read latency in microseconds, and the fraction of the configured rates in use
+    double average_latency{};
+    double tune_ratio{1.0};
+    std::chrono::steady_clock::time_point last_tune{std::chrono::steady_clock::now()};
+};
+
+} // namespace KVSTORE_NS
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <ns.h>
+#include <literals.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <xxhash64.h>
+
+using namespace KVSTORE_NS::literals;
+
+namespace KVSTORE_NS
+{
+// A cache of values read from a store's sst files, by key, checked by "get" after the memtables, so that a hit
+// costs neither a file search nor a copy out of the file (see kvstore.h).
+// The cache is split into shards by key hash, each with its own lock and an equal share of the byte budget.
+//
+// Each shard follows the W-TinyLFU policy, as presented in
+// G. Einziger, R. Friedman, B. Manes, TinyLFU: A Highly Efficient Cache Admission Policy, (ACM ToS) 2017.
+// New values enter a small LRU "window". A value leaving the window is only admitted to the main cache if its key has
+// been read more often, as estimated by a count-min sketch of recent reads, than the value it would evict.
+// The main cache is a segmented LRU: values read again while on probation are protected, and the protected
+// values least recently read are demoted back to probation. Skewed reads thus keep the hot keys cached,
+// while a scan of cold keys only churns the window.
+//
+// Values are shared, so a reader may hold one (see pinned_value.h) after it is evicted.
+struct row_cache
+{
+    struct config_options
+    {
+        // the memory budget of the cache, in bytes, including the keys and a fixed overhead per value
+        size_t capacity{64_MiB};
+
+        // the number of shards. Rounded up to a power of 2.
+        size_t shards{16};
+
+        // the fraction of each shard's budget held by the window, and of the rest held by protected values
+        double window_ratio{0.01};
+        double protected_ratio{0.8};
+    };
+
+    using value_ptr = std::shared_ptr<std::vector<std::byte> const>;
+
+    explicit row_cache(config_options const & opts) :
+        config(opts),
+        shards(std::bit_ceil(std::max<size_t>(opts.shards, 1)))
+    {
+        for (shard & s : this->shards) { s.configure(opts, opts.capacity / this->shards.size()); }
+    }
+
+    row_cache(row_cache&&) = delete;
+    row_cache(row_cache const &) = delete;
+    row_cache& operator=(row_cache&&) = delete;
+    row_cache& operator=(row_cache const&) = delete;
+
+    // Returns the value cached for "key", or nullptr. Every read is counted, hit or miss, towards the key's admission.
+    value_ptr get(std::string_view key)
+    {
+        uint64_t const h = hash(key);
+        shard & s = this->shard_of(h);
+        std::lock_guard lock{s.mutex};
+        s.sketch.increment(h);
+        return s.get(key);
+    }
+
+    // The generation of the cache's contents, taken before reading the files a value may be inserted from.
+    // Each "erase" advances the generation, so a value read from files older than the erase is never inserted after it.
+    uint64_t generation() const { return this->gen.load(); }
+
+    // Caches "value" for "key", as read from the files after "generation" was taken, unless an erase has happened since.
+    void insert(std::string_view key, std::span<std::byte const> value, uint64_t generation)
+    {
+        uint64_t const h = hash(key);
+        shard & s = this->shard_of(h);
+        size_t const charge = charge_of(key, value);
+        if (charge > s.max_charge()) { return; }
+
+        auto copy = std::make_shared<std::vector<std::byte> const>(value.begin(), value.end());
+        std::lock_guard lock{s.mutex};
+        if (this->gen.load() != generation) { return; }
+        s.insert(key, h, std::move(copy), charge);
+    }
+
+    // Drops the value cached for "key". Called once a newer version of the key is visible in the files.
+    void erase(std::string_view key)
+    {
+        shard & s = this->shard_of(hash(key));
+        this->gen += 1;
+        std::lock_guard lock{s.mutex};
+        s.erase(key);
+    }
+
+    // Drops the values cached for the keys from "begin" up to (not including) "end".
+    // Each shard finds the keys in its ordered index, so the cost follows the keys dropped, not the size of the cache.
+    void erase_range(std::string_view begin, std::string_view end)
+    {
+        this->gen += 1;
+        for (shard & s : this->shards)
+        {
+            std::lock_guard lock{s.mutex};
+            s.erase_range(begin, end);
+        }
+    }
+
+    // the bytes charged to the cached values
+    size_t usage() const
+    {
+        size_t bytes{};
+        for (shard const & s : this->shards)
+        {
+            std::lock_guard lock{s.mutex};
+            bytes += s.usage();
+        }
+
+        return bytes;
+    }
+
+    config_options const config;
+
+private:
+    // An estimate of how often each key has been read recently: 4 rows of saturating 4 bit counters, of which a key's
+    // count is the least. Every counter is halved once the sketch has counted 10 reads per counter in a row,
+    // so the estimates follow changes in which keys are hot.
+    struct frequency_sketch
+    {
+        void resize(size_t counters)
+        {
+            this->width = std::bit_ceil(std::max<size_t>(counters, 64));
+            this->rows.assign(ROWS * this->width / 2, 0);
+            this->sample = 10 * this->width;
+        }
+
+        void increment(uint64_t h)
+        {
+            bool added{};
+            for (size_t r = 0; r < ROWS; r++)
+            {
+                size_t const i = this->index(h, r);
+                uint8_t & b = this->rows[i / 2];
+                size_t const shift = (i % 2) * 4;
+                if (((b >> shift) & 0xF) < 0xF)
+                {
+                    b += uint8_t(1 << shift);
+                    added = true;
+                }
+            }
+
+            if (added && ++this->count >= this->sample) { this->age(); }
+        }
+
+        uint8_t estimate(uint64_t h) const
+        {
+            uint8_t least = 0xF;
+            for (size_t r = 0; r < ROWS; r++)
+            {
+                size_t const i = this->index(h, r);
+                least = std::min<uint8_t>(least, (this->rows[i / 2] >> ((i % 2) * 4)) & 0xF);
+            }
+
+            return least;
+        }
+
+    private:
+        static size_t constexpr ROWS = 4;
+
+        // the counter of row "r" for a key, by double hashing
+        size_t index(uint64_t h, size_t r) const
+        {
+            uint64_t const h2 = (h >> 32) | 1;
+            return r * this->width + ((h + r * h2) & (this->width - 1));
+        }
+
+        void age()
+        {
+            // halves both counters of each byte at once
+            for (uint8_t & b : this->rows) { b = (b >> 1) & 0x77; }
+            this->count /= 2;
+        }
+
+        size_t width{};
+        std::vector<uint8_t> rows{};
+        size_t sample{};
+        size_t count{};
+    };
+
+    enum class region
+    {
+        window,
+        probation,
+        protect,
+    };
+
+    struct node
+    {
+        std::string key{};
+        uint64_t hash{};
+        value_ptr value{};
+        size_t charge{};
+        region where{};
+    };
+
+    using list = std::list<node>;
+
+    struct shard
+    {
+        void configure(config_options const & opts, size_t bytes)
+        {
+            this->window_capacity = size_t(bytes * opts.window_ratio);
+            this->main_capacity = bytes - this->window_capacity;
+            this->protect_capacity = size_t(this->main_capacity * opts.protected_ratio);
+
+            // sized for values of a few hundred bytes - the sketch only needs to tell hot keys from cold
+            this->sketch.resize(bytes / 256);
+        }
+
+        // the largest charge of a value the shard can hold
+        size_t max_charge() const { return this->main_capacity; }
+        size_t usage() const { return this->bytes[0] + this->bytes[1] + this->bytes[2]; }
+
+        value_ptr get(std::string_view key)
+        {
+            auto it = this->index.find(key);
+            if (it == this->index.end()) { return nullptr; }
+
+            list::iterator n = it->second;
+            switch (n->where)
+            {
+                case region::window: this->move(n, region::window); break;
+                case region::protect: this->move(n, region::protect); break;
+                case region::probation:
+                    // read again on probation - protect it, demoting the least recently read protected values to make room
+                    this->move(n, region::protect);
+                    while (this->bytes[size_t(region::protect)] > this->protect_capacity)
+                    {
+                        this->move(std::prev(this->lists[size_t(region::protect)].end()), region::probation);
+                    }
+
+                    break;
+            }
+
+            return n->value;
+        }
+
+        void insert(std::string_view key, uint64_t h, value_ptr value, size_t charge)
+        {
+            this->erase(key);
+
+            list & window = this->lists[size_t(region::window)];
+            window.push_front(node{.key = std::string(key), .hash = h, .value = std::move(value), .charge = charge, .where = region::window});
+            this->bytes[size_t(region::window)] += charge;
+            this->index.emplace(window.front().key, window.begin());
+            this->ordered.emplace(window.front().key);
+
+            while (this->bytes[size_t(region::window)] > this->window_capacity) { this->admit(std::prev(window.end())); }
+        }
+
+        void erase(std::string_view key)
+        {
+            if (auto it = this->index.find(key); it != this->index.end()) { this->remove(it->second); }
+        }
+
+        void erase_range(std::string_view begin, std::string_view end)
+        {
+            auto it = this->ordered.lower_bound(begin);
+            while (it != this->ordered.end() && *it < end)
+            {
+                std::string_view const key = *it++;
+                this->remove(this->index.at(key));
+            }
+        }
+
+        mutable std::mutex mutex{};
+        frequency_sketch sketch{};
+
+    private:
+        // Moves "candidate", the least recently read value of the window, into the main cache if there is room for it,
+        // or if it is read more often than the values it would evict. Otherwise, it is evicted itself.
+        void admit(list::iterator candidate)
+        {
+            uint8_t const freq = this->sketch.estimate(candidate->hash);
+            while (this->main_usage() + candidate->charge > this->main_capacity)
+            {
+                list & probation = this->lists[size_t(region::probation)];
+                list & protect = this->lists[size_t(region::protect)];
+                list::iterator const victim = std::prev(!probation.empty() ? probation.end() : protect.end());
+                if (this->sketch.estimate(victim->hash) >= freq)
+                {
+                    this->remove(candidate);
+                    return;
+                }
+
+                this->remove(victim);
+            }
+
+            this->move(candidate, region::probation);
+        }
+
+        size_t main_usage() const { return this->bytes[size_t(region::probation)] + this->bytes[size_t(region::protect)]; }
+
+        // moves "n" to the front of the list of region "r"
+        void move(list::iterator n, region r)
+        {
+            this->bytes[size_t(n->where)] -= n->charge;
+            this->bytes[size_t(r)] += n->charge;
+            this->lists[size_t(r)].splice(this->lists[size_t(r)].begin(), this->lists[size_t(n->where)], n);
+            n->where = r;
+        }
+
+        void remove(list::iterator n)
+        {
+            this->index.erase(n->key);
+            this->ordered.erase(n->key);
+            this->bytes[size_t(n->where)] -= n->charge;
+            this->lists[size_t(n->where)].erase(n);
+        }
+
+        size_t window_capacity{};
+        size_t main_capacity{};
+        size_t protect_capacity{};
+        list lists[3]{};
+        size_t bytes[3]{};
+        // keyed by views of the nodes' own keys, which stay in place as nodes move between lists
+        std::unordered_map<std::string_view, list::iterator> index{};
+        // the same keys in order, for "erase_range". Point lookups keep to the hash index.
+        std::set<std::string_view> ordered{};
+    };
+
+    static uint64_t hash(std::string_view key) { return XXHash64::hash(key.data(), key.size(), 0); }
+
+    // the bytes charged for a value: its key and data, and an estimate of the node and index overhead
+    static size_t charge_of(std::string_view key, std::span<std::byte const> value) { return key.size() + value.size() + 128; }
+
+    shard & shard_of(uint64_t h) { return this->shards[(h >> 48) & (this->shards.size() - 1)]; }
+
+    std::vector<shard> shards;
+    std::atomic<uint64_t> gen{};
+};
+
+} // namespace KVSTORE_NS
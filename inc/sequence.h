@@ -0,0 +1,55 @@
+#pragma once
+
+#include <ns.h>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace KVSTORE_NS
+{
+// Every write to a store is stamped with a sequence number, one greater than that of the write before it.
+// Versions of a key are ordered by sequence, and a read at a snapshot's sequence only sees the writes up to it.
+using sequence_t = uint64_t;
+
+// Reads at this sequence see every write. Sequences are stored in sst files alongside an 8 bit value type.
+inline constexpr sequence_t MAX_SEQUENCE = std::numeric_limits<sequence_t>::max() >> 8;
+
+// The versions of keys that must be kept by a flush or compaction, for the snapshots open as it started.
+// The snapshots divide sequences into stripes: a snapshot reads the newest version at or below its sequence,
+// so of several versions of a key in one stripe, only the newest can ever be read.
+// "horizon" is the last sequence published as the list was taken. A snapshot taken later may read any write after it,
+// so those writes are never hidden.
+struct retention
+{
+    retention() = default;
+
+    retention(std::vector<sequence_t> snapshots, sequence_t horizon) : snapshots(std::move(snapshots)), horizon(horizon)
+    {
+        std::sort(this->snapshots.begin(), this->snapshots.end());
+    }
+
+    // true if no snapshot (or later read) may read the version at "older", rather than the newer version at "newer"
+    bool hides(sequence_t newer, sequence_t older) const
+    {
+        return newer <= this->horizon && this->stripe(newer) == this->stripe(older);
+    }
+
+    // true if every snapshot, and every later read, reads the version at "sequence" or a newer one
+    bool visible_to_all(sequence_t sequence) const
+    {
+        return sequence <= this->horizon && (this->snapshots.empty() || sequence <= this->snapshots.front());
+    }
+
+private:
+    // the index of the first snapshot which reads "sequence"
+    size_t stripe(sequence_t sequence) const
+    {
+        return std::lower_bound(this->snapshots.begin(), this->snapshots.end(), sequence) - this->snapshots.begin();
+    }
+
+    std::vector<sequence_t> snapshots{};
+    sequence_t horizon{MAX_SEQUENCE};
+};
+
+} // namespace KVSTORE_NS
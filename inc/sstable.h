@@ -5,7 +5,13 @@
 #include <chrono>
 #include <literals.h>
 #include <memtable.h>
+#include <sync_file.h>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
 // Linux only for usage of file operations (open, ftruncate, mmap, etc)
 #include <fcntl.h>
 #include <unistd.h>
@@ -22,6 +28,8 @@ using namespace KVSTORE_NS::memtable;
  * https://github.com/facebook/rocksdb/wiki/Rocksdb-BlockBasedTable-Format
  *
  * Keys are prefix-compressed to reduce space, save for inermittent "index" keys, which reset the prefix for the next segment of blocks.
+ * A key may have several entries, one per version kept for open snapshots, in order of descending sequence.
+ * Only the first entry of a key may be an index key, unless a block starts part way through its versions.
  * The first key of a data block is always an "index" key. Key entries are padded to 8-byte alignment, which may add up to 14 bytes per entry.
  * An out of scope improvement woud be a bloom filter, used for a fast check to determine if a given key is stored in the given file
  * In addition, instead of using fixed size blocks, which might lead to significant wasted space in the file,
@@ -31,6 +39,7 @@ using namespace KVSTORE_NS::memtable;
  *   prefix_bytes: uint64 - number of shared bytes from last index key: all index keys have value "0".
  *   suffix_bytes: uint64 - number of bytes in the remainder of the key after the shared prefix from the last index key.
  *   value_bytes: uint64 - size of the value data
+ *   tag: uint64 - the entry's sequence, shifted left 8 bits, over its value type: a value, or the deletion of the key (with no value data)
  *   key_suffix: byte[suffix_bytes] - the remaining bytes of the key after the shared prefix. NOT nul-terminated.
  *   padding: byte[] - zero padding to 8-byte alignment
  *   value_data: byte[value_bytes] - the value for the given key.
@@ -49,13 +58,29 @@ using namespace KVSTORE_NS::memtable;
  *  Block Footer
  * ...
  * Data Block N
+ * Range Tombstones - the key ranges deleted by the file, disjoint and in key order
+ *  Range 0
+ *   begin_bytes: uint64 - size of the first key deleted
+ *   end_bytes: uint64 - size of the key the range ends before
+ *   sequence: uint64 - the sequence of the deletion
+ *   begin: byte[begin_bytes], padding: byte[] - zero padding to 8-byte alignment
+ *   end: byte[end_bytes], padding: byte[] - zero padding to 8-byte alignment
+ *  ...
+ *  Range M
  * Footer
  *  block_size: uint64_t - the size in bytes of each data block
- *  block_count: uint64_t - number of blocks (of block_size bytes) in the file
+ *  block_count: uint64_t - number of blocks (of block_size bytes) in the file. May be 0 if the file only deletes ranges.
  *  entry_count: uint64 - total count of entries in all data blocks
  *  key_bytes: uint64 - total size of all keys before prefix compression
  *  value_bytes: uint64 - total size of all value data in the file
- *  magic: uint64 - fixed 0x677265676F727968
+ *  range_count: uint64 - number of range tombstones
+ *  largest_sequence: uint64 - the highest sequence of any entry or range
+ *  format_version: uint64 - the version of this format: 2
+ *  magic: uint64 - fixed 0x677265676F72796B
+ *
+ * Format 1 files, from before entries had sequences or deleted keys, have entries without a tag, no range tombstones,
+ * and a footer of only block_size, block_count, entry_count, key_bytes and value_bytes, ending in the magic 0x677265676F727968.
+ * They are rewritten in the current format as they are loaded (see "upgrade").
  */
 
 namespace KVSTORE_NS::sst
@@ -69,8 +94,9 @@ struct sstable
         std::filesystem::path base_dir{"."};
     };
 
-    sstable(config_options const & opts) :
-        t(std::chrono::steady_clock::now()),
+    // Files are ordered by "time", so files written concurrently must be given the times of the data they hold.
+    sstable(config_options const & opts, std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now()) :
+        t(time),
         // file path under the base directory is simply the timestamp. Assume that the files will be created at a rate of less than 1/ms
         path(opts.base_dir / (std::to_string(this->t.time_since_epoch() / 1ns) + FILE_EXT)),
         config(opts)
@@ -78,128 +104,205 @@ struct sstable
 
     }
 
-    // Use this ctor to simultaneously write the file from the passed table
-    sstable(config_options const & opts, memtable::skiptable const & table) : sstable(opts)
+    // Use this ctor to simultaneously write the file from the passed table (see "writer" for "throttle", "build" for "keep")
+    sstable(config_options const & opts, memtable::sorted_table const & table,
+            std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now(),
+            std::function<void(size_t)> throttle = {}, retention const & keep = {}) :
+        sstable(opts, time)
     {
-        bool built = this->build(table);
+        bool built = this->build(table, std::move(throttle), keep);
         assert(built);
     }
 
     // Load the config information for an existing file and take ownership of that sst file
-    sstable(std::filesystem::path const & sstfile) : t(t_from(sstfile)), path(sstfile), config(config_from(sstfile))
+    sstable(std::filesystem::path const & sstfile) : t(t_from(sstfile)), path(sstfile), config(config_from(sstfile)),
+        bytes(std::filesystem::file_size(sstfile))
     {
+        footer const ftr{footer_from(sstfile)};
+        this->ranges = ranges_from(sstfile, ftr);
+        this->max_sequence = ftr.largest_sequence;
+
+        // the key range of the file is read from its first entry, and from the entries of its last block
+        if (ftr.block_count > 0)
+        {
+            cursor first{*this};
+            this->first_key = first.key();
+            for (cursor last{*this, ftr.block_count - 1}; last.valid(); last.next()) { this->last_key = last.key(); }
+        }
+
+        this->extend_key_range(ftr.entry_count > 0);
     }
 
-    // sort sst files by timestamp
-    bool operator<(sstable const & other) const { return this->t < other.t; }
+    // the format version of a file: 1 for a file of the legacy format, or 0 if the file is not an sst file of any known format
+    static uint64_t format_of(std::filesystem::path const & sstfile)
+    {
+        std::ifstream f{sstfile, std::ios::binary};
+        uint64_t magic{};
+        f.seekg(-static_cast<std::streamoff>(sizeof(magic)), std::ios::end);
+        f.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+        if (!f.good()) { return 0; }
+        if (magic == legacy_footer::MAGIC_NUMBER) { return 1; }
+        if (magic != footer::MAGIC_NUMBER) { return 0; }
+
+        uint64_t version{};
+        f.seekg(-static_cast<std::streamoff>(sizeof(magic) + sizeof(version)), std::ios::end);
+        f.read(reinterpret_cast<char *>(&version), sizeof(version));
+        return f.good() ? version : 0;
+    }
 
-    // Build a sst file from the data in a given memtable - the memtable must be locked.
-    // This uses platform-agnostic c++ streams for portability, as writing sequentially should still be "fast"
-    // (compared to platform-specific file operations).
-    bool build(memtable::skiptable const & table) const
+    // Rewrites a file of an older format (see the format definition) in the current one, before it is loaded.
+    // Format 1 entries become values at sequence 0, older than any write since. The file is written beside the old one,
+    // then renamed over it, so a crash leaves one or the other whole. Files of unknown formats end the process (see "unreadable").
+    static void upgrade(std::filesystem::path const & sstfile)
     {
-        if (!table.locked() ) { return false; }
+        uint64_t const format = format_of(sstfile);
+        if (format == footer::FORMAT_VERSION) { return; }
+        if (format != 1) { unreadable(sstfile, "unknown format"); }
+
+        std::ifstream in{sstfile, std::ios::binary};
+        legacy_footer old{};
+        in.seekg(-static_cast<std::streamoff>(sizeof(old)), std::ios::end);
+        in.read(reinterpret_cast<char *>(&old), sizeof(old));
+        if (!in.good() || old.block_size == 0) { unreadable(sstfile, "truncated format 1 footer"); }
+
+        sstable upgraded{config_options{.max_block_size = old.block_size, .base_dir = sstfile.parent_path()}, t_from(sstfile)};
+        upgraded.path += ".upgrade";
+        {
+            writer w{upgraded};
+            std::vector<char> block(old.block_size);
+            std::string key{};
+            std::string index_key{};
+            uint64_t entries{};
+            in.seekg(0, std::ios::beg);
+            for (uint64_t b = 0; b < old.block_count; b++)
+            {
+                in.read(block.data(), block.size());
+                if (!in.good()) { unreadable(sstfile, "truncated format 1 block"); }
+
+                // entries run from the start of the block up to its padding, or to the index offsets ending it.
+                // A zeroed header is padding, unless it is the file's first entry: the empty key, with an empty value.
+                uint64_t idx_count{};
+                memcpy(&idx_count, block.data() + block.size() - sizeof(idx_count), sizeof(idx_count));
+                size_t const entries_end = block.size() - sizeof(uint64_t) * (idx_count + 1);
+                for (size_t offset = 0; offset + sizeof(legacy_entry_header) <= entries_end && entries < old.entry_count; entries++)
+                {
+                    legacy_entry_header hdr{};
+                    memcpy(&hdr, block.data() + offset, sizeof(hdr));
+                    if (entries > 0 && hdr.prefix_bytes == 0 && hdr.suffix_bytes == 0 && hdr.value_bytes == 0) { break; }
+
+                    char const * suffix = block.data() + offset + sizeof(hdr);
+                    char const * value = suffix + hdr.suffix_bytes + entry_header::padding_bytes(hdr.suffix_bytes);
+                    if (hdr.prefix_bytes == 0) { index_key.assign(suffix, hdr.suffix_bytes); }
+                    key.assign(index_key, 0, hdr.prefix_bytes);
+                    key.append(suffix, hdr.suffix_bytes);
+                    w.add(key, value, hdr.value_bytes);
+
+                    offset = (value - block.data()) + hdr.value_bytes + entry_header::padding_bytes(hdr.value_bytes);
+                }
+            }
 
-        std::ofstream of{this->path, std::ios::binary};
-        assert(of.good());
+            w.finish();
+        }
 
-        // iterate over the keys, writing data to the file as we go
-        size_t blocks = 0;
-        size_t key_bytes{};
-        size_t data_bytes{};
-        size_t entries{};
-        std::string_view prefix{};
-        size_t block_bytes{};
-        std::vector<uint64_t> idx_offsets{};
+        std::filesystem::rename(upgraded.path, sstfile);
+        sync_directory(sstfile.parent_path());
+    }
 
-        memtable::skiptable::node const * n = table.first();
-        while (n)
-        {
-            auto record = table.get(n);
-            std::string_view key{n->key};
+    // Removes the file, if it was made obsolete
+    ~sstable()
+    {
+        if (this->obsolete) { std::filesystem::remove(this->path); }
+    }
 
-            key_bytes += key.size();
-            data_bytes += record->size;
-            entries += 1;
+    // Marks the file to be removed once it is no longer referenced, when it is replaced by compaction.
+    // Readers hold their files by shared pointers, so a reader still using the file keeps it on disk.
+    void make_obsolete() const { this->obsolete = true; }
 
-            entry_header hdr{header_from(prefix, n)};
+    // sort sst files by timestamp
+    bool operator<(sstable const & other) const { return this->t < other.t; }
 
-            // Each time a key doesn't match a prefix, we denote it an index key
-            bool const idx_key = hdr.prefix_bytes == 0;
+    std::chrono::steady_clock::time_point time() const { return this->t; }
+    std::filesystem::path const & file_path() const { return this->path; }
 
-            size_t const entry_bytes = sizeof(entry_header)
-                                + hdr.suffix_bytes
-                                + entry_header::padding_bytes(hdr.suffix_bytes)
-                                + record->size
-                                + entry_header::padding_bytes(record->size);
+    // the size of the file, in bytes
+    size_t file_size() const { return this->bytes; }
 
-            // If we need a new block, write the block footer and update counters
-            if (block_bytes > (this->config.max_block_size
-                                - entry_bytes // total bytes for this entry
-                                - (idx_key * sizeof(uint64_t)) // index_offset for this entry
-                                - (idx_offsets.size() * sizeof(uint64_t)) // previous index_offsets
-                                - sizeof(uint64_t))) // final "index_count" uint64
-            {
-                uint64_t const idx_count = idx_offsets.size();
-                size_t const footer_bytes = sizeof(uint64_t) * (idx_count + 1);
-                for (; block_bytes < this->config.max_block_size - footer_bytes; block_bytes++) { of << (char)0; }
-                of.write(reinterpret_cast<char const *>(idx_offsets.data()), idx_count * sizeof(uint64_t));
-                of.write(reinterpret_cast<char const *>(&idx_count), sizeof(idx_count));
-
-                blocks += 1;
-                block_bytes = 0;
-                idx_offsets.clear();
-                prefix = std::string_view();
-            }
+    // the range of keys held or deleted by the file. The end of the last range deleted is included,
+    // so the ranges of neighbouring files in a level may meet at a single key.
+    std::string_view smallest() const { return this->first_key; }
+    std::string_view largest() const { return this->last_key; }
 
-            // write the entry data
-            if (idx_key) { idx_offsets.emplace_back(block_bytes); }
+    // the key ranges deleted by the file
+    range_tombstones const & deleted_ranges() const { return this->ranges; }
 
-            of.write(reinterpret_cast<char const *>(&hdr), sizeof(hdr)); // hdr
-            of << key.substr(hdr.prefix_bytes, hdr.suffix_bytes); // key suffix (entire key in case of idx key)
-            for (size_t i = 0; i < entry_header::padding_bytes(hdr.suffix_bytes); i++) { of << (char)0; } // suffix padding
-            of.write(reinterpret_cast<char const *>(record->data), record->size); // value
-            for (size_t i = 0; i < entry_header::padding_bytes(record->size); i++) { of << (char)0; } // value padding
-            block_bytes += entry_bytes;
+    // the highest sequence written to the file
+    sequence_t largest_sequence() const { return this->max_sequence; }
 
+    // true if the file may hold keys in the range [lo, hi]
+    bool overlaps(std::string_view lo, std::string_view hi) const { return !(hi < this->smallest() || this->largest() < lo); }
 
-            n = n->iterate();
+    // Build a sst file from the data in a given (sorted, immutable) memtable.
+    // Older versions of each key are written only where "keep" needs them.
+    bool build(memtable::sorted_table const & table, std::function<void(size_t)> throttle = {}, retention const & keep = {})
+    {
+        if (table.size() == 0 && table.deleted_ranges().empty()) { return false; }
 
-            // If we are about to exit iteration, we need to write the final block footer
-            if (!n)
+        writer w{*this, std::move(throttle)};
+        for (size_t i = 0; i < table.size(); i++)
+        {
+            table::record const * newer{};
+            for (table::record const * record = table.value(i); record; record = table.previous(*record))
             {
-                uint64_t const idx_count = idx_offsets.size();
-                size_t const footer_bytes = sizeof(uint64_t) * (idx_count + 1);
-                for (; block_bytes < this->config.max_block_size - footer_bytes; block_bytes++) { of << (char)0; }
-                of.write(reinterpret_cast<char const *>(idx_offsets.data()), idx_count * sizeof(uint64_t));
-                of.write(reinterpret_cast<char const *>(&idx_count), sizeof(idx_count));
+                if (!newer || !keep.hides(newer->sequence, record->sequence))
+                {
+                    w.add(table.key(i), record->data, record->size, record->type, record->sequence);
+                }
 
-                blocks += 1;
+                newer = record;
             }
         }
 
-        // write the footer
-        footer const ftr{
-            .block_size = this->config.max_block_size,
-            .block_count = blocks,
-            .entry_count = entries,
-            .key_bytes = key_bytes,
-            .value_bytes = data_bytes,
-            .magic{footer::MAGIC_NUMBER}
-        };
-
-        of.write(reinterpret_cast<char const *>(&ftr), sizeof(ftr));
-        of.flush();
-        of.close();
+        w.finish(table.deleted_ranges());
         return true;
     }
 
-    // Retrieve the data for a given key. Returns true  and copies value into "data_out"
-    // if the key is found, otherwise returns false
+    // Retrieve the data for the newest version of a given key visible at "snapshot".
+    // Copies the value into "data_out" if the key is found.
+    lookup get(std::string_view key, std::vector<std::byte> & data_out, sequence_t snapshot = MAX_SEQUENCE) const
+    {
+        std::span<std::byte const> value{};
+        std::shared_ptr<void const> mapping{};
+        lookup const found = this->get(key, value, mapping, snapshot);
+        return copy(found, value, data_out);
+    }
+
+    // As above, but references the value in place, in a mapping of the file, rather than copying it.
+    // If the key is found, "mapping" receives the mapping, which keeps the value valid until it is released
+    // (even if the file is removed meanwhile).
+    lookup get(std::string_view key, std::span<std::byte const> & value_out, std::shared_ptr<void const> & mapping,
+               sequence_t snapshot = MAX_SEQUENCE) const
+    {
+        if (key < this->smallest() || this->largest() < key) { return lookup::missing; }
+
+        sequence_t sequence{};
+        lookup const found = this->find(key, value_out, mapping, snapshot, sequence);
+        if (this->ranges.covers(key, found == lookup::missing ? 0 : sequence, snapshot))
+        {
+            mapping.reset();
+            return lookup::deleted;
+        }
+
+        return found;
+    }
+
+private:
+    // Searches the data blocks for the newest version of "key" visible at "snapshot", setting "sequence" to its sequence.
     // This operation could be optimized on the "not-found" path with the addition of a bloom filter
     // NB: this code is not platform agnostic, but rather depends on linux file operations.
     // This design was chosen for performance purposes, as c++ streams are slower for non-sequential reads
-    bool get(std::string_view key, std::vector<std::byte> & data_out) const
+    // The file stays mapped, in "mapping", only if the key is found.
+    lookup find(std::string_view key, std::span<std::byte const> & value_out, std::shared_ptr<void const> & mapping,
+                sequence_t snapshot, sequence_t & sequence) const
     {
         assert(std::filesystem::exists(this->path));
         size_t const file_size = std::filesystem::file_size(this->path);
@@ -215,99 +318,201 @@ struct sstable
         // would be to mmap the file block by block as needed, mapping only the footer initially.
         std::byte * fptr = reinterpret_cast<std::byte *>(mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0));
         assert(fptr != MAP_FAILED);
+        // the mapping stays valid once the descriptor is closed
+        close(fd);
 
         auto ftr = reinterpret_cast<footer const *>(fptr + file_size - sizeof(footer));
         assert(ftr->magic == footer::MAGIC_NUMBER);
 
-        // Find the block for our key
+        // the first key of each block is an index key, with no shared prefix
+        auto const first_key = [&](size_t block) {
+            auto hdr = reinterpret_cast<entry_header const *>(fptr + block * ftr->block_size);
+            assert(hdr->prefix_bytes == 0);
+            return std::string_view{reinterpret_cast<char const *>(hdr + 1), hdr->suffix_bytes};
+        };
+
+        // Find the block for our key: the last whose first key sorts before it, as its newest versions may end that block,
+        // or the first block, if it starts with the key
         size_t block{};
-        for (; block < ftr->block_count; block++)
+        for (; block < ftr->block_count; block++) { if (key <= first_key(block)) { break; } }
+
+        if (block == 0 && (ftr->block_count == 0 || key < first_key(0)))
         {
-            size_t const offset = block * ftr->block_size;
-            auto hdr = reinterpret_cast<entry_header const *>(fptr + offset);
-            assert(hdr->prefix_bytes == 0); // the first key in each block should always be an index key
-            std::string_view k{reinterpret_cast<char const *>(hdr + 1), hdr->suffix_bytes};
-            if (key < k) { break; }
+            // "key" sorts before the first key in the file
+            munmap(fptr, file_size);
+            return lookup::missing;
+        }
+
+        lookup found{lookup::missing};
+        for (block = block == 0 ? 0 : block - 1; block < ftr->block_count; block++)
+        {
+            if (this->find_in_block(fptr + block * ftr->block_size, ftr->block_size, key, value_out, snapshot, sequence, found)) { break; }
+
+            // the versions of the key may continue into the next block, which would then start with the key
+            if (block + 1 == ftr->block_count || first_key(block + 1) != key) { break; }
+        }
+
+        if (found == lookup::found)
+        {
+            mapping = std::shared_ptr<void const>(fptr, [file_size](void const * p) { munmap(const_cast<void *>(p), file_size); });
         }
+        else { munmap(fptr, file_size); }
 
-        // We want to look in the block previous to the last checked, as we will break once the block is all keys > "key"
-        block -= 1;
+        return found;
+    }
 
-        size_t const block_base = block * ftr->block_size;
-        uint64_t const idx_count = *reinterpret_cast<uint64_t const *>(fptr + block_base + ftr->block_size - sizeof(uint64_t));
+    // Searches one block for the newest version of "key" visible at "snapshot". Returns true if the search is done,
+    // setting "found", or false if the block ends before it is known whether a later block holds a visible version.
+    static bool find_in_block(std::byte const * block_base, size_t block_size, std::string_view key, std::span<std::byte const> & value_out,
+                              sequence_t snapshot, sequence_t & sequence, lookup & found)
+    {
+        uint64_t const idx_count = *reinterpret_cast<uint64_t const *>(block_base + block_size - sizeof(uint64_t));
         uint64_t idx_offset{};
         std::string_view prefix{};
         for (size_t idx = 0; idx < idx_count; idx ++)
         {
             uint64_t last_offset = idx_offset;
-            idx_offset = *reinterpret_cast<uint64_t const *>(fptr + block_base + ftr->block_size - (sizeof(uint64_t) * (1 + idx_count - idx)));
-            auto hdr = reinterpret_cast<entry_header const *>(fptr + block_base + idx_offset);
+            idx_offset = *reinterpret_cast<uint64_t const *>(block_base + block_size - (sizeof(uint64_t) * (1 + idx_count - idx)));
+            auto hdr = reinterpret_cast<entry_header const *>(block_base + idx_offset);
             assert(hdr->prefix_bytes == 0);
             std::string_view k{reinterpret_cast<char const *>(hdr + 1), hdr->suffix_bytes};
 
-            // same logic as before, we want to look in the sub-block before the last key we checked
+            // we want to look in the sub-block before the first index key past ours
             if (key < k)
             {
                 idx_offset = last_offset;
                 break;
             }
-            else { prefix = k; }
+            else
+            {
+                prefix = k;
+                // the versions of the key start at its index key
+                if (key == k) { break; }
+            }
         }
 
         // search through the section of keys under this prefix / index_key to try and find target
-        // stop iterating if we find our key (and return), or when we reach the next prefix key
-        auto hdr = reinterpret_cast<entry_header const *>(fptr + block_base + idx_offset);
-        do
+        // stop iterating if we find a visible version of our key (and return), or when we reach the next prefix key
+        size_t const entries_end = block_size - sizeof(uint64_t) * (idx_count + 1);
+        auto hdr = reinterpret_cast<entry_header const *>(block_base + idx_offset);
+        bool matched{};
+        while (true)
         {
             std::string_view suffix{reinterpret_cast<char const *>(hdr + 1), hdr->suffix_bytes};
-            if (key.substr(0, hdr->prefix_bytes) == prefix.substr(0, hdr->prefix_bytes) &&
+            if (key.size() == size_t{hdr->prefix_bytes} + hdr->suffix_bytes &&
+                key.substr(0, hdr->prefix_bytes) == prefix.substr(0, hdr->prefix_bytes) &&
                 key.substr(hdr->prefix_bytes, hdr->suffix_bytes) == suffix)
             {
-                // we found out key - copy data and return
-                data_out.resize(hdr->value_bytes);
-                auto src = reinterpret_cast<std::byte const *>(hdr + 1) + hdr->suffix_bytes + entry_header::padding_bytes(hdr->suffix_bytes);
-                memcpy(data_out.data(), src, hdr->value_bytes);
-                munmap(fptr, file_size);
-                return true;
+                matched = true;
+                if (sequence_of(hdr->tag) <= snapshot)
+                {
+                    // we found our key - reference its data and return
+                    sequence = sequence_of(hdr->tag);
+                    found = type_of(hdr->tag) == table::value_type::deletion ? lookup::deleted : lookup::found;
+                    if (found == lookup::found)
+                    {
+                        auto src = reinterpret_cast<std::byte const *>(hdr + 1) + hdr->suffix_bytes + entry_header::padding_bytes(hdr->suffix_bytes);
+                        value_out = {src, hdr->value_bytes};
+                    }
+
+                    return true;
+                }
             }
-            else
-            {
-                hdr = reinterpret_cast<entry_header const *>(reinterpret_cast<std::byte const *>(hdr + 1)
-                    + hdr->suffix_bytes
-                    + entry_header::padding_bytes(hdr->suffix_bytes)
-                    + hdr->value_bytes
-                    + entry_header::padding_bytes(hdr->value_bytes));
-            }
-        } while (hdr->prefix_bytes != 0);
-
-        munmap(fptr, file_size);
-        return false;
+            else if (matched) { return true; }
+
+            hdr = reinterpret_cast<entry_header const *>(reinterpret_cast<std::byte const *>(hdr + 1)
+                + hdr->suffix_bytes
+                + entry_header::padding_bytes(hdr->suffix_bytes)
+                + hdr->value_bytes
+                + entry_header::padding_bytes(hdr->value_bytes));
+
+            // the block ended (in padding, which reads as an entry with no key or tag), after which the next block
+            // may hold (more) versions of our key
+            size_t const offset = reinterpret_cast<std::byte const *>(hdr) - block_base;
+            if (offset + sizeof(entry_header) > entries_end || (hdr->prefix_bytes == 0 && hdr->suffix_bytes == 0 && hdr->tag == 0)) { return false; }
+
+            // the section ended at the next index key, past our key. Older versions of our key may still be index keys:
+            // those of the empty key, which shares no prefix, and those in files written before they were compressed.
+            if (hdr->prefix_bytes == 0 && std::string_view{reinterpret_cast<char const *>(hdr + 1), hdr->suffix_bytes} != key) { return true; }
+        }
     }
 
-private:
+    static table::value_type type_of(uint64_t tag) { return static_cast<table::value_type>(tag & 0xFF); }
+    static sequence_t sequence_of(uint64_t tag) { return tag >> 8; }
+    static uint64_t tag_from(table::value_type type, sequence_t sequence) { return (sequence << 8) | static_cast<uint64_t>(type); }
+
     std::chrono::steady_clock::time_point t;
     std::filesystem::path path;
     config_options config;
+    size_t bytes{};
+    std::string first_key{};
+    std::string last_key{};
+    range_tombstones ranges{};
+    sequence_t max_sequence{};
+    mutable std::atomic_bool obsolete{};
 
     struct entry_header
     {
         uint32_t prefix_bytes{};
         uint32_t suffix_bytes{};
         uint64_t value_bytes{};
+        uint64_t tag{};
         static size_t constexpr padding_bytes(size_t data_size) { return sizeof(uint64_t) - (data_size % sizeof(uint64_t)); }
     };
 
+    struct range_header
+    {
+        uint64_t begin_bytes{};
+        uint64_t end_bytes{};
+        uint64_t sequence{};
+    };
+
     struct footer
     {
-        static uint64_t constexpr MAGIC_NUMBER = 0x677265676F727968;
+        // identifies the file as an sst file whose footer carries its format version. Fixed across versions.
+        static uint64_t constexpr MAGIC_NUMBER = 0x677265676F72796B;
+        static uint64_t constexpr FORMAT_VERSION = 2;
         uint64_t block_size{};
         uint64_t block_count{};
         uint64_t entry_count{};
         uint64_t key_bytes{};
         uint64_t value_bytes{};
+        uint64_t range_count{};
+        uint64_t largest_sequence{};
+        uint64_t format_version{FORMAT_VERSION};
         uint64_t magic{MAGIC_NUMBER};
     };
 
+    // the footer and entry header of format 1 files, which carry no version (see "upgrade")
+    struct legacy_footer
+    {
+        static uint64_t constexpr MAGIC_NUMBER = 0x677265676F727968;
+        uint64_t block_size{};
+        uint64_t block_count{};
+        uint64_t entry_count{};
+        uint64_t key_bytes{};
+        uint64_t value_bytes{};
+        uint64_t magic{};
+    };
+
+    struct legacy_entry_header
+    {
+        uint32_t prefix_bytes{};
+        uint32_t suffix_bytes{};
+        uint64_t value_bytes{};
+    };
+
+    // widens the key range of the file to include its deleted ranges. "has_entries" is false if the file only deletes ranges.
+    void extend_key_range(bool has_entries)
+    {
+        if (this->ranges.empty()) { return; }
+
+        std::string_view const begin = this->ranges.smallest();
+        std::string_view const end = this->ranges.largest();
+        if (!has_entries || begin < this->first_key) { this->first_key = begin; }
+        if (!has_entries || this->last_key < end) { this->last_key = end; }
+    }
+
     static std::chrono::steady_clock::time_point t_from(std::filesystem::path const & sstfile)
     {
         assert(std::filesystem::exists(sstfile));
@@ -322,7 +527,7 @@ private:
         return std::chrono::steady_clock::time_point{std::chrono::nanoseconds{steady_ns}};
     }
 
-    static config_options config_from(std::filesystem::path const & sstfile)
+    static footer footer_from(std::filesystem::path const & sstfile)
     {
         assert(std::filesystem::exists(sstfile));
         assert(std::filesystem::is_regular_file(sstfile));
@@ -334,16 +539,60 @@ private:
         size_t const file_size = f.tellg();
         f.seekg(file_size-sizeof(ftr), std::ios::beg);
 
-        f >> ftr.block_size >> ftr.block_count >> ftr.entry_count >> ftr.key_bytes >> ftr.value_bytes >> ftr.magic;
-        assert(ftr.magic == footer::MAGIC_NUMBER);
+        f.read(reinterpret_cast<char *>(&ftr), sizeof(ftr));
+        if (!f.good() || ftr.magic != footer::MAGIC_NUMBER || ftr.format_version != footer::FORMAT_VERSION)
+        {
+            unreadable(sstfile, "not an sst file of the current format");
+        }
 
+        return ftr;
+    }
+
+    // The store cannot serve reads without its files, and does not throw, so a file it cannot read ends the process,
+    // naming the file, rather than reading it wrongly
+    [[noreturn]] static void unreadable(std::filesystem::path const & sstfile, char const * why)
+    {
+        std::fprintf(stderr, "kvstore: cannot read sst file %s: %s\n", sstfile.c_str(), why);
+        std::abort();
+    }
+
+    static config_options config_from(std::filesystem::path const & sstfile)
+    {
+        footer const ftr{footer_from(sstfile)};
         return config_options{.max_block_size=ftr.block_size,.base_dir=sstfile.parent_path()};
     }
 
-    // generates the header for the entry corresponding to a given node
-    static entry_header header_from(std::string_view & prefix, memtable::skiptable::node const * n)
+    // reads the range tombstones, which follow the data blocks
+    static range_tombstones ranges_from(std::filesystem::path const & sstfile, footer const & ftr)
+    {
+        if (ftr.range_count == 0) { return {}; }
+
+        std::ifstream f{sstfile, std::ios::binary};
+        f.seekg(ftr.block_count * ftr.block_size, std::ios::beg);
+
+        auto const read_key = [&f](size_t size) {
+            std::string key(size + entry_header::padding_bytes(size), '\0');
+            f.read(key.data(), key.size());
+            key.resize(size);
+            return key;
+        };
+
+        std::vector<range_tombstones::range> ranges{};
+        for (uint64_t i = 0; i < ftr.range_count; i++)
+        {
+            range_header hdr{};
+            f.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+            std::string begin = read_key(hdr.begin_bytes);
+            ranges.emplace_back(range_tombstones::range{.begin = std::move(begin), .end = read_key(hdr.end_bytes), .sequence = hdr.sequence});
+        }
+
+        assert(f.good());
+        return range_tombstones(std::move(ranges));
+    }
+
+    // generates the header for the entry with the given key and value size
+    static entry_header header_from(std::string & prefix, std::string_view key, size_t value_bytes, uint64_t tag)
     {
-        std::string_view key{n->key};
         entry_header hdr{};
         if (prefix.empty()) { prefix = key; }
         else
@@ -355,10 +604,358 @@ private:
         }
 
         hdr.suffix_bytes = key.length() - hdr.prefix_bytes;
-        hdr.value_bytes = n->value()->size;
+        hdr.value_bytes = value_bytes;
+        hdr.tag = tag;
 
         return hdr;
     }
+
+    // writes "count" zero bytes, for block padding. Written in chunks, as a block may be almost entirely padding.
+    static void write_zeros(std::ofstream & of, size_t count)
+    {
+        static char const zeros[4_KiB]{};
+        for (; count > sizeof(zeros); count -= sizeof(zeros)) { of.write(zeros, sizeof(zeros)); }
+        of.write(zeros, count);
+    }
+
+public:
+    // Writes entries, added in key order, to the file of an sstable being built.
+    // This uses platform-agnostic c++ streams for portability, as writing sequentially should still be "fast"
+    // (compared to platform-specific file operations).
+    // If set, "throttle" is called with the size of each block before it is written, so the caller may limit the write rate.
+    struct writer
+    {
+        explicit writer(sstable & file, std::function<void(size_t)> throttle = {}) :
+            file(file), of(file.path, std::ios::binary), throttle(std::move(throttle))
+        {
+            assert(this->of.good());
+        }
+
+        writer(writer&&) = delete;
+        writer(writer const &) = delete;
+        writer& operator=(writer&&) = delete;
+        writer& operator=(writer const&) = delete;
+
+        // Versions of the same key are added in order of descending sequence
+        void add(std::string_view key, void const * data, size_t size,
+                 table::value_type type = table::value_type::value, sequence_t sequence = 0)
+        {
+            if (this->entries == 0) { this->file.first_key = key; }
+            this->file.last_key = key;
+            this->file.max_sequence = std::max(this->file.max_sequence, sequence);
+
+            this->key_bytes += key.size();
+            this->data_bytes += size;
+            this->entries += 1;
+
+            uint64_t const tag = tag_from(type, sequence);
+            entry_header hdr{header_from(this->prefix, key, size, tag)};
+            auto const entry_bytes = [&] {
+                return sizeof(entry_header)
+                    + hdr.suffix_bytes
+                    + entry_header::padding_bytes(hdr.suffix_bytes)
+                    + size
+                    + entry_header::padding_bytes(size);
+            };
+
+            // Each time a key doesn't match a prefix, we denote it an index key
+            bool const idx_key = hdr.prefix_bytes == 0;
+
+            // If we need a new block, write the block footer and update counters
+            if (this->block_bytes > (this->file.config.max_block_size
+                                - entry_bytes() // total bytes for this entry
+                                - (idx_key * sizeof(uint64_t)) // index_offset for this entry
+                                - (this->idx_offsets.size() * sizeof(uint64_t)) // previous index_offsets
+                                - sizeof(uint64_t))) // final "index_count" uint64
+            {
+                this->finish_block();
+
+                // the first key of a block is always an index key
+                this->prefix.clear();
+                hdr = header_from(this->prefix, key, size, tag);
+            }
+
+            // write the entry data. Following keys are compressed against the index key, as readers decode them,
+            // so the older versions of a key are never index keys, unless they start a block.
+            if (hdr.prefix_bytes == 0)
+            {
+                this->idx_offsets.emplace_back(this->block_bytes);
+                this->prefix = key;
+            }
+
+            this->of.write(reinterpret_cast<char const *>(&hdr), sizeof(hdr)); // hdr
+            this->of << key.substr(hdr.prefix_bytes, hdr.suffix_bytes); // key suffix (entire key in case of idx key)
+            write_zeros(this->of, entry_header::padding_bytes(hdr.suffix_bytes)); // suffix padding
+            this->of.write(reinterpret_cast<char const *>(data), size); // value
+            write_zeros(this->of, entry_header::padding_bytes(size)); // value padding
+            this->block_bytes += entry_bytes();
+        }
+
+        // the bytes written so far, counting the current block as full
+        size_t bytes() const { return (this->blocks + 1) * this->file.config.max_block_size; }
+
+        // writes the final block footer, the ranges deleted by the file, and the file footer.
+        // A file must hold at least one entry or range.
+        void finish(range_tombstones ranges = {})
+        {
+            assert(this->entries > 0 || !ranges.empty());
+            if (this->entries > 0) { this->finish_block(); }
+
+            size_t range_bytes{};
+            for (range_tombstones::range const & r : ranges.ranges())
+            {
+                range_header const hdr{.begin_bytes = r.begin.size(), .end_bytes = r.end.size(), .sequence = r.sequence};
+                this->file.max_sequence = std::max(this->file.max_sequence, r.sequence);
+                this->of.write(reinterpret_cast<char const *>(&hdr), sizeof(hdr));
+                for (std::string const & key : {std::cref(r.begin), std::cref(r.end)})
+                {
+                    this->of.write(key.data(), key.size());
+                    write_zeros(this->of, entry_header::padding_bytes(key.size()));
+                    range_bytes += key.size() + entry_header::padding_bytes(key.size());
+                }
+
+                range_bytes += sizeof(hdr);
+            }
+
+            footer const ftr{
+                .block_size = this->file.config.max_block_size,
+                .block_count = this->blocks,
+                .entry_count = this->entries,
+                .key_bytes = this->key_bytes,
+                .value_bytes = this->data_bytes,
+                .range_count = ranges.ranges().size(),
+                .largest_sequence = this->file.max_sequence,
+                .magic{footer::MAGIC_NUMBER}
+            };
+
+            this->of.write(reinterpret_cast<char const *>(&ftr), sizeof(ftr));
+            this->of.flush();
+            this->of.close();
+
+            // synced before the file is installed, as the WAL holding its data is removed once it is
+            sync_file(this->file.path);
+            this->file.bytes = this->blocks * ftr.block_size + range_bytes + sizeof(ftr);
+            this->file.ranges = std::move(ranges);
+            this->file.extend_key_range(this->entries > 0);
+        }
+
+    private:
+        // pads the current block, and writes its footer
+        void finish_block()
+        {
+            if (this->throttle) { this->throttle(this->file.config.max_block_size); }
+
+            uint64_t const idx_count = this->idx_offsets.size();
+            size_t const footer_bytes = sizeof(uint64_t) * (idx_count + 1);
+            write_zeros(this->of, this->file.config.max_block_size - footer_bytes - this->block_bytes);
+            this->of.write(reinterpret_cast<char const *>(this->idx_offsets.data()), idx_count * sizeof(uint64_t));
+            this->of.write(reinterpret_cast<char const *>(&idx_count), sizeof(idx_count));
+
+            this->blocks += 1;
+            this->block_bytes = 0;
+            this->idx_offsets.clear();
+        }
+
+        sstable & file;
+        std::ofstream of;
+        std::function<void(size_t)> const throttle;
+        size_t blocks{};
+        size_t key_bytes{};
+        size_t data_bytes{};
+        size_t entries{};
+        // the last index key, that following keys are prefix-compressed against
+        std::string prefix{};
+        size_t block_bytes{};
+        std::vector<uint64_t> idx_offsets{};
+    };
+
+    // Reads the entries of a file in key order, forwards or backwards. The file is mapped for the lifetime of the cursor.
+    struct cursor
+    {
+        explicit cursor(sstable const & file, size_t first_block = 0) : size(std::filesystem::file_size(file.path))
+        {
+            int fd = open(file.path.c_str(), O_RDONLY);
+            assert(fd != -1);
+            this->base = reinterpret_cast<std::byte const *>(mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0));
+            assert(this->base != MAP_FAILED);
+            close(fd);
+
+            this->ftr = reinterpret_cast<footer const *>(this->base + this->size - sizeof(footer));
+            assert(this->ftr->magic == footer::MAGIC_NUMBER);
+
+            this->block = first_block;
+            this->load();
+        }
+
+        ~cursor() { munmap(const_cast<std::byte *>(this->base), this->size); }
+
+        cursor(cursor&&) = delete;
+        cursor(cursor const &) = delete;
+        cursor& operator=(cursor&&) = delete;
+        cursor& operator=(cursor const&) = delete;
+
+        // false once the cursor has moved past the last entry
+        bool valid() const { return this->block < this->ftr->block_count; }
+
+        std::string_view key() const { return this->current_key; }
+
+        std::byte const * value() const
+        {
+            return reinterpret_cast<std::byte const *>(this->hdr + 1) + this->hdr->suffix_bytes + entry_header::padding_bytes(this->hdr->suffix_bytes);
+        }
+
+        size_t value_size() const { return this->hdr->value_bytes; }
+
+        table::value_type type() const { return type_of(this->hdr->tag); }
+        sequence_t sequence() const { return sequence_of(this->hdr->tag); }
+
+        void next()
+        {
+            this->offset += entry_bytes(this->hdr);
+            this->load();
+        }
+
+        // Moves to the first entry with a key not less than "key", or past the last entry if there is none
+        void seek(std::string_view key)
+        {
+            // the first entry not less than the key follows the last entry before it, which is in the last block
+            // whose first key sorts before the key - or the key is in the first block
+            size_t lo{};
+            size_t hi = this->ftr->block_count;
+            while (lo < hi)
+            {
+                size_t const mid = lo + (hi - lo) / 2;
+                if (this->first_key(mid) < key) { lo = mid + 1; }
+                else { hi = mid; }
+            }
+
+            this->block = lo == 0 ? 0 : lo - 1;
+            this->offset = 0;
+            if (this->valid())
+            {
+                // skip the sections of the block whose index key, and so every key, sorts before the key
+                std::span<uint64_t const> const indices = this->indices(this->block);
+                auto it = std::lower_bound(indices.begin(), indices.end(), key, [this](uint64_t idx_offset, std::string_view k) {
+                    return this->index_key(this->block, idx_offset) < k;
+                });
+
+                if (it != indices.begin()) { this->offset = *(it - 1); }
+            }
+
+            this->load();
+            while (this->valid() && this->key() < key) { this->next(); }
+        }
+
+        // Moves to the entry before the current one, or to the last entry if past it.
+        // Returns false, without moving, if there is no such entry.
+        // The entry offsets of a block are collected as the cursor first moves back through it,
+        // so that each step back is a binary search, rather than a walk from the start of the block.
+        bool prev()
+        {
+            size_t b = this->valid() ? this->block : this->ftr->block_count;
+            size_t off = this->valid() ? this->offset : 0;
+            if (off == 0)
+            {
+                if (b == 0) { return false; }
+                b -= 1;
+                off = this->ftr->block_size;
+            }
+
+            if (this->offsets_block != b)
+            {
+                this->offsets.clear();
+                for (size_t o = 0; this->entry_at(b, o); o += entry_bytes(this->header(b, o))) { this->offsets.emplace_back(o); }
+                this->offsets_block = b;
+            }
+
+            // every block holds an entry at its start, so an earlier entry is always found
+            auto it = std::lower_bound(this->offsets.begin(), this->offsets.end(), off);
+            assert(it != this->offsets.begin());
+            size_t const entry_offset = *(it - 1);
+
+            // a compressed key shares its prefix with the index key of its section
+            std::span<uint64_t const> const indices = this->indices(b);
+            uint64_t const idx_offset = *(std::upper_bound(indices.begin(), indices.end(), entry_offset) - 1);
+            this->current_key = this->index_key(b, idx_offset);
+
+            this->block = b;
+            this->offset = entry_offset;
+            this->load();
+            return true;
+        }
+
+    private:
+        // reads the entry at the current offset, moving on to the next block once past the last entry of a block
+        void load()
+        {
+            for (; this->block < this->ftr->block_count; this->block++, this->offset = 0)
+            {
+                if (!this->entry_at(this->block, this->offset)) { continue; }
+                this->hdr = this->header(this->block, this->offset);
+
+                // a compressed key shares its prefix with the previous key, as well as with its index key
+                this->current_key.resize(this->hdr->prefix_bytes);
+                this->current_key.append(reinterpret_cast<char const *>(this->hdr + 1), this->hdr->suffix_bytes);
+                return;
+            }
+        }
+
+        std::byte const * block_base(size_t b) const { return this->base + b * this->ftr->block_size; }
+
+        entry_header const * header(size_t b, size_t off) const { return reinterpret_cast<entry_header const *>(this->block_base(b) + off); }
+
+        // the block-relative offsets of the index keys of block "b", in ascending order
+        std::span<uint64_t const> indices(size_t b) const
+        {
+            std::byte const * end = this->block_base(b) + this->ftr->block_size - sizeof(uint64_t);
+            uint64_t const idx_count = *reinterpret_cast<uint64_t const *>(end);
+            return {reinterpret_cast<uint64_t const *>(end) - idx_count, idx_count};
+        }
+
+        std::string_view index_key(size_t b, uint64_t idx_offset) const
+        {
+            entry_header const * h = this->header(b, idx_offset);
+            return {reinterpret_cast<char const *>(h + 1), h->suffix_bytes};
+        }
+
+        // the first key of a block is always an index key
+        std::string_view first_key(size_t b) const { return this->index_key(b, 0); }
+
+        // true if an entry starts at "off" in block "b".
+        // Blocks end in zero padding, which reads as an entry with an empty key, no shared prefix and a zero tag:
+        // as keys are sorted, only the first key of a block may be empty, unless the empty key has several versions,
+        // which have sequences.
+        bool entry_at(size_t b, size_t off) const
+        {
+            size_t const entries_end = this->ftr->block_size - sizeof(uint64_t) * (this->indices(b).size() + 1);
+            if (off + sizeof(entry_header) > entries_end) { return false; }
+
+            entry_header const * h = this->header(b, off);
+            return off == 0 || h->prefix_bytes != 0 || h->suffix_bytes != 0 || h->tag != 0;
+        }
+
+        // the size of the entry with header "h", including padding
+        static size_t entry_bytes(entry_header const * h)
+        {
+            return sizeof(entry_header)
+                + h->suffix_bytes
+                + entry_header::padding_bytes(h->suffix_bytes)
+                + h->value_bytes
+                + entry_header::padding_bytes(h->value_bytes);
+        }
+
+        size_t const size;
+        std::byte const * base{};
+        footer const * ftr{};
+        size_t block{};
+        size_t offset{};
+        entry_header const * hdr{};
+        std::string current_key{};
+
+        // the offsets of the entries of block "offsets_block", collected by "prev"
+        std::vector<size_t> offsets{};
+        size_t offsets_block{SIZE_MAX};
+    };
 };
 
 };
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <ns.h>
+#include <cassert>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace KVSTORE_NS
+{
+// Flushes a written file's data to the device, so that it survives a crash of the machine, not just of the process
+inline void sync_file(std::filesystem::path const & path)
+{
+    int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    assert(fd >= 0);
+    [[maybe_unused]] int const synced = ::fsync(fd);
+    assert(synced == 0);
+    ::close(fd);
+}
+
+// Flushes a directory's entries to the device, making the files created, renamed or removed in it durable
+inline void sync_directory(std::filesystem::path const & dir)
+{
+    int const fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    assert(fd >= 0);
+    [[maybe_unused]] int const synced = ::fsync(fd);
+    assert(synced == 0);
+    ::close(fd);
+}
+
+} // namespace KVSTORE_NS
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <ns.h>
+#include <sstable.h>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <optional>
+#include <unordered_map>
+
+namespace KVSTORE_NS::sst
+{
+// An immutable list of the sst files in a store, arranged in levels.
+// Level 0 holds flushed files, newest first, whose key ranges may overlap.
+// Deeper levels are written by compaction (see compaction.h), and hold files with disjoint key ranges, sorted by key,
+// so a lookup reads every level 0 file, but at most one file of each deeper level.
+//
+// Flushes (and compactions) never modify a version, but build a new one and install it in place of the current one,
+// so readers need no lock: they read whichever version is current, and it stays valid for as long as they hold it
+// (see kvstore, which frees replaced versions through epoch-based reclamation).
+// Files are shared between successive versions by reference count, so building a version copies no file state.
+struct version
+{
+    using file_ptr = std::shared_ptr<sstable const>;
+    using level = std::vector<file_ptr>;
+
+    // the file recording the level of each sst file, in the sst directory
+    inline static std::string const MANIFEST{"MANIFEST"};
+
+    version() : levels(1) {}
+    explicit version(std::vector<level> && levels) : levels(std::move(levels)), newest(newest_in(this->levels)) {}
+
+    version(version&&) = delete;
+    version(version const &) = delete;
+    version& operator=(version&&) = delete;
+    version& operator=(version const&) = delete;
+
+    // builds the version for existing files, in any order, all in level 0
+    static version * from(std::vector<file_ptr> files)
+    {
+        std::sort(files.begin(), files.end(), [](file_ptr const & l, file_ptr const & r) { return *r < *l; });
+        std::vector<level> levels{};
+        levels.emplace_back(std::move(files));
+        return new version(std::move(levels));
+    }
+
+    // Rebuilds the version saved in "dir" by "save".
+    // Files in the directory but missing from the manifest were written by a flush or compaction that was
+    // interrupted before it was installed: their data is still in the WAL, or in the compaction's inputs, so they are removed.
+    // Without a manifest, the files were written before compaction, and are all placed in level 0.
+    // Files of an older format are rewritten in the current one as they are loaded (see "sstable::upgrade").
+    static version * load(std::filesystem::path const & dir)
+    {
+        std::unordered_map<std::string, std::filesystem::path> found{};
+        for (auto const & item : std::filesystem::directory_iterator(dir))
+        {
+            if (item.path().extension() == sstable::FILE_EXT && std::filesystem::is_regular_file(item))
+            {
+                found.emplace(item.path().filename().string(), item.path());
+            }
+        }
+
+        std::ifstream manifest{dir / MANIFEST};
+        if (!manifest.good())
+        {
+            std::vector<file_ptr> files{};
+            for (auto const & [name, path] : found)
+            {
+                // a file without a footer was torn by a crash during the store's first flush, whose writes are still in the WAL
+                if (sstable::format_of(path) == 0)
+                {
+                    std::filesystem::remove(path);
+                    continue;
+                }
+
+                sstable::upgrade(path);
+                files.emplace_back(std::make_shared<sstable const>(path));
+            }
+            return from(std::move(files));
+        }
+
+        std::vector<level> levels(1);
+        size_t n{};
+        std::string name{};
+        while (manifest >> n >> name)
+        {
+            auto it = found.find(name);
+            if (it == found.end()) { continue; }
+
+            if (levels.size() <= n) { levels.resize(n + 1); }
+            sstable::upgrade(it->second);
+            levels[n].emplace_back(std::make_shared<sstable const>(it->second));
+            found.erase(it);
+        }
+
+        for (auto const & [name, path] : found) { std::filesystem::remove(path); }
+        return new version(std::move(levels));
+    }
+
+    // Records the level of each file in "dir", replacing the previous manifest atomically.
+    // The manifest, and the directory entries of the files it lists, are synced before this returns, as "load" removes
+    // the files a manifest does not list.
+    void save(std::filesystem::path const & dir) const
+    {
+        std::filesystem::path const tmp = dir / (MANIFEST + ".tmp");
+        {
+            std::ofstream of{tmp, std::ios::trunc};
+            for (size_t n = 0; n < this->levels.size(); n++)
+            {
+                for (file_ptr const & file : this->levels[n]) { of << n << ' ' << file->file_path().filename().string() << '\n'; }
+            }
+        }
+
+        sync_file(tmp);
+        std::filesystem::rename(tmp, dir / MANIFEST);
+        sync_directory(dir);
+    }
+
+    // returns a new version, with "file" added as the newest in level 0
+    version * with(file_ptr file) const
+    {
+        std::vector<level> next{this->levels};
+        next[0].insert(next[0].begin(), std::move(file));
+        return new version(std::move(next));
+    }
+
+    // returns a new version, with the "removed" files replaced by the "added" files in level "n".
+    // The added files must not overlap the files remaining in the level, unless "n" is 0,
+    // where they take the place of the first file removed from level 0 (or are the oldest, if none is).
+    version * apply(std::vector<file_ptr> const & removed, size_t n, std::vector<file_ptr> const & added) const
+    {
+        std::vector<level> next(std::max(this->levels.size(), n + 1));
+        std::optional<size_t> replaced{};
+        for (size_t l = 0; l < this->levels.size(); l++)
+        {
+            for (file_ptr const & file : this->levels[l])
+            {
+                if (std::find(removed.begin(), removed.end(), file) == removed.end()) { next[l].emplace_back(file); }
+                else if (l == 0 && !replaced) { replaced = next[0].size(); }
+            }
+        }
+
+        next[n].insert(n == 0 && replaced ? next[0].begin() + *replaced : next[n].end(), added.begin(), added.end());
+        if (n > 0)
+        {
+            std::sort(next[n].begin(), next[n].end(), [](file_ptr const & l, file_ptr const & r) { return l->smallest() < r->smallest(); });
+        }
+
+        return new version(std::move(next));
+    }
+
+    // the files of level "n" which may hold keys in the range [lo, hi]
+    std::vector<file_ptr> overlapping(size_t n, std::string_view lo, std::string_view hi) const
+    {
+        std::vector<file_ptr> files{};
+        if (n >= this->levels.size()) { return files; }
+
+        for (file_ptr const & file : this->levels[n]) { if (file->overlaps(lo, hi)) { files.emplace_back(file); } }
+        return files;
+    }
+
+    // the total size of the files in level "n"
+    size_t level_bytes(size_t n) const
+    {
+        size_t bytes{};
+        if (n < this->levels.size()) { for (file_ptr const & file : this->levels[n]) { bytes += file->file_size(); } }
+        return bytes;
+    }
+
+    // the highest sequence written to any file
+    sequence_t largest_sequence() const { return this->newest; }
+
+    // Searches the levels in order, and level 0 from newest to oldest, so the most recent value for the key is found.
+    // The search stops at the first file holding a version of the key visible at "snapshot", or deleting it.
+    lookup get(std::string_view key, std::vector<std::byte> & data_out, sequence_t snapshot = MAX_SEQUENCE) const
+    {
+        std::span<std::byte const> value{};
+        std::shared_ptr<void const> mapping{};
+        lookup const found = this->get(key, value, mapping, snapshot);
+        return copy(found, value, data_out);
+    }
+
+    // As above, referencing the value in place in the file that holds it, kept mapped by "mapping" (see "sstable::get")
+    lookup get(std::string_view key, std::span<std::byte const> & value_out, std::shared_ptr<void const> & mapping,
+               sequence_t snapshot = MAX_SEQUENCE) const
+    {
+        for (file_ptr const & file : this->levels[0])
+        {
+            if (lookup const found = file->get(key, value_out, mapping, snapshot); found != lookup::missing) { return found; }
+        }
+
+        for (size_t n = 1; n < this->levels.size(); n++)
+        {
+            // the files of the level which may hold the key start at the first whose range ends at or after it.
+            // A range deletion may end at the key the next file starts with, so that file may hold the key too.
+            level const & files = this->levels[n];
+            auto it = std::lower_bound(files.begin(), files.end(), key,
+                [](file_ptr const & file, std::string_view k) { return file->largest() < k; });
+            for (; it != files.end() && (*it)->smallest() <= key; it++)
+            {
+                if (lookup const found = (*it)->get(key, value_out, mapping, snapshot); found != lookup::missing) { return found; }
+            }
+        }
+
+        return lookup::missing;
+    }
+
+    std::vector<level> const levels{};
+
+private:
+    static sequence_t newest_in(std::vector<level> const & levels)
+    {
+        sequence_t sequence{};
+        for (level const & files : levels)
+        {
+            for (file_ptr const & file : files) { sequence = std::max(sequence, file->largest_sequence()); }
+        }
+
+        return sequence;
+    }
+
+    // "largest_sequence", computed once, as the row cache checks it on every fill
+    sequence_t const newest{};
+};
+
+} // namespace KVSTORE_NS::sst
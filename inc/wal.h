@@ -3,16 +3,71 @@
 #include <ns.h>
 #include <filesystem>
 #include <memtable.h>
+#include <write_batch.h>
 #include <fstream>
-#include <unordered_set>
+#include <unordered_map>
 #include <atomic>
 #include <shared_mutex>
 #include <algorithm>
+#include <iterator>
+#include <functional>
+#include <deque>
+#include <cstring>
+#include <crc32c.h>
+#include <literals.h>
+#include <sync_file.h>
+#include <span>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 using namespace std::literals::chrono_literals;
+using namespace KVSTORE_NS::literals;
+
+/********************************************************************************
+ * Log Format
+ *
+ * This format follows the LevelDB and RocksDB log format.
+ * https://github.com/google/leveldb/blob/main/doc/log_format.md
+ *
+ * The log is a sequence of 32 KiB blocks. Each record is written as one or more fragments, split so that none crosses a block,
+ * letting recovery resume at the next block after a corrupt fragment. A block's trailer too small for a fragment header is zero-filled.
+ * Fragment
+ *  crc: uint32 - the masked crc32c of the type and data
+ *  length: uint16 - the size of the data
+ *  type: uint8 - FULL (1), or FIRST (2), MIDDLE (3) and LAST (4) for the parts of a record split across blocks
+ *  data: byte[length]
+ * Record - the data of its fragments, concatenated. Its writes are recovered all together, or not at all.
+ *  Write 0
+ *   type: uint8 - a value 'v', a deletion 'd', the deletion of a range 'r', or the name of a family 'f'
+ *   family: uint32 - the id of the column family written
+ *   sequence: uint64 - the sequence of the write. 0 for a family name.
+ *   key_bytes: uint32 - the size of the key, the first key of a range or the family name
+ *   value_bytes: uint32 - the size of the value, or of the key a range ends before
+ *   key: byte[key_bytes]
+ *   value: byte[value_bytes]
+ *  ...
+ *  Write N - a record holds several writes only if they were logged as a batch
+ */
 
 namespace KVSTORE_NS::WAL
 {
+// How far a write is persisted before the call logging it returns
+enum class durability
+{
+    // queued, to be written by the next write to commit, or the next periodic sync. Lost if the process crashes before then.
+    none,
+    // written to the file, so it survives a crash of the process, but not of the machine
+    buffered,
+    // written and synced to the device with "fdatasync"
+    sync,
+};
+
 // Implements write-ahead-logging, enabling recovery of in-memory data upon abnormal process crash
 struct walfile
 {
@@ -26,6 +81,13 @@ struct walfile
 
         // The directory where the logfile will be created
         std::filesystem::path base_dir{"."};
+
+        // the durability of writes logged without one of their own
+        durability default_durability{durability::none};
+
+        // If set, the store's background thread syncs the log at this period, bounding the writes lost when the machine crashes
+        // without each write paying for a sync. The period is checked as the background thread wakes, so it may run over slightly.
+        std::chrono::milliseconds sync_period{0};
     };
 
     config_options const config;
@@ -33,13 +95,20 @@ struct walfile
 
     walfile(config_options const & opts) :
         config(opts),
-        logfile(opts.base_dir / (std::to_string(std::chrono::steady_clock::now().time_since_epoch() / 1ms) + FILE_EXT)),
-        putq(opts.concurrent_put_limit)
+        logfile(opts.base_dir / (std::to_string(std::chrono::steady_clock::now().time_since_epoch() / 1ns) + FILE_EXT)),
+        putq(opts.concurrent_put_limit),
+        // held open for the life of the log, so that writing a group of records costs a single call
+        fd(::open(this->logfile.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644))
     {
+        assert(this->fd >= 0);
+
+        // the file's entry is synced, so that a sync of its data is enough to make a write durable
+        sync_directory(opts.base_dir);
     }
 
     ~walfile()
     {
+        ::close(this->fd);
         std::filesystem::remove(this->logfile);
     }
 
@@ -48,90 +117,462 @@ struct walfile
     walfile & operator==(walfile const &) = delete;
     walfile & operator==(walfile&&) = delete;
 
-    // Log a "put" operation to the WAL (represented by the node inserted into the memtable)
+    // Records the name of the column family logged as "family", so that recovery finds its table by name.
+    // Every family is named in a log before any of its writes.
+    void name_family(uint32_t family, std::string_view name)
+    {
+        std::string record{};
+        append_write(record, FAMILY, family, 0, name, {});
+        this->commit(this->enqueue(std::move(record)), durability::none);
+    }
+
+    // Log a "put" or "remove" operation to the WAL, written at "sequence" to the column family "family"
     // concurrent "log" calls are safe, as only 1 concurrent thread will write actual data to the logfile
-    void log(memtable::skiptable::node const * node)
+    // The entry is serialized here, from the caller's own data, so the log never reads a memtable that may be flushed and freed
+    // before the queue is drained.
+    // The call returns once the write is persisted as "d" requires (see "durability"), or "default_durability" if "d" is not set.
+    void log(memtable::table::value_type type, uint32_t family, sequence_t sequence, std::string_view key, std::string_view value = {},
+             std::optional<durability> d = {})
     {
-log_retry:
-        // first, take the shared_mutex in "shared mode" and write to the queue
-        // the atomicity of the write-head ensures valid ordering
-        // If the queue is full we loop (releasing the mutex) as eventually a concurrent thread will drain the queue
-        // in practice this may occassionally cause significant latency on log operations, so a retry limit might be practical
-        this->q_mutex.lock_shared();
+        std::string record{};
+        append_write(record, type == memtable::table::value_type::deletion ? DELETION : VALUE, family, sequence, key, value);
+        this->commit(this->enqueue(std::move(record)), d.value_or(this->config.default_durability));
+    }
 
-        size_t w = this->write;
-        size_t const next = (w + 1) % this->config.concurrent_put_limit;
+    // Log a "remove_range" operation to the WAL
+    void log_range(uint32_t family, sequence_t sequence, std::string_view begin, std::string_view end, std::optional<durability> d = {})
+    {
+        std::string record{};
+        append_write(record, RANGE_DELETION, family, sequence, begin, end);
+        this->commit(this->enqueue(std::move(record)), d.value_or(this->config.default_durability));
+    }
 
-        if (next == this->read || !this->write.compare_exchange_weak(w, next)) { goto log_retry; }
-        else { this->putq.at(w) = node; }
+    // Log the writes of a batch as a single record, so that recovery applies all of them or none.
+    // The writes are sequenced from "first", in the order they were added to the batch.
+    void log_batch(sequence_t first, write_batch const & batch, std::optional<durability> d = {})
+    {
+        std::string record{};
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            write_batch::entry const e = batch[i];
+            append_write(record, e.type == memtable::table::value_type::deletion ? DELETION : VALUE, e.family, first + i, e.key, e.value);
+        }
 
-        this->q_mutex.unlock_shared();
+        this->commit(this->enqueue(std::move(record)), d.value_or(this->config.default_durability));
+    }
 
-        // now try to take the lock exclusively, to drain the queue into the file
-        // if we fail, another concurrent thread is doing the same job, so simply exit
-        if (this->q_mutex.try_lock())
+    // Writes and syncs every write logged so far. Called periodically by the store (see "sync_period").
+    void sync()
+    {
+        this->commit(this->write.load(), durability::sync);
+    }
+
+    // Load existing logfiles into the memtables of the column families, returning the highest sequence logged.
+    // The logs are read together, in any order, as the writes in each are ordered by their sequences.
+    // "table_of" returns the memtable of a family, by name, or nullptr if the store no longer has the family,
+    // whose writes are then dropped. It is called again for a family whenever the table it returned fills, and must then return
+    // an empty one, as a log may hold more writes than a table (such as those of a large batch, or of several tables not yet flushed).
+    // Only the most recent version of each key is inserted, along with every range deletion,
+    // which hides the versions with lower sequences as it did when the log was written.
+    // Fragments failing their crc, such as those torn by a crash, are skipped (see "read_blocks").
+    static sequence_t load(std::span<std::filesystem::path const> logfiles, std::function<memtable::table *(std::string_view)> const & table_of)
+    {
+        struct item
         {
-            std::ofstream file{this->logfile, std::ios::app};
+            char type{};
+            sequence_t sequence{};
+            // the name of the column family written, as named in the write's log
+            std::string_view family{};
+            std::string_view key{};
+            std::string_view value{};
+        };
+
+        // the contents of the logs, and the records split across blocks, reassembled.
+        // Deque elements stay in place, so the items may view them.
+        std::deque<std::string> contents{};
+        std::deque<std::string> joined{};
+        std::vector<item> items{};
+
+        // the families named in the log being read, by id
+        std::unordered_map<uint32_t, std::string_view> names{};
+        auto const apply = [&](std::string_view record) {
+            std::vector<std::pair<uint32_t, item>> writes{};
+            while (!record.empty())
+            {
+                item i{};
+                uint32_t family{};
+                uint32_t key_bytes{};
+                uint32_t value_bytes{};
+                if (record.size() < WRITE_HEADER_BYTES) { return; }
+                i.type = record[0];
+                memcpy(&family, record.data() + 1, sizeof(family));
+                memcpy(&i.sequence, record.data() + 5, sizeof(i.sequence));
+                memcpy(&key_bytes, record.data() + 13, sizeof(key_bytes));
+                memcpy(&value_bytes, record.data() + 17, sizeof(value_bytes));
+                record.remove_prefix(WRITE_HEADER_BYTES);
+
+                // a record passing its crc is whole, so this only guards against a bug in the writer
+                if (record.size() < size_t(key_bytes) + value_bytes) { return; }
+                i.key = record.substr(0, key_bytes);
+                i.value = record.substr(key_bytes, value_bytes);
+                record.remove_prefix(size_t(key_bytes) + value_bytes);
+                writes.emplace_back(family, i);
+            }
+
+            for (auto & [family, i] : writes)
+            {
+                if (i.type == FAMILY) { names[family] = i.key; }
+                else if (auto it = names.find(family); it != names.end())
+                {
+                    i.family = it->second;
+                    items.emplace_back(i);
+                }
+            }
+        };
+
+        for (std::filesystem::path const & logfile : logfiles)
+        {
+            assert(std::filesystem::is_regular_file(logfile));
+            assert(logfile.extension() == walfile::FILE_EXT);
+
+            std::ifstream file{logfile, std::ios::binary};
             assert(file.good());
+            std::string_view const log = contents.emplace_back(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+            names.clear();
+            read_blocks(log, joined, apply);
+        }
 
-            while (this->read != this->write)
+        sequence_t largest{};
+        std::vector<item const *> writes{};
+        std::unordered_map<std::string_view, memtable::table *> tables{};
+        std::unordered_map<std::string_view, std::unordered_map<std::string_view, item const *>> latest{};
+        for (item const & i : items)
+        {
+            largest = std::max(largest, i.sequence);
+            auto [table, named] = tables.emplace(i.family, nullptr);
+            if (named) { table->second = table_of(i.family); }
+            if (!table->second) { continue; }
+
+            if (i.type == RANGE_DELETION)
             {
-                memtable::skiptable::node const * n{};
-                std::swap(this->putq.at(this->read), n);
-                memtable::skiptable::record const * data = n->value();
-                file << n->key << std::endl;
-                file.write(reinterpret_cast<char const *>(data->data), data->size);
-                this->read = (this->read + 1) % this->config.concurrent_put_limit;
+                writes.emplace_back(&i);
+                continue;
             }
 
-            this->q_mutex.unlock();
+            // concurrent writers may log out of sequence order, and the versions of a key may be in several logs
+            auto [it, added] = latest[i.family].emplace(i.key, &i);
+            if (!added && it->second->sequence < i.sequence) { it->second = &i; }
+        }
+
+        for (auto const & [family, keys] : latest)
+        {
+            for (auto const & [key, i] : keys) { writes.emplace_back(i); }
         }
+
+        // inserted in sequence order, so that once a family's writes fill a table and continue in the next,
+        // every version in the newer table is newer than those in the older, as reads searching the newest table first expect
+        std::sort(writes.begin(), writes.end(), [](item const * l, item const * r) { return l->sequence < r->sequence; });
+        auto const insert = [](memtable::table & table, item const & i) {
+            switch (i.type)
+            {
+                case RANGE_DELETION: return table.insert_range(i.key, i.value, i.sequence);
+                case DELETION: return table.remove(i.key, i.sequence) != nullptr;
+                default: return table.insert(i.key, const_cast<char *>(i.value.data()), i.value.size(), i.sequence) != nullptr;
+            }
+        };
+
+        for (item const * i : writes)
+        {
+            memtable::table * & table = tables[i->family];
+            while (!insert(*table, *i))
+            {
+                // an empty table takes any one write
+                assert(!table->empty());
+                table = table_of(i->family);
+            }
+        }
+
+        return largest;
     }
 
-    // Load an existing logfile into the passed memtable.
-    // Attempts to only write the most recent value for each key.
-    static void load(std::filesystem::path const & logfile, memtable::skiptable & table)
+private:
+    // the type of each logged write
+    static char constexpr VALUE = 'v';
+    static char constexpr DELETION = 'd';
+    static char constexpr RANGE_DELETION = 'r';
+    static char constexpr FAMILY = 'f';
+
+    // the type of a fragment: a whole record, or the first, a middle or the last part of one split across blocks
+    enum class fragment : uint8_t
     {
-        assert(std::filesystem::exists(logfile));
-        assert(std::filesystem::is_regular_file(logfile));
-        assert(logfile.extension() == walfile::FILE_EXT);
+        zero = 0,
+        full = 1,
+        first = 2,
+        middle = 3,
+        last = 4,
+    };
 
-        std::ifstream file{logfile};
-        assert(file.good());
+    static size_t constexpr BLOCK_SIZE = 32_KiB;
+    static size_t constexpr FRAGMENT_HEADER_BYTES = sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t);
+    static size_t constexpr WRITE_HEADER_BYTES = sizeof(char) + sizeof(uint32_t) + sizeof(sequence_t) + 2 * sizeof(uint32_t);
 
-        std::unordered_set<std::string> inserted{};
-        std::vector<std::pair<std::string, std::string>> kvs{};
-        while (file.good())
+    // Reads the fragments of a log, calling "apply" with each whole record, reassembled in "joined" if it was split across blocks.
+    // Fragments failing their crc, such as those torn by a crash, are skipped along with the rest of their block,
+    // and with every record they are part of.
+    template <typename Apply>
+    static void read_blocks(std::string_view log, std::deque<std::string> & joined, Apply const & apply)
+    {
+        std::string partial{};
+        bool in_record{};
+        for (size_t block = 0; block < log.size(); block += BLOCK_SIZE)
         {
-            std::string key{};
-            std::string value{};
-            std::getline(file, key);
-            assert(file.good());
-            std::getline(file, value);
+            std::string_view rest = log.substr(block, BLOCK_SIZE);
+            while (rest.size() >= FRAGMENT_HEADER_BYTES)
+            {
+                uint32_t masked{};
+                uint16_t length{};
+                memcpy(&masked, rest.data(), sizeof(masked));
+                memcpy(&length, rest.data() + 4, sizeof(length));
+                auto const type = static_cast<fragment>(rest[6]);
 
-            kvs.emplace_back(std::make_pair(std::move(key), std::move(value)));
+                // the zero-filled trailer of a block, or a fragment torn or corrupted: resume at the next block.
+                // A record cut off by the skip is dropped, as is any continuing it in the next block.
+                bool const valid = type != fragment::zero && FRAGMENT_HEADER_BYTES + length <= rest.size()
+                    && crc32c::unmask(masked) == crc32c::value(rest.data() + 6, 1 + size_t(length));
+                if (!valid)
+                {
+                    in_record = false;
+                    break;
+                }
+
+                std::string_view const data = rest.substr(FRAGMENT_HEADER_BYTES, length);
+                rest.remove_prefix(FRAGMENT_HEADER_BYTES + length);
+                switch (type)
+                {
+                    case fragment::full:
+                        in_record = false;
+                        apply(data);
+                        break;
+                    case fragment::first:
+                        partial.assign(data);
+                        in_record = true;
+                        break;
+                    case fragment::middle:
+                        if (in_record) { partial.append(data); }
+                        break;
+                    case fragment::last:
+                        if (in_record) { apply(joined.emplace_back(std::move(partial.append(data)))); }
+                        in_record = false;
+                        break;
+                    default:
+                        in_record = false;
+                        break;
+                }
+            }
         }
+    }
 
-        // reverse the order as we want the most recent values, which are at the end of the file
-        std::reverse(kvs.begin(), kvs.end());
-        for (auto const & kv : kvs)
+    // appends a write to a record, in the format described above
+    static void append_write(std::string & record, char type, uint32_t family, sequence_t sequence, std::string_view key, std::string_view value)
+    {
+        auto const key_bytes = uint32_t(key.size());
+        auto const value_bytes = uint32_t(value.size());
+        char header[WRITE_HEADER_BYTES]{type};
+        memcpy(header + 1, &family, sizeof(family));
+        memcpy(header + 5, &sequence, sizeof(sequence));
+        memcpy(header + 13, &key_bytes, sizeof(key_bytes));
+        memcpy(header + 17, &value_bytes, sizeof(value_bytes));
+
+        record.reserve(record.size() + sizeof(header) + key.size() + value.size());
+        record.append(header, sizeof(header)).append(key).append(value);
+    }
+
+    // A piece of the file written by a group commit: the zero-filled trailer of a block, or a fragment header and the data following it,
+    // viewed in place in the record it is part of
+    struct frame
+    {
+        size_t padding{};
+        size_t header_bytes{};
+        char header[FRAGMENT_HEADER_BYTES]{};
+        std::string_view data{};
+    };
+
+    // Appends the frames of "record" to "frames", split into fragments so that none crosses a block boundary.
+    // "block_offset" is the position in the current block at which the frames end.
+    static void frame_record(std::vector<frame> & frames, size_t & block_offset, std::string_view record)
+    {
+        bool begin = true;
+        do
+        {
+            size_t const left = BLOCK_SIZE - block_offset;
+            if (left < FRAGMENT_HEADER_BYTES)
+            {
+                frames.emplace_back(frame{.padding = left});
+                block_offset = 0;
+                continue;
+            }
+
+            size_t const length = std::min(record.size(), left - FRAGMENT_HEADER_BYTES);
+            bool const end = length == record.size();
+            fragment const type = begin && end ? fragment::full : begin ? fragment::first : end ? fragment::last : fragment::middle;
+
+            frame & f = frames.emplace_back(frame{.header_bytes = FRAGMENT_HEADER_BYTES, .data = record.substr(0, length)});
+            auto const length16 = uint16_t(length);
+            memcpy(f.header + 4, &length16, sizeof(length16));
+            f.header[6] = char(type);
+            uint32_t const crc = crc32c::mask(crc32c::extend(crc32c::value(f.header + 6, 1), record.data(), length));
+            memcpy(f.header, &crc, sizeof(crc));
+
+            record.remove_prefix(length);
+            block_offset += FRAGMENT_HEADER_BYTES + length;
+            begin = false;
+        } while (!record.empty());
+    }
+
+    // writes "iov" to the file whole, resuming after short writes, in calls of at most IOV_MAX buffers
+    void write_all(std::span<iovec> iov)
+    {
+        while (!iov.empty())
         {
-            if (!inserted.contains(kv.first))
+            ssize_t written = ::writev(this->fd, iov.data(), int(std::min<size_t>(iov.size(), IOV_MAX)));
+            if (written < 0 && errno == EINTR) { continue; }
+            assert(written >= 0);
+
+            while (!iov.empty() && size_t(written) >= iov.front().iov_len)
+            {
+                written -= ssize_t(iov.front().iov_len);
+                iov = iov.subspan(1);
+            }
+
+            if (written > 0)
             {
-                // drop newline characters
-                assert(!table.locked());
-                table.insert(kv.first.substr(0,kv.first.size() - 1), (void*)kv.second.data(), kv.second.size() - 1);
-                inserted.insert(kv.first);
+                iov.front().iov_base = static_cast<char *>(iov.front().iov_base) + written;
+                iov.front().iov_len -= size_t(written);
             }
         }
     }
 
-private:
+    // Queues a record, returning its ticket: the number of records logged up to and including it.
+    uint64_t enqueue(std::string record)
+    {
+log_retry:
+        // first, take the shared_mutex in "shared mode" and write to the queue
+        // the atomicity of the write-head ensures valid ordering
+        // If the queue is full we loop (releasing the mutex) as eventually a concurrent thread will drain the queue
+        // in practice this may occassionally cause significant latency on log operations, so a retry limit might be practical
+        this->q_mutex.lock_shared();
+
+        uint64_t w = this->write;
+        bool const full = w - this->read == this->config.concurrent_put_limit;
+        if (full || !this->write.compare_exchange_weak(w, w + 1))
+        {
+            this->q_mutex.unlock_shared();
+            // a full queue may have been left undrained by writers that did not wait for their records
+            if (full) { this->commit(w, durability::none); }
+            goto log_retry;
+        }
+        else { this->putq.at(w % this->config.concurrent_put_limit) = std::move(record); }
+
+        this->q_mutex.unlock_shared();
+        return w + 1;
+    }
+
+    // Group commit: returns once the records up to "ticket" are persisted as "d" requires.
+    // One writer at a time leads, writing every record queued as it starts in a single "writev", then syncing them with
+    // a single "fdatasync" if any writer waiting on them asked for it. Writers arriving meanwhile queue their records and wait,
+    // and once the leader is done, one of those still waiting leads the next group - so under load, each write and sync
+    // is shared by many records. A writer asking for no durability leads only if no one is leading, and never waits.
+    void commit(uint64_t ticket, durability d)
+    {
+        std::unique_lock lock{this->commit_mutex};
+        if (d == durability::none)
+        {
+            while (!this->leading && this->written < ticket) { this->lead(lock); }
+            return;
+        }
+
+        if (d == durability::sync) { this->sync_wanted = std::max(this->sync_wanted, ticket); }
+        while (this->written < ticket || (d == durability::sync && this->synced < ticket))
+        {
+            if (this->leading) { this->committed.wait(lock); }
+            else { this->lead(lock); }
+        }
+    }
+
+    // Writes the queued records to the file, then syncs it if a writer is waiting for a sync. Requires "commit_mutex", which is
+    // released while writing. Enqueuers are only blocked while the records are taken from the queue.
+    void lead(std::unique_lock<std::mutex> & lock)
+    {
+        this->leading = true;
+        lock.unlock();
+
+        this->q_mutex.lock();
+        while (this->read != this->write)
+        {
+            this->draining.emplace_back();
+            std::swap(this->putq.at(this->read % this->config.concurrent_put_limit), this->draining.back());
+            this->read += 1;
+        }
+
+        uint64_t const upto = this->read;
+        this->q_mutex.unlock();
+
+        // the frames are complete before any buffer is taken from them, as adding frames may move them
+        for (std::string const & record : this->draining) { frame_record(this->frames, this->block_offset, record); }
+
+        static char const zeros[FRAGMENT_HEADER_BYTES]{};
+        for (frame & f : this->frames)
+        {
+            if (f.padding) { this->iov.emplace_back(iovec{const_cast<char *>(zeros), f.padding}); }
+            if (f.header_bytes) { this->iov.emplace_back(iovec{f.header, f.header_bytes}); }
+            if (!f.data.empty()) { this->iov.emplace_back(iovec{const_cast<char *>(f.data.data()), f.data.size()}); }
+        }
+
+        this->write_all(this->iov);
+
+        // cleared, rather than freed, so that later groups reuse their capacity
+        this->iov.clear();
+        this->frames.clear();
+        this->draining.clear();
+
+        lock.lock();
+        this->written = upto;
+        if (this->sync_wanted > this->synced)
+        {
+            lock.unlock();
+            [[maybe_unused]] int const synced = ::fdatasync(this->fd);
+            assert(synced == 0);
+            lock.lock();
+            this->synced = upto;
+        }
+
+        this->leading = false;
+        this->committed.notify_all();
+    }
+
     std::shared_mutex q_mutex{};
-    std::vector<memtable::skiptable::node const *> putq;
-    std::atomic_size_t write{};
+    // serialized records, waiting to be written
+    std::vector<std::string> putq;
+    // the number of records queued, and taken from the queue to be written. Each record is at its count modulo the queue size.
+    std::atomic<uint64_t> write{};
      // doesn't need to be atomic, will only be modified under exclusive mutex ownership
-    size_t read{};
+    uint64_t read{};
+    int const fd;
+
+    // the state of the group commit: the number of records written, and synced, and the ticket of the last record a writer is
+    // waiting to be synced. Require "commit_mutex".
+    std::mutex commit_mutex{};
+    std::condition_variable committed{};
+    bool leading{};
+    uint64_t written{};
+    uint64_t synced{};
+    uint64_t sync_wanted{};
+
+    // The position in the current block at which the file ends, and the state of the group being written. Require "leading".
+    size_t block_offset{};
+    std::vector<std::string> draining{};
+    std::vector<frame> frames{};
+    std::vector<iovec> iov{};
 };
 
 } // namespace KVSTORE_NS::WAL
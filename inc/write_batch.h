@@ -0,0 +1,75 @@
+#pragma once
+
+#include <ns.h>
+#include <memtable.h>
+#include <string>
+#include <vector>
+
+namespace KVSTORE_NS
+{
+// A group of puts and removes, applied to a store at once by "kvstore::write".
+// The writes are applied atomically: a read sees every write of the batch or none of them, as does recovery from the log.
+// Writes may be made to several column families, named by their ids (see "kvstore::column_family::id"), or else to the default family.
+// Keys and values are copied into a single buffer as they are added, so a batch may be built from short-lived data,
+// and a batch that is cleared and refilled reuses its memory.
+struct write_batch
+{
+    // a write in the batch, referencing the batch's own copy of its key and value
+    struct entry
+    {
+        memtable::table::value_type type{};
+        uint32_t family{};
+        std::string_view key{};
+        std::string_view value{};
+    };
+
+    void put(std::string_view key, void const * data, size_t data_size) { this->put(0, key, data, data_size); }
+    void remove(std::string_view key) { this->remove(0, key); }
+
+    void put(uint32_t family, std::string_view key, void const * data, size_t data_size)
+    {
+        this->add(memtable::table::value_type::value, family, key, {static_cast<char const *>(data), data_size});
+    }
+
+    void remove(uint32_t family, std::string_view key) { this->add(memtable::table::value_type::deletion, family, key, {}); }
+
+    void clear()
+    {
+        this->bytes.clear();
+        this->writes.clear();
+    }
+
+    // the number of writes in the batch
+    size_t size() const { return this->writes.size(); }
+    bool empty() const { return this->writes.empty(); }
+
+    // the ith write, in the order they were added. Requires i < size().
+    entry operator[](size_t i) const
+    {
+        write const & w = this->writes[i];
+        std::string_view const all{this->bytes};
+        return entry{.type = w.type, .family = w.family, .key = all.substr(w.offset, w.key_size), .value = all.substr(w.offset + w.key_size, w.value_size)};
+    }
+
+private:
+    // a write, whose key and then value are held in "bytes" from "offset"
+    struct write
+    {
+        memtable::table::value_type type{};
+        uint32_t family{};
+        size_t offset{};
+        size_t key_size{};
+        size_t value_size{};
+    };
+
+    void add(memtable::table::value_type type, uint32_t family, std::string_view key, std::string_view value)
+    {
+        this->writes.emplace_back(write{.type = type, .family = family, .offset = this->bytes.size(), .key_size = key.size(), .value_size = value.size()});
+        this->bytes.append(key).append(value);
+    }
+
+    std::string bytes{};
+    std::vector<write> writes{};
+};
+
+} // namespace KVSTORE_NS
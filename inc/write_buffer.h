@@ -0,0 +1,123 @@
+#pragma once
+
+#include <ns.h>
+#include <literals.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std::literals::chrono_literals;
+using namespace KVSTORE_NS::literals;
+
+namespace KVSTORE_NS::memtable
+{
+// A memory budget for the memtables of one or more stores.
+// Tables attached to a manager reserve their memory from it as they grow, and release it when reset or freed.
+// Once usage passes the flush trigger, stores flush their memtables early.
+// Past the slowdown trigger, writers are delayed in proportion to how close usage is to the budget,
+// and at the budget itself, writers block until flushes release memory.
+// A single manager may be shared between several stores, giving a firm ceiling on the memtable memory of all of them.
+struct write_buffer_manager
+{
+    struct config_options
+    {
+        // The memory budget, in bytes, for all memtables attached to the manager
+        // This should comfortably exceed the memory of a single full memtable (see memtable.h) for each attached store.
+        // Writes already in progress when the budget is reached complete, so usage may briefly exceed it.
+        size_t buffer_size{512_MiB};
+
+        // The fraction of the budget past which stores flush their memtables early
+        double flush_ratio{0.5};
+
+        // The fraction of the budget past which writers are delayed
+        double slowdown_ratio{0.9};
+
+        // The delay applied to each write as usage approaches the budget
+        std::chrono::microseconds max_write_delay{1000us};
+
+        // Tables reserve memory ahead of their usage in blocks of this size,
+        // so that most inserts do not touch the shared usage counter.
+        size_t reserve_block{64_KiB};
+    };
+
+    explicit write_buffer_manager(config_options const & opts) : config(opts) {}
+
+    write_buffer_manager(write_buffer_manager&&) = delete;
+    write_buffer_manager(write_buffer_manager const &) = delete;
+    write_buffer_manager& operator=(write_buffer_manager&&) = delete;
+    write_buffer_manager& operator=(write_buffer_manager const&) = delete;
+
+    void reserve(size_t bytes) { this->used += bytes; }
+
+    void release(size_t bytes)
+    {
+        // wake any writers blocked on the budget. Taking the mutex after the update ensures a blocked writer
+        // is either already waiting, or will see the new usage before it waits.
+        size_t const before = this->used.fetch_sub(bytes);
+        if (before >= this->config.buffer_size)
+        {
+            std::vector<std::function<void()>> resumed{};
+            {
+                std::lock_guard lock{this->room_mutex};
+                if (before - bytes < this->config.buffer_size) { std::swap(resumed, this->waiting); }
+            }
+
+            this->room.notify_all();
+            for (auto & resume : resumed) { resume(); }
+        }
+    }
+
+    // The bytes currently reserved by attached tables
+    size_t usage() const { return this->used; }
+
+    bool should_flush() const { return this->used >= this->config.buffer_size * this->config.flush_ratio; }
+
+    // Delays the calling writer if usage is past the slowdown trigger, and blocks while usage is at the budget
+    void throttle()
+    {
+        size_t const used = this->used;
+        size_t const slowdown = this->config.buffer_size * this->config.slowdown_ratio;
+        if (used < slowdown) { return; }
+
+        if (used < this->config.buffer_size)
+        {
+            double const fraction = double(used - slowdown) / double(this->config.buffer_size - slowdown);
+            std::this_thread::sleep_for(std::chrono::duration_cast<std::chrono::microseconds>(this->config.max_write_delay * fraction));
+            return;
+        }
+
+        std::unique_lock lock{this->room_mutex};
+        this->room.wait(lock, [this] { return this->used < this->config.buffer_size; });
+    }
+
+    // The asynchronous form of blocking in "throttle": calls "resume" once usage is under the budget - at once,
+    // if it already is, or from the "release" that brings it under. "resume" should be short, as it may run on a flush.
+    void when_room(std::function<void()> resume)
+    {
+        {
+            std::lock_guard lock{this->room_mutex};
+            if (this->used >= this->config.buffer_size)
+            {
+                this->waiting.emplace_back(std::move(resume));
+                return;
+            }
+        }
+
+        resume();
+    }
+
+    config_options const config;
+
+private:
+    std::atomic_size_t used{};
+    std::mutex room_mutex{};
+    std::condition_variable room{};
+    // the callers of "when_room" waiting for usage to fall under the budget
+    std::vector<std::function<void()>> waiting{};
+};
+
+} // namespace KVSTORE_NS::memtable
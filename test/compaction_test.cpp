@@ -0,0 +1,149 @@
+#include <compaction.h>
+#include <iostream>
+#include <tuple>
+
+using namespace KVSTORE_NS;
+using namespace KVSTORE_NS::literals;
+
+// Merges a newer and an older file, checking the versions compaction writes: shadowed versions and those deleted
+// by a range are dropped, unless a snapshot still reads them, and deletions are dropped only at the bottom of the tree,
+// once no snapshot can read what they delete.
+int main()
+{
+    int failures{};
+    auto const expect = [&](bool ok, std::string_view what) {
+        if (!ok)
+        {
+            std::cerr << "FAILED: " << what << std::endl;
+            failures += 1;
+        }
+    };
+
+    std::filesystem::path const dir = std::filesystem::temp_directory_path() / "kvstore_compaction_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    using value_type = memtable::table::value_type;
+    sst::sstable::config_options const sst_opts{.max_block_size = 4_KiB, .base_dir = dir};
+    auto time = std::chrono::steady_clock::now();
+    auto const next_time = [&] { return time += 1ms; };
+
+    // the open snapshot, reading the versions at or below its sequence
+    constexpr sequence_t SNAPSHOT = 5;
+
+    struct write
+    {
+        std::string key{};
+        std::string value{};
+        value_type type{value_type::value};
+        sequence_t sequence{};
+    };
+
+    // flushes "writes" to a file, keeping the versions the snapshot reads
+    auto const flush = [&](std::vector<write> const & writes) {
+        memtable::skiptable table{memtable::table::config_opts{}};
+        for (write const & w : writes)
+        {
+            switch (w.type)
+            {
+                case value_type::value: table.insert(w.key, const_cast<char *>(w.value.data()), w.value.size(), w.sequence); break;
+                case value_type::deletion: table.remove(w.key, w.sequence); break;
+                case value_type::range_deletion: table.insert_range(w.key, w.value, w.sequence); break;
+            }
+        }
+
+        table.lock();
+        memtable::sorted_table const sorted{table};
+        return std::make_shared<sst::sstable const>(sst_opts, sorted, next_time(), std::function<void(size_t)>{}, retention({SNAPSHOT}, MAX_SEQUENCE));
+    };
+
+    sst::version::file_ptr const older = flush({
+        {.key = "a", .value = "a-old", .sequence = 2},
+        {.key = "a", .value = "a-mid", .sequence = 6},
+        {.key = "b", .value = "b-old", .sequence = 3},
+        {.key = "c", .value = "c-old", .sequence = 6},
+        {.key = "d", .value = "d-old", .sequence = 7},
+        {.key = "r2", .value = "r2-old", .sequence = 4},
+    });
+
+    sst::version::file_ptr const newer = flush({
+        {.key = "a", .value = "a-new", .sequence = 9},
+        {.key = "b", .type = value_type::deletion, .sequence = 10},
+        {.key = "c", .type = value_type::deletion, .sequence = 11},
+        {.key = "d", .value = "e", .type = value_type::range_deletion, .sequence = 12},
+        {.key = "r", .value = "s", .type = value_type::range_deletion, .sequence = 13},
+        {.key = "e", .type = value_type::deletion, .sequence = 14},
+    });
+
+    using version_of = std::tuple<std::string, sequence_t, value_type>;
+    struct merged
+    {
+        std::vector<version_of> versions{};
+        size_t ranges{};
+        std::vector<sst::version::file_ptr> files{};
+    };
+
+    // compacts the two files into level 1, listing every version written
+    auto const compact = [&](retention const & keep, bool bottom) {
+        sst::compaction const c{.level = 0, .output_level = 1, .inputs = {newer, older}, .bottom = bottom};
+        merged out{.files = c.run(sst_opts, sst::compaction::config_options{}, keep, next_time)};
+        for (sst::version::file_ptr const & file : out.files)
+        {
+            for (sst::sstable::cursor cursor{*file}; cursor.valid(); cursor.next())
+            {
+                out.versions.emplace_back(std::string(cursor.key()), cursor.sequence(), cursor.type());
+            }
+
+            out.ranges += file->deleted_ranges().ranges().size();
+        }
+
+        return out;
+    };
+
+    {
+        // the snapshot reads "a", "b" and "r2" at their oldest versions, which are kept, as are the deletions written after it.
+        // "a" at 6 and "c" at 6 are hidden from every read by newer versions, and "d" at 7 by a range deletion.
+        merged const out = compact(retention({SNAPSHOT}, MAX_SEQUENCE), true);
+        std::vector<version_of> const expected{
+            {"a", 9, value_type::value}, {"a", 2, value_type::value},
+            {"b", 10, value_type::deletion}, {"b", 3, value_type::value},
+            {"c", 11, value_type::deletion},
+            {"e", 14, value_type::deletion},
+            {"r2", 4, value_type::value},
+        };
+
+        expect(out.versions == expected, "snapshot versions kept, shadowed versions dropped");
+        expect(out.ranges == 2, "range deletions the snapshot does not read are kept");
+
+        std::vector<std::byte> data{};
+        sst::sstable const & file = *out.files.front();
+        expect(file.get("a", data, SNAPSHOT) == lookup::found && std::string(reinterpret_cast<char const *>(data.data()), data.size()) == "a-old",
+               "the snapshot reads its version");
+        expect(file.get("r2", data, SNAPSHOT) == lookup::found, "the snapshot reads a version under a later range deletion");
+        expect(file.get("r2", data) == lookup::deleted && file.get("b", data) == lookup::deleted, "later reads see the deletions");
+    }
+
+    {
+        // without snapshots, only the newest value of each key is left, and at the bottom, no deletion
+        merged const out = compact(retention({}, MAX_SEQUENCE), true);
+        expect(out.versions == std::vector<version_of>{{"a", 9, value_type::value}}, "tombstones dropped at the bottom");
+        expect(out.ranges == 0, "range deletions dropped at the bottom");
+    }
+
+    {
+        // above the bottom, files below may still hold older versions for the deletions to hide
+        merged const out = compact(retention({}, MAX_SEQUENCE), false);
+        std::vector<version_of> const expected{
+            {"a", 9, value_type::value},
+            {"b", 10, value_type::deletion},
+            {"c", 11, value_type::deletion},
+            {"e", 14, value_type::deletion},
+        };
+
+        expect(out.versions == expected, "tombstones kept above the bottom");
+        expect(out.ranges == 2, "range deletions kept above the bottom");
+    }
+
+    std::filesystem::remove_all(dir);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+#include <kvstore.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+
+using namespace KVSTORE_NS;
+using namespace KVSTORE_NS::literals;
+
+// Scans a store whose keys are spread over its memtables and several levels of sst files, overwritten and deleted
+// in between, against a map of the writes: forward and reverse, from seeks, within a prefix, and at a snapshot.
+int main()
+{
+    int failures{};
+    auto const expect = [&](bool ok, std::string_view what) {
+        if (!ok)
+        {
+            std::cerr << "FAILED: " << what << std::endl;
+            failures += 1;
+        }
+    };
+
+    std::filesystem::path const dir = std::filesystem::temp_directory_path() / "kvstore_iterator_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    // small tables, files and levels, so that a few thousand keys fill several levels
+    kvstore::config_options opts{};
+    opts.memtable_options.writes_before_lock = 256;
+    opts.sst_options.base_dir = dir;
+    opts.sst_options.max_block_size = 1_KiB;
+    opts.wal_options.base_dir = dir;
+    opts.compaction_options.level0_file_trigger = 2;
+    opts.compaction_options.level_base_bytes = 16_KiB;
+    opts.compaction_options.level_ratio = 2;
+    opts.compaction_options.target_file_size = 8_KiB;
+
+    using model = std::map<std::string, std::string>;
+    model expected{};
+    std::mt19937 rng{42};
+    auto const key_of = [](size_t i) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "key/%05zu", i);
+        return std::string(buf);
+    };
+
+    constexpr size_t KEYS = 3000;
+    auto const write_round = [&](kvstore & store, size_t round, size_t writes) {
+        for (size_t w = 0; w < writes; w++)
+        {
+            size_t const i = rng() % KEYS;
+            std::string const key = key_of(i);
+            if (rng() % 5 == 0)
+            {
+                store.remove(key);
+                expected.erase(key);
+                continue;
+            }
+
+            std::string value = std::to_string(round) + "/" + std::to_string(w);
+            store.put(key, value.data(), value.size());
+            expected[key] = std::move(value);
+        }
+
+        if (round % 2 == 1)
+        {
+            size_t const begin = rng() % KEYS;
+            store.remove_range(key_of(begin), key_of(begin + 40));
+            expected.erase(expected.lower_bound(key_of(begin)), expected.lower_bound(key_of(begin + 40)));
+        }
+    };
+
+    // each round is flushed as the store closes, and compacted into the levels below as the next opens
+    for (size_t round = 0; round < 6; round++)
+    {
+        kvstore store{opts};
+        write_round(store, round, 1500);
+    }
+
+    auto open = std::make_unique<kvstore>(opts);
+    kvstore & store = *open;
+    // the last writes stay in the memtables
+    write_round(store, 6, 200);
+
+    std::set<size_t> levels{};
+    {
+        std::ifstream manifest{dir / "MANIFEST"};
+        size_t level{};
+        std::string name{};
+        while (manifest >> level >> name) { levels.insert(level); }
+    }
+
+    expect(levels.size() >= 2 && *levels.rbegin() >= 2, "files in several levels");
+
+    auto const value_of = [](kvstore::iterator const & it) {
+        return std::string(reinterpret_cast<char const *>(it.value().data()), it.value().size());
+    };
+
+    // the keys and values from the iterator's position to the end, forward or in reverse
+    auto const scan = [&](kvstore::iterator & it, bool reverse) {
+        std::vector<std::pair<std::string, std::string>> out{};
+        for (; it.valid(); reverse ? it.prev() : it.next()) { out.emplace_back(std::string(it.key()), value_of(it)); }
+        return out;
+    };
+
+    auto const range = [](auto begin, auto end) { return std::vector<std::pair<std::string, std::string>>(begin, end); };
+
+    {
+        kvstore::iterator it{store};
+        it.seek_to_first();
+        expect(scan(it, false) == range(expected.begin(), expected.end()), "forward scan");
+
+        it.seek_to_last();
+        expect(scan(it, true) == range(expected.rbegin(), expected.rend()), "reverse scan");
+    }
+
+    {
+        kvstore::iterator it{store};
+        for (size_t n = 0; n < 200; n++)
+        {
+            // existing, deleted and absent keys, between and past the stored ones
+            std::string const key = key_of(rng() % (KEYS + 10)) + (n % 3 == 0 ? "~" : "");
+
+            it.seek(key);
+            auto const at = expected.lower_bound(key);
+            if (at == expected.end() ? it.valid() : !it.valid() || it.key() != at->first || value_of(it) != at->second)
+            {
+                expect(false, "seek");
+                break;
+            }
+
+            it.seek_for_prev(key);
+            auto const before = expected.upper_bound(key);
+            if (before == expected.begin() ? it.valid() : !it.valid() || it.key() != std::prev(before)->first)
+            {
+                expect(false, "seek_for_prev");
+                break;
+            }
+
+            // changing direction from a seek
+            if (it.valid() && before != expected.end())
+            {
+                it.next();
+                if (!it.valid() || it.key() != before->first) { expect(false, "next after seek_for_prev"); break; }
+            }
+        }
+    }
+
+    {
+        std::string const prefix = "key/012";
+        kvstore::iterator it{store, kvstore::iterator::config_options{.prefix = prefix}};
+        auto const end = expected.lower_bound("key/013");
+        it.seek_to_first();
+        expect(scan(it, false) == range(expected.lower_bound(prefix), end), "prefix scan");
+
+        it.seek_to_last();
+        expect(scan(it, true) == range(std::make_reverse_iterator(end), std::make_reverse_iterator(expected.lower_bound(prefix))),
+               "reverse prefix scan");
+    }
+
+    {
+        // writes after a snapshot, including to keys in the files, are not read at it
+        kvstore::snapshot const at{store};
+        model const before = expected;
+        write_round(store, 7, 300);
+
+        kvstore::iterator it{store, kvstore::iterator::config_options{.at = &at}};
+        it.seek_to_first();
+        expect(scan(it, false) == range(before.begin(), before.end()), "scan at a snapshot");
+
+        kvstore::iterator latest{store};
+        latest.seek_to_first();
+        expect(scan(latest, false) == range(expected.begin(), expected.end()), "scan of the latest writes");
+    }
+
+    open.reset();
+    std::filesystem::remove_all(dir);
+    return failures == 0 ? 0 : 1;
+}
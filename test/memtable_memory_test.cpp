@@ -0,0 +1,80 @@
+#include <art.h>
+#include <epoch.h>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+using namespace KVSTORE_NS;
+
+// Compares the memory of the two memtable engines over the same keys: long keys sharing structured prefixes,
+// where the adaptive radix tree should be the smaller. Neither engine may hold a second copy of the keys, beyond
+// the one stored in the record buffer, and the radix tree's replaced inner nodes must not stay charged to the table
+// once they are retired to a reclaimer.
+int main()
+{
+    int failures{};
+    auto const expect = [&](bool ok, std::string_view what) {
+        if (!ok)
+        {
+            std::cerr << "FAILED: " << what << std::endl;
+            failures += 1;
+        }
+    };
+
+    constexpr size_t KEYS = 100'000;
+    constexpr size_t KEY_SIZE = 40;
+    memtable::table::config_opts const opts{.writes_before_lock = KEYS};
+
+    // "padding" lengthens every key after its distinguishing bytes, which leaves the shape of either index unchanged
+    auto const key_of = [](size_t i, size_t padding = 0) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "tenant/%04zu/bucket/photos/objects/%06zu", i % 50, i);
+        return std::string(buf) + std::string(padding, '~');
+    };
+
+    // the memory the table gained from the inserts, beyond its fixed record buffer and filter
+    auto const fill = [&](memtable::table & table, size_t padding = 0) {
+        size_t const empty = table.memory_usage();
+        for (size_t i = 0; i < KEYS; i++)
+        {
+            std::string const key = key_of(i, padding);
+            if (!table.insert(key, const_cast<char *>("v"), 1, i + 1)) { expect(false, "insert accepted"); }
+        }
+
+        return table.memory_usage() - empty;
+    };
+
+    epoch::reclaimer reclaimer{};
+    memtable::skiptable skiplist{opts};
+    memtable::art_table art{opts, nullptr, &reclaimer};
+    memtable::art_table art_unreclaimed{opts};
+
+    size_t const skiplist_bytes = fill(skiplist);
+    size_t const art_bytes = fill(art);
+    size_t const unreclaimed_bytes = fill(art_unreclaimed);
+    reclaimer.collect();
+
+    std::cout << KEYS << " keys of " << KEY_SIZE << " bytes - skiplist: " << skiplist_bytes << " bytes, art: " << art_bytes
+        << " bytes (" << unreclaimed_bytes << " keeping replaced nodes)" << std::endl;
+
+    expect(key_of(0).size() == KEY_SIZE, "key size");
+    expect(art_bytes < skiplist_bytes, "art is smaller for shared prefixes");
+    expect(art_bytes < unreclaimed_bytes, "retired inner nodes are released");
+
+    // each key is stored once, in the record buffer: longer keys cost their extra bytes once, not again in the index
+    constexpr size_t PADDING = 40;
+    memtable::skiptable skiplist_padded{opts};
+    memtable::art_table art_padded{opts, nullptr, &reclaimer};
+    expect(fill(skiplist_padded, PADDING) - skiplist_bytes == KEYS * PADDING, "skiplist nodes hold no copy of their keys");
+    expect(fill(art_padded, PADDING) - art_bytes == KEYS * PADDING, "art leaves hold no copy of their keys");
+    reclaimer.collect();
+
+    size_t n{};
+    for (memtable::table::entry const * e = art.lower_bound(""); e; e = art.next(e), n++)
+    {
+        if (e->key != key_of(std::stoul(std::string(e->key.substr(e->key.size() - 6))))) { expect(false, "art keys intact"); break; }
+    }
+
+    expect(n == KEYS, "every key indexed");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#include <memtable.h>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace KVSTORE_NS;
+
+// Concurrent inserts of ascending keys into one skiptable, the sorted ingest that the level tails serve.
+// Every key must be indexed in order, and the appends must stay as cheap as those of a single thread:
+// a tail left behind by a race would make every later append walk its level from there.
+int main()
+{
+    int failures{};
+    auto const expect = [&](bool ok, std::string_view what) {
+        if (!ok)
+        {
+            std::cerr << "FAILED: " << what << std::endl;
+            failures += 1;
+        }
+    };
+
+    constexpr size_t KEYS = 200'000;
+    constexpr size_t THREADS = 4;
+
+    auto const key_of = [](size_t i) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%010zu", i);
+        return std::string(buf);
+    };
+
+    auto const ingest = [&](size_t threads) {
+        memtable::skiptable table{memtable::table::config_opts{.writes_before_lock = KEYS}};
+        auto const start = std::chrono::steady_clock::now();
+
+        // thread "t" inserts every "threads"th key, so the threads append in step at the end of each level
+        std::vector<std::thread> writers{};
+        for (size_t t = 0; t < threads; t++)
+        {
+            writers.emplace_back([&, t] {
+                for (size_t i = t; i < KEYS; i += threads)
+                {
+                    std::string const key = key_of(i);
+                    if (!table.insert(key, nullptr, 0, i + 1)) { expect(false, "insert accepted"); }
+                }
+            });
+        }
+
+        for (std::thread & w : writers) { w.join(); }
+        auto const elapsed = std::chrono::steady_clock::now() - start;
+
+        size_t n{};
+        for (memtable::table::entry const * e = table.lower_bound(""); e; e = table.next(e), n++)
+        {
+            if (n < KEYS && e->key != key_of(n)) { expect(false, "keys indexed in order"); break; }
+        }
+
+        expect(n == KEYS, "every key indexed");
+        return elapsed;
+    };
+
+    auto const single = ingest(1);
+    auto const concurrent = ingest(THREADS);
+
+    // generous, as thread scheduling varies: a stale tail costs orders of magnitude more
+    expect(concurrent < single * 20 + std::chrono::seconds(2), "concurrent appends are not quadratic");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+#include <sstable.h>
+#include <iostream>
+
+using namespace KVSTORE_NS;
+using namespace KVSTORE_NS::literals;
+
+// Snapshot reads of a flushed key with several versions: every version kept for a snapshot must be found at it,
+// including versions continuing into the next block, and those of the empty key.
+int main()
+{
+    int failures{};
+    auto const expect = [&](bool ok, std::string_view what) {
+        if (!ok)
+        {
+            std::cerr << "FAILED: " << what << std::endl;
+            failures += 1;
+        }
+    };
+
+    std::filesystem::path const dir = std::filesystem::temp_directory_path() / "kvstore_sstable_versions_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    for (size_t block_size : {4_MiB, 256_KiB / 1024})
+    {
+        memtable::skiptable table{memtable::table::config_opts{}};
+        std::string old_value{"old"}, new_value{"new"}, other{"other"};
+        table.insert("", old_value.data(), old_value.size(), 1);
+        table.insert("", new_value.data(), new_value.size(), 4);
+        table.insert("aaa", other.data(), other.size(), 2);
+        table.insert("bbb", old_value.data(), old_value.size(), 1);
+        table.insert("bbb", new_value.data(), new_value.size(), 4);
+        table.insert("ccc", other.data(), other.size(), 3);
+        table.lock();
+
+        memtable::sorted_table sorted{table};
+        // a snapshot at sequence 1 keeps the old versions
+        sst::sstable const file{sst::sstable::config_options{.max_block_size = block_size, .base_dir = dir}, sorted,
+            std::chrono::steady_clock::now(), {}, retention({1}, 4)};
+
+        for (std::string_view key : {"", "bbb"})
+        {
+            std::vector<std::byte> data{};
+            expect(file.get(key, data, 1) == lookup::found && std::string((char const *)data.data(), data.size()) == "old",
+                   "old version at the snapshot");
+            expect(file.get(key, data) == lookup::found && std::string((char const *)data.data(), data.size()) == "new",
+                   "new version at the latest sequence");
+        }
+
+        std::vector<std::byte> data{};
+        expect(file.get("ccc", data, 1) == lookup::missing, "key written after the snapshot");
+        expect(file.get("ccc", data) == lookup::found, "key following the versions");
+        std::filesystem::remove(file.file_path());
+    }
+
+    std::filesystem::remove_all(dir);
+    return failures == 0 ? 0 : 1;
+}
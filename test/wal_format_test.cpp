@@ -0,0 +1,123 @@
+#include <wal.h>
+#include <fstream>
+#include <iostream>
+
+using namespace KVSTORE_NS;
+using namespace KVSTORE_NS::literals;
+
+// Round trips writes through the log's binary format: keys and values holding newlines and zeros, a batch,
+// a record split across several 32 KiB blocks, and recovery from a torn final block and from a corrupt block.
+int main()
+{
+    int failures{};
+    auto const expect = [&](bool ok, std::string_view what) {
+        if (!ok)
+        {
+            std::cerr << "FAILED: " << what << std::endl;
+            failures += 1;
+        }
+    };
+
+    std::filesystem::path const dir = std::filesystem::temp_directory_path() / "kvstore_wal_format_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    using value_type = memtable::table::value_type;
+    std::string const newline_key{"key\nwith\r\nnewlines"};
+    std::string const newline_value{"value\n\nspanning\nlines\0and a zero", 32};
+    std::string const big(100_KiB, 'x');
+
+    // the log is removed with the walfile, so a copy of it is recovered instead
+    std::filesystem::path const logged = dir / ("logged" + WAL::walfile::FILE_EXT);
+    {
+        WAL::walfile log{WAL::walfile::config_options{.base_dir = dir}};
+        log.name_family(0, "default");
+        log.log(value_type::value, 0, 1, newline_key, newline_value);
+        log.log(value_type::value, 0, 2, "\n", "\n");
+        log.log(value_type::value, 0, 3, "removed", "old");
+        log.log(value_type::deletion, 0, 4, "removed");
+
+        write_batch batch{};
+        batch.put("batch/a", "1", 1);
+        batch.put("batch/b\n", "2\n", 2);
+        batch.remove("batch/c");
+        log.log_batch(5, batch);
+
+        // starts in the first block, and ends in the fourth
+        log.log(value_type::value, 0, 8, "big", big);
+        log.log(value_type::value, 0, 9, "after", "big");
+        log.log(value_type::value, 0, 10, "tail", "last");
+        log.sync();
+        std::filesystem::copy_file(log.logfile, logged);
+    }
+
+    size_t const size = std::filesystem::file_size(logged);
+    expect(size > 3 * 32_KiB && size < 4 * 32_KiB, "the big record spans four blocks");
+
+    auto const value_of = [](memtable::table const & table, std::string_view key) -> std::optional<std::string> {
+        std::vector<std::byte> data{};
+        if (table.get(key, memtable::table::hash(key), data) != memtable::lookup::found) { return {}; }
+        return std::string(reinterpret_cast<char const *>(data.data()), data.size());
+    };
+
+    // recovers a copy of the log, damaged by "damage", into a new table
+    auto const recover = [&](auto && damage, memtable::table & table) {
+        std::filesystem::path const copy = dir / ("copy" + WAL::walfile::FILE_EXT);
+        std::filesystem::copy_file(logged, copy, std::filesystem::copy_options::overwrite_existing);
+        damage(copy);
+        sequence_t const largest = WAL::walfile::load({&copy, 1}, [&](std::string_view name) { return name == "default" ? &table : nullptr; });
+        std::filesystem::remove(copy);
+        return largest;
+    };
+
+    memtable::table::config_opts const opts{.writes_before_lock = 1000};
+    {
+        memtable::skiptable table{opts};
+        expect(recover([](auto const &) {}, table) == 10, "every sequence recovered");
+        expect(value_of(table, newline_key) == newline_value, "newlines in keys and values");
+        expect(value_of(table, "\n") == "\n", "a key of only a newline");
+        expect(!value_of(table, "removed") && table.find("removed"), "the deletion hides the value");
+        expect(value_of(table, "batch/a") == "1" && value_of(table, "batch/b\n") == "2\n" && table.find("batch/c"), "the batch");
+        expect(value_of(table, "big") == big, "the record split across blocks");
+        expect(value_of(table, "after") == "big" && value_of(table, "tail") == "last", "the records after the split one");
+    }
+
+    {
+        // a crash while writing the last block leaves its final fragment torn
+        memtable::skiptable table{opts};
+        sequence_t const largest = recover([&](auto const & path) { std::filesystem::resize_file(path, size - 3); }, table);
+        expect(largest == 9, "the torn record is dropped");
+        expect(!table.find("tail"), "the torn record is not applied");
+        expect(value_of(table, "big") == big && value_of(table, "after") == "big", "the records before the torn one");
+    }
+
+    {
+        // a corrupt block drops the rest of the block, and the record that continues from it into the next
+        memtable::skiptable table{opts};
+        recover([](auto const & path) {
+            std::fstream file{path, std::ios::in | std::ios::out | std::ios::binary};
+            file.seekp(32_KiB + 100);
+            file.put('!');
+        }, table);
+
+        expect(!table.find("big"), "the corrupt split record is dropped");
+        expect(value_of(table, newline_key) == newline_value && value_of(table, "batch/a") == "1", "the records before the corrupt block");
+        expect(value_of(table, "after") == "big" && value_of(table, "tail") == "last", "recovery resumes after the corrupt block");
+    }
+
+    {
+        // a batch torn part way is applied not at all
+        memtable::skiptable table{opts};
+        recover([&](auto const & path) {
+            std::ifstream in{path, std::ios::binary};
+            std::string const contents{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+            std::filesystem::resize_file(path, contents.find("batch/b\n"));
+        }, table);
+
+        expect(value_of(table, "\n") == "\n", "the records before the batch");
+        expect(!table.find("batch/a") && !table.find("batch/c"), "no write of the torn batch");
+    }
+
+    std::filesystem::remove_all(dir);
+    return failures == 0 ? 0 : 1;
+}
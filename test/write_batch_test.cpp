@@ -0,0 +1,141 @@
+#include <kvstore.h>
+#include <iostream>
+#include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace KVSTORE_NS;
+
+// Write batches spanning two column families are read all or nothing, while concurrent writes rotate the memtables under them
+// and batches larger than a memtable are written, and are recovered whole from the log after a crash.
+int main()
+{
+    int failures{};
+    auto const expect = [&](bool ok, std::string_view what) {
+        if (!ok)
+        {
+            std::cerr << "FAILED: " << what << std::endl;
+            failures += 1;
+        }
+    };
+
+    std::filesystem::path const dir = std::filesystem::temp_directory_path() / "kvstore_write_batch_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    // small memtables, so that batches are written across rotations and flushes
+    kvstore::config_options opts{};
+    opts.memtable_options.writes_before_lock = 64;
+    opts.sst_options.base_dir = dir;
+    opts.wal_options.base_dir = dir;
+    kvstore::family_options meta{};
+    meta.name = "meta";
+    meta.memtable_options.writes_before_lock = 64;
+    meta.sst_options.base_dir = dir / "meta";
+    opts.column_families.push_back(meta);
+
+    constexpr size_t KEYS = 20;
+    auto const key_of = [](size_t writer, size_t i) { return "account/" + std::to_string(writer) + "/" + std::to_string(i); };
+    auto const string_of = [](std::vector<std::byte> const & data) { return std::string(reinterpret_cast<char const *>(data.data()), data.size()); };
+
+    // writes round "round" of "writer" as one batch: every key of the writer and its counter in "meta" take the round's value,
+    // and the marker of the previous round is removed. Every tenth batch is larger than a memtable.
+    auto const write_round = [&](kvstore & store, size_t writer, size_t round, std::optional<WAL::durability> d = {}) {
+        uint32_t const meta_id = store.family("meta")->id();
+        std::string const value = std::to_string(round);
+        write_batch batch{};
+        size_t const keys = round % 10 == 0 ? 4 * KEYS * 10 : KEYS;
+        for (size_t i = 0; i < keys; i++) { batch.put(key_of(writer, i % (KEYS * 10)), value.data(), value.size()); }
+        batch.put(meta_id, "round/" + std::to_string(writer), value.data(), value.size());
+        batch.put("marker/" + std::to_string(writer) + "/" + value, value.data(), value.size());
+        if (round > 0) { batch.remove("marker/" + std::to_string(writer) + "/" + std::to_string(round - 1)); }
+        store.write(batch, d);
+    };
+
+    // true if the writer's keys, counter and marker all show the same round, read at "at"
+    auto const consistent = [&](kvstore & store, size_t writer, kvstore::snapshot const * at) {
+        std::vector<std::byte> data{};
+        if (!store.get(*store.family("meta"), "round/" + std::to_string(writer), data, at)) { return true; }
+        std::string const round = string_of(data);
+        for (size_t i = 0; i < KEYS; i++)
+        {
+            if (!store.get(key_of(writer, i), data, at) || string_of(data) != round) { return false; }
+        }
+
+        if (!store.get("marker/" + std::to_string(writer) + "/" + round, data, at)) { return false; }
+        return round == "0" || !store.get("marker/" + std::to_string(writer) + "/" + std::to_string(std::stoul(round) - 1), data, at);
+    };
+
+    // recovery: a process writing batches crashes, without closing the store. Each batch was written to the log before returning.
+    constexpr size_t CRASH_ROUNDS = 50;
+    pid_t const child = fork();
+    if (child == 0)
+    {
+        kvstore store{opts};
+        for (size_t round = 0; round < CRASH_ROUNDS; round++) { write_round(store, 0, round, WAL::durability::buffered); }
+        _exit(0);
+    }
+
+    int status{};
+    waitpid(child, &status, 0);
+    expect(WIFEXITED(status) && WEXITSTATUS(status) == 0, "the writing process ran");
+
+    {
+        kvstore store{opts};
+        std::vector<std::byte> data{};
+        expect(store.get(*store.family("meta"), "round/0", data) && string_of(data) == std::to_string(CRASH_ROUNDS - 1), "every batch recovered");
+        expect(consistent(store, 0, nullptr), "recovered batches are whole");
+    }
+
+    // atomicity: readers at a snapshot see each writer's batches whole, while plain puts fill the memtables alongside them
+    {
+        kvstore store{opts};
+        constexpr size_t WRITERS = 2;
+        constexpr size_t ROUNDS = 300;
+        std::atomic_bool done{};
+        std::atomic_size_t torn{};
+
+        std::vector<std::thread> threads{};
+        for (size_t w = 0; w < WRITERS; w++)
+        {
+            threads.emplace_back([&, w] {
+                for (size_t round = 0; round < ROUNDS; round++) { write_round(store, w + 1, round); }
+            });
+        }
+
+        threads.emplace_back([&] {
+            for (size_t i = 0; i < 20 * ROUNDS; i++)
+            {
+                std::string const key = "filler/" + std::to_string(i);
+                store.put(key, const_cast<char *>(key.data()), key.size());
+            }
+        });
+
+        std::thread reader{[&] {
+            while (!done)
+            {
+                for (size_t w = 0; w < WRITERS; w++)
+                {
+                    kvstore::snapshot const at{store};
+                    if (!consistent(store, w + 1, &at)) { torn += 1; }
+                }
+            }
+        }};
+
+        for (std::thread & t : threads) { t.join(); }
+        done = true;
+        reader.join();
+
+        expect(torn == 0, "no batch read in part");
+        for (size_t w = 0; w < WRITERS; w++)
+        {
+            std::vector<std::byte> data{};
+            expect(store.get(*store.family("meta"), "round/" + std::to_string(w + 1), data) && string_of(data) == std::to_string(ROUNDS - 1),
+                   "the last batch of each writer");
+            expect(consistent(store, w + 1, nullptr), "the final state is whole");
+        }
+    }
+
+    std::filesystem::remove_all(dir);
+    return failures == 0 ? 0 : 1;
+}